@@ -30,6 +30,11 @@
 #ifndef AA_H
 #define AA_H
 
+#if defined(AA_WAL) && !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+/* fileno, fsync and open are POSIX, strict -std modes only declare them when asked */
+#define _POSIX_C_SOURCE 200809L
+#endif /* AA_WAL && !_WIN32 && !_POSIX_C_SOURCE */
+
 #include <assert.h>
 #include <limits.h>
 #include <stdarg.h>
@@ -40,6 +45,44 @@
 
 #include "alloc.h"
 
+#ifdef AA_COW
+#include <stdatomic.h>
+#endif /* AA_COW */
+
+#ifdef AA_PARALLEL
+#include <stdatomic.h>
+#include <threads.h>
+#endif /* AA_PARALLEL */
+
+#ifdef AA_TRACE
+#include <stdio.h>
+#include <time.h>
+#endif /* AA_TRACE */
+
+#ifdef AA_SPILL
+#include <stdio.h>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif /* _WIN32 */
+#endif /* AA_SPILL */
+
+#if defined(AA_SMALL) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif /* AA_SMALL && __SSE2__ */
+
+#ifdef AA_WAL
+#include <stdio.h>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif /* _WIN32 */
+#endif /* AA_WAL */
+
 #ifndef SIZE_WIDTH
 #if defined(_WIN32) && !defined(__WORDSIZE)
 #ifdef _WIN64
@@ -70,6 +113,12 @@ enum {
 
     AA_INIT_NUM_BUCKETS = 8,
 
+    /* Share of their range the integer keys fill to be indexed directly (AA_DENSE) */
+    AA_DENSE_NUM = 1,
+    AA_DENSE_DEN = 2,
+    /* Fewer entries stay hashed */
+    AA_DENSE_MIN = 64,
+
     /* Magic hash constants to distinguish empty, deleted, and filled buckets */
     AA_HASH_EMPTY = 0,
     AA_HASH_DELETED = 1,
@@ -106,12 +155,151 @@ struct aa_bucket {
     struct aa_node *entry;
 };
 
+#if defined(AA_COMPACT) + defined(AA_CUCKOO) + defined(AA_COW) > 1
+#error "AA_COMPACT, AA_CUCKOO and AA_COW are mutually exclusive"
+#endif /* AA_COMPACT + AA_CUCKOO + AA_COW */
+
+/**
+ * @brief Forward declaration of the aa_entry structure (compact layout)
+ */
+struct aa_entry;
+
+/**
+ * @brief Forward declaration of the aa_page structure (copy-on-write layout)
+ */
+struct aa_page;
+
+#ifdef AA_TTL
+/**
+ * @brief Geometry of the timer wheel: 4 levels of 64 slots cover 2^24 ticks
+ */
+enum {
+    AA_WHEEL_BITS = 6,
+    AA_WHEEL_SLOTS = 1 << AA_WHEEL_BITS,
+    AA_WHEEL_LEVELS = 4,
+};
+
+/**
+ * @brief Forward declaration of the aa_timer structure
+ */
+struct aa_timer;
+#endif /* AA_TTL */
+
+#ifdef AA_MULTI
+/**
+ * @brief Forward declaration of the aa_span structure (the values of a multimap key)
+ */
+struct aa_span;
+
+/**
+ * @brief Forward declaration of the aa_chunk structure (pooled multimap values)
+ */
+struct aa_chunk;
+
+/**
+ * @brief Chunks of 1, 2, 4 ... 2^15 values are recycled through per-size free lists
+ */
+enum {
+    AA_MULTI_CLASSES = 16,
+};
+#endif /* AA_MULTI */
+
+#ifdef AA_KEY_POOL
+/**
+ * @brief Forward declaration of the aa_key_pool structure (shared string key storage)
+ */
+struct aa_key_pool;
+
+/**
+ * @brief Occupancy of a key pool
+ */
+struct aa_key_pool_stats {
+    size_t keys, bytes, capacity;
+};
+#endif /* AA_KEY_POOL */
+
+#ifdef AA_SMALL
+#ifndef AA_SMALL_N
+#define AA_SMALL_N 8
+#endif /* AA_SMALL_N */
+
+#if AA_SMALL_N < 4 || AA_SMALL_N > 32 || (AA_SMALL_N & (AA_SMALL_N - 1))
+#error "AA_SMALL_N must be a power of two from 4 to 32"
+#endif /* AA_SMALL_N */
+#endif /* AA_SMALL */
+
+#ifdef AA_CACHE
+/**
+ * @brief Counters of a capped hash table
+ */
+struct aa_cache_stats {
+    size_t hits, misses, evictions;
+};
+#endif /* AA_CACHE */
+
 /**
  * @brief Structure representing the hash table
  */
 struct aa {
+#if defined(AA_COMPACT)
+    void *index;
+    struct aa_entry *entries;
+    size_t dim;
+#elif defined(AA_CUCKOO)
+    struct aa_bucket *buckets;
+    void *block;
+    size_t dim;
+#elif defined(AA_COW)
+    struct aa_page **pages;
+    size_t dim;
+#else
     struct aa_bucket *buckets;
+#endif /* AA_COMPACT */
     size_t used, deleted;
+#ifdef AA_TRACE
+    FILE *trace;
+    uint64_t trace_time;
+#endif /* AA_TRACE */
+#ifdef AA_WAL
+    FILE *wal;
+    char *wal_path;
+    size_t wal_sync, wal_pending, wal_records;
+#endif /* AA_WAL */
+#ifdef AA_CACHE
+    size_t capacity, hand;
+    void (*on_evict)(struct aa_node *, void *);
+    void *evict_ctx;
+    struct aa_cache_stats stats;
+#endif /* AA_CACHE */
+#ifdef AA_TTL
+    struct aa_timer **wheel, *due;
+    size_t wheel_count[AA_WHEEL_LEVELS];
+    uint64_t now, tick; /* tick is where the wheel stands, at most now */
+#endif /* AA_TTL */
+#ifdef AA_BLOOM
+    uint64_t *bloom;
+    size_t bloom_words, bloom_dim, bloom_stale;
+#endif /* AA_BLOOM */
+#ifdef AA_MULTI
+    struct aa_chunk *pool[AA_MULTI_CLASSES];
+    void *slabs;
+    size_t slab_used;
+#endif /* AA_MULTI */
+#ifdef AA_KEY_POOL
+    struct aa_key_pool *key_pool;
+#endif /* AA_KEY_POOL */
+#ifdef AA_SMALL
+    /* Until the first resize, up to AA_SMALL_N nodes live in the table itself */
+    uint32_t small_tags[AA_SMALL_N];
+    uint32_t small_mask;
+    max_align_t small[];
+#endif /* AA_SMALL */
+#ifdef AA_DENSE
+    /* Integer keys filling their range index the nodes directly, from dense_base */
+    struct aa_node *dense;
+    uint64_t *present;
+    size_t dense_base, key_lo, key_hi;
+#endif /* AA_DENSE */
 };
 
 /**
@@ -128,6 +316,63 @@ extern struct aa *aa_new(void);
  */
 extern void aa_delete(struct aa *);
 
+#if defined(AA_MULTI)
+/**
+ * @brief Appends a value to the values of a key in the multimap
+ *
+ * @param aa A pointer to the multimap
+ * @param key The key to be added to
+ * @param value The value to be appended
+ * @return 0 on success, -1 on failure
+ */
+#ifdef _WIN32
+#define aa_add(aa, key, value) aa_x_add(aa, 2, key, value)
+#else
+#define aa_add(aa, key, value) aa_x_add(aa, key, value)
+#endif /* _WIN32 */
+
+/**
+ * @brief Gets all values of a key, contiguous and in insertion order
+ *
+ * The span stays valid until the key is next added to or removed from.
+ *
+ * @param aa A pointer to the multimap
+ * @param key The key whose values are to be retrieved
+ * @return A struct aa_span with the values in data and their number in len, empty for a missing key
+ */
+#ifdef _WIN32
+#define aa_get_all(aa, key) aa_x_get_all(aa, 1, key)
+#else
+#define aa_get_all(aa, key) aa_x_get_all(aa, key)
+#endif /* _WIN32 */
+
+/**
+ * @brief Counts the values of a key
+ *
+ * @param aa A pointer to the multimap
+ * @param key The key whose values are to be counted
+ * @return The number of values, 0 for a missing key
+ */
+#ifdef _WIN32
+#define aa_count(aa, key) aa_x_count(aa, 1, key)
+#else
+#define aa_count(aa, key) aa_x_count(aa, key)
+#endif /* _WIN32 */
+
+/**
+ * @brief Removes the first occurrence of a value from a key, and the key with its last value
+ *
+ * @param aa A pointer to the multimap
+ * @param key The key to be removed from
+ * @param value The value to be removed
+ * @return 0 on success, -1 if the key does not hold the value
+ */
+#ifdef _WIN32
+#define aa_remove_one(aa, key, value) aa_x_remove_one(aa, 2, key, value)
+#else
+#define aa_remove_one(aa, key, value) aa_x_remove_one(aa, key, value)
+#endif /* _WIN32 */
+#elif !defined(AA_SET)
 /**
  * @brief Sets a key-value pair in the hash table
  *
@@ -155,6 +400,33 @@ extern void aa_delete(struct aa *);
 #else
 #define aa_get(aa, key, value) aa_x_get(aa, key, IS_POINTER(value) ? value : (typeof_unqual(value))NULL)
 #endif /* _WIN32 */
+#else
+/**
+ * @brief Inserts a key into the hash set
+ *
+ * @param aa A pointer to the hash set
+ * @param key The key to be inserted
+ * @return 0 if the key was inserted, 1 if it was already present, -1 on failure
+ */
+#ifdef _WIN32
+#define aa_insert(aa, key) aa_x_insert(aa, 1, key)
+#else
+#define aa_insert(aa, key) aa_x_insert(aa, key)
+#endif /* _WIN32 */
+
+/**
+ * @brief Checks whether a key is present in the hash set
+ *
+ * @param aa A pointer to the hash set
+ * @param key The key to be looked up
+ * @return true if the key is present, false otherwise
+ */
+#ifdef _WIN32
+#define aa_contains(aa, key) aa_x_contains(aa, 1, key)
+#else
+#define aa_contains(aa, key) aa_x_contains(aa, key)
+#endif /* _WIN32 */
+#endif /* AA_SET */
 
 /**
  * @brief Removes a key-value pair from the hash table
@@ -169,6 +441,118 @@ extern void aa_delete(struct aa *);
 #define aa_remove(aa, key) aa_x_remove(aa, key)
 #endif /* _WIN32 */
 
+/**
+ * @brief Computes the hash of a key as stored in the hash table
+ *
+ * The result can be cached next to the key and passed to the *_hashed
+ * functions below, which then skip hashing entirely.
+ *
+ * @param key The key to be hashed
+ * @return The hash of the key
+ */
+#ifdef _WIN32
+#define aa_hash_key(key) aa_x_hash_key(1, key)
+#else
+#define aa_hash_key(key) aa_x_hash_key(key)
+#endif /* _WIN32 */
+
+#if !defined(AA_SET) && !defined(AA_MULTI)
+/**
+ * @brief Sets a key-value pair in the hash table using a precomputed hash
+ *
+ * @param aa A pointer to the hash table
+ * @param hash The hash of the key as returned by aa_hash_key
+ * @param key The key to be set
+ * @param value The value to be associated with the key
+ * @return 0 on success, -1 on failure
+ */
+#ifdef _WIN32
+#define aa_set_hashed(aa, hash, key, value) aa_x_set_hashed(aa, hash, 2, key, value)
+#else
+#define aa_set_hashed(aa, hash, key, value) aa_x_set_hashed(aa, hash, key, value)
+#endif /* _WIN32 */
+
+#ifdef AA_TTL
+/**
+ * @brief Sets a key-value pair that expires ttl ticks after the table's current time
+ *
+ * The current time is the last one passed to aa_expire, in whatever unit the
+ * caller uses. Setting the key again moves its expiration, without a TTL it
+ * makes the entry permanent.
+ *
+ * @param aa A pointer to the hash table
+ * @param key The key to be set
+ * @param value The value to be associated with the key
+ * @param ttl The lifetime of the entry, at least 1
+ * @return 0 on success, -1 on failure
+ */
+#ifdef _WIN32
+#define aa_set_ttl(aa, key, value, ttl) aa_x_set_ttl(aa, ttl, 2, key, value)
+#else
+#define aa_set_ttl(aa, key, value, ttl) aa_x_set_ttl(aa, ttl, key, value)
+#endif /* _WIN32 */
+#endif /* AA_TTL */
+
+/**
+ * @brief Gets the value associated with a key using a precomputed hash
+ *
+ * @param aa A pointer to the hash table
+ * @param hash The hash of the key as returned by aa_hash_key
+ * @param key The key whose value is to be retrieved
+ * @param value A pointer to the variable where the value will be stored
+ * @return 0 on success, -1 on failure
+ */
+#ifdef _WIN32
+#define aa_get_hashed(aa, hash, key, value)                                                                            \
+    aa_x_get_hashed(aa, hash, 2, key, IS_POINTER(value) ? value : (typeof_unqual(value))NULL)
+#else
+#define aa_get_hashed(aa, hash, key, value)                                                                            \
+    aa_x_get_hashed(aa, hash, key, IS_POINTER(value) ? value : (typeof_unqual(value))NULL)
+#endif /* _WIN32 */
+#elif defined(AA_SET)
+/**
+ * @brief Inserts a key into the hash set using a precomputed hash
+ *
+ * @param aa A pointer to the hash set
+ * @param hash The hash of the key as returned by aa_hash_key
+ * @param key The key to be inserted
+ * @return 0 if the key was inserted, 1 if it was already present, -1 on failure
+ */
+#ifdef _WIN32
+#define aa_insert_hashed(aa, hash, key) aa_x_insert_hashed(aa, hash, 1, key)
+#else
+#define aa_insert_hashed(aa, hash, key) aa_x_insert_hashed(aa, hash, key)
+#endif /* _WIN32 */
+
+/**
+ * @brief Checks whether a key is present in the hash set using a precomputed hash
+ *
+ * @param aa A pointer to the hash set
+ * @param hash The hash of the key as returned by aa_hash_key
+ * @param key The key to be looked up
+ * @return true if the key is present, false otherwise
+ */
+#ifdef _WIN32
+#define aa_contains_hashed(aa, hash, key) aa_x_contains_hashed(aa, hash, 1, key)
+#else
+#define aa_contains_hashed(aa, hash, key) aa_x_contains_hashed(aa, hash, key)
+#endif /* _WIN32 */
+#endif /* AA_SET */
+
+/**
+ * @brief Removes a key-value pair from the hash table using a precomputed hash
+ *
+ * @param aa A pointer to the hash table
+ * @param hash The hash of the key as returned by aa_hash_key
+ * @param key The key to be removed
+ * @return 0 on success, -1 on failure
+ */
+#ifdef _WIN32
+#define aa_remove_hashed(aa, hash, key) aa_x_remove_hashed(aa, hash, 1, key)
+#else
+#define aa_remove_hashed(aa, hash, key) aa_x_remove_hashed(aa, hash, key)
+#endif /* _WIN32 */
+
 /**
  * @brief Rehashes the hash table to a new size
  *
@@ -208,311 +592,5530 @@ extern size_t aa_entries(struct aa *);
  */
 extern struct aa_node *aa_next(struct aa *);
 
-extern int aa_x_set(struct aa *,
-#ifdef _WIN32
-                    size_t,
-#endif /* _WIN32 */
-                    ...);
-extern int aa_x_get(struct aa *,
-#ifdef _WIN32
-                    size_t,
-#endif /* _WIN32 */
-                    ...);
-extern int aa_x_remove(struct aa *,
-#ifdef _WIN32
-                       size_t,
-#endif /* _WIN32 */
-                       ...);
-
-#endif /* AA_H */
-
-#ifdef AA_IMPLEMENTATION
-
-#ifndef AA_KEY
-#error "Please define AA_KEY type"
-#endif /* AA_KEY */
+/**
+ * @brief Removes every entry for which the predicate returns true
+ *
+ * The table is swept once and resized at most once at the end, so the
+ * predicate sees every entry exactly once.
+ *
+ * @param aa A pointer to the hash table
+ * @param predicate A function called for every entry with the user context
+ * @param ctx A user context passed to the predicate
+ * @return The number of removed entries
+ */
+extern size_t aa_remove_if(struct aa *, bool (*)(struct aa_node *, void *), void *);
 
-#ifndef AA_VALUE
-#error "Please define AA_VALUE type"
-#endif /* AA_VALUE */
+/**
+ * @brief Keeps only the entries for which the predicate returns true
+ *
+ * @param aa A pointer to the hash table
+ * @param predicate A function called for every entry with the user context
+ * @param ctx A user context passed to the predicate
+ * @return The number of removed entries
+ */
+extern size_t aa_retain_if(struct aa *, bool (*)(struct aa_node *, void *), void *);
 
-#if __STDC_VERSION__ >= 202311L
-typedef typeof_unqual(AA_KEY) aa_key_t;
-typedef typeof_unqual(AA_VALUE) aa_value_t;
-#if (__linux__)
-#include <stdbit.h>
-#endif /* __linux__ */
-#else
-#error "C23 or later required"
-#endif /* __STDC_VERSION__ */
+#ifdef AA_TRACE
+#ifndef AA_TRACE_KEY_MAX
+#define AA_TRACE_KEY_MAX 256
+#endif /* AA_TRACE_KEY_MAX */
 
-struct aa_node {
-    aa_key_t key;
-    aa_value_t value;
+/**
+ * @brief Operations recorded in a trace
+ */
+enum aa_trace_op {
+    AA_TRACE_SET = 1,
+    AA_TRACE_GET,
+    AA_TRACE_REMOVE,
 };
 
-static int aa_alloc_htable(struct aa *a, size_t s) {
-    if (!a || s == 0)
-        return -1;
+/**
+ * @brief One decoded trace record
+ *
+ * Start with a zeroed record and pass the same one to every aa_trace_read,
+ * timestamps are stored as deltas and accumulated in place.
+ */
+struct aa_trace_record {
+    uint64_t time;
+    uint64_t hash;
+    enum aa_trace_op op;
+    size_t key_len;
+    unsigned char key[AA_TRACE_KEY_MAX + 1];
+};
 
-    struct aa_bucket *_Htable = (struct aa_bucket *)fat_malloc(sizeof(struct aa_bucket) * s);
-    if (!_Htable)
-        return -1;
-    a->buckets = _Htable;
+/**
+ * @brief Starts or stops recording every set/get/remove on a hash table
+ *
+ * Each operation is appended to the stream as the operation, the time since
+ * the previous record in nanoseconds, the stored hash and the key bytes
+ * (the string for pointer keys). Keys longer than AA_TRACE_KEY_MAX are cut.
+ *
+ * @param aa A pointer to the hash table
+ * @param out An open binary stream, or NULL to stop recording
+ * @return 0 on success, -1 on failure
+ */
+extern int aa_trace(struct aa *, FILE *);
 
-    return 0;
-}
+/**
+ * @brief Reads the next record of a trace written by aa_trace
+ *
+ * @param in An open binary stream positioned at a record or at the trace header
+ * @param record A pointer to the record to be filled in
+ * @return 0 on success, -1 at the end of the trace or on a malformed record
+ */
+extern int aa_trace_read(FILE *, struct aa_trace_record *);
+#endif /* AA_TRACE */
 
-static int aa_init_table_if_needed(struct aa *a) {
-    if (!a)
-        return -1;
+#ifdef AA_COW
+/**
+ * @brief Creates a copy-on-write clone of a hash table
+ *
+ * The clone shares every bucket page and node with the original, so it
+ * costs one pointer per page. Whichever table writes to a shared page or
+ * node copies it first. Take the clone where the original is written;
+ * another thread may then read it with calls that do not allocate or free,
+ * such as aa_get, while the original is written. Writing to the clone and
+ * deleting it stay on the writer's thread, as _Allocated_memory is not
+ * atomic. Entries returned by aa_next are read-only.
+ *
+ * @param aa A pointer to the hash table
+ * @return A pointer to the clone, or NULL if the allocation fails
+ */
+extern struct aa *aa_clone(struct aa *);
+#endif /* AA_COW */
 
-    if (!a->buckets)
-        if (aa_alloc_htable(a, AA_INIT_NUM_BUCKETS) != 0)
-            return -1;
+#ifdef AA_TTL
+/**
+ * @brief Advances the table's clock and removes the entries that are due
+ *
+ * Entries read as misses as soon as their time has come, the removal itself
+ * is spread over calls: at most budget due entries are removed per call, and
+ * the wheel only moves as far as they need, the rest wait for the next one.
+ * The work grows with the number of expirations, not with the size of the
+ * table.
+ *
+ * @param aa A pointer to the hash table
+ * @param now The current time, it never moves backwards
+ * @param budget The maximum number of due entries to remove
+ * @return The number of removed entries
+ */
+extern size_t aa_expire(struct aa *, uint64_t, size_t);
+#endif /* AA_TTL */
 
-    return 0;
-}
+#ifdef AA_CACHE
+/**
+ * @brief Caps the number of entries, evicting with the CLOCK algorithm
+ *
+ * Once the table holds capacity entries, adding a new key evicts one that
+ * was not read or written since the clock hand last passed it. Entries
+ * above a lowered capacity are evicted right away.
+ *
+ * @param aa A pointer to the hash table
+ * @param capacity The maximum number of entries, 0 for no limit
+ * @param on_evict A function called with every evicted entry before it is freed, or NULL
+ * @param ctx A user context passed to on_evict
+ * @return 0 on success, -1 on failure
+ */
+extern int aa_set_capacity(struct aa *, size_t, void (*)(struct aa_node *, void *), void *);
+
+/**
+ * @brief Gets the hit, miss and eviction counters of a capped hash table
+ *
+ * @param aa A pointer to the hash table
+ * @return The counters, all zero for an invalid table
+ */
+extern struct aa_cache_stats aa_cache_stats(struct aa *);
+#endif /* AA_CACHE */
+
+#ifdef AA_WAL
+/**
+ * @brief Durability levels for aa_wal_open, any other value is a group commit size
+ */
+enum {
+    AA_WAL_NO_SYNC = 0, /* Leave flushing to the OS */
+    AA_WAL_SYNC_ALL = 1, /* fsync after every operation */
+};
+
+/**
+ * @brief Makes a hash table persistent through a write-ahead log
+ *
+ * The snapshot at "<path>.snap" and the log at path are replayed into the
+ * table first, a torn record at the end of the log is dropped. From then on
+ * every set/remove is appended to the log before the call returns, and the
+ * log is synced every sync_every operations (group commit).
+ *
+ * Keys and values are written as bytes (the string for pointer keys),
+ * so values must not point to memory.
+ *
+ * @param aa A pointer to the hash table
+ * @param path The path of the log file
+ * @param sync_every AA_WAL_NO_SYNC, AA_WAL_SYNC_ALL or the number of operations per fsync
+ * @return 0 on success, -1 on failure
+ */
+extern int aa_wal_open(struct aa *, const char *, size_t);
+
+/**
+ * @brief Flushes and syncs the pending log records
+ *
+ * @param aa A pointer to the hash table
+ * @return 0 on success, -1 on failure
+ */
+extern int aa_wal_sync(struct aa *);
+
+/**
+ * @brief Writes a fresh snapshot of the table and truncates the log
+ *
+ * Called automatically once the log outgrows the table. aa_clear is not
+ * logged, call this after it to make the clear durable.
+ *
+ * @param aa A pointer to the hash table
+ * @return 0 on success, -1 on failure
+ */
+extern int aa_wal_checkpoint(struct aa *);
+
+/**
+ * @brief Syncs and closes the log, the table stays in memory
+ *
+ * @param aa A pointer to the hash table
+ * @return 0 on success, -1 on failure
+ */
+extern int aa_wal_close(struct aa *);
+#endif /* AA_WAL */
+
+#ifdef AA_KEY_POOL
+/**
+ * @brief Creates an empty key pool that hash tables can share
+ *
+ * @return A pointer to the pool, or NULL if the allocation fails
+ */
+extern struct aa_key_pool *aa_key_pool_new(void);
+
+/**
+ * @brief Drops the caller's reference, the pool is freed with its last table
+ *
+ * @param pool A pointer to the key pool
+ */
+extern void aa_key_pool_release(struct aa_key_pool *);
+
+/**
+ * @brief Stores the keys of an empty hash table in a shared pool
+ *
+ * Tables without one get a private pool on their first insert, which stores
+ * the bytes of each key alone. A shared pool stores identical keys of all its
+ * tables once. The tables must come from the same instantiation.
+ *
+ * @param aa A pointer to the empty hash table
+ * @param pool A pointer to the key pool
+ * @return 0 on success, -1 on failure
+ */
+extern int aa_set_key_pool(struct aa *, struct aa_key_pool *);
+
+/**
+ * @brief Moves the live keys to fresh pages and frees the old ones
+ *
+ * Keys move, so pointers taken from node keys are invalid afterwards.
+ *
+ * @param pool A pointer to the key pool
+ * @return 0 on success, -1 on failure
+ */
+extern int aa_key_pool_compact(struct aa_key_pool *);
+
+/**
+ * @brief Counts the live keys and bytes of a key pool
+ *
+ * @param pool A pointer to the key pool
+ * @return The live keys, their bytes with headers and the bytes held in pages and index
+ */
+extern struct aa_key_pool_stats aa_key_pool_stats(struct aa_key_pool *);
+#endif /* AA_KEY_POOL */
+
+#ifdef AA_SPILL
+/**
+ * @brief Forward declaration of the aa_spill structure (a table partitioned over memory and disk)
+ */
+struct aa_spill;
+
+/**
+ * @brief Creates a table split by hash into partitions that spill to disk
+ *
+ * Keys go to partitions by the high bits of their hash. Once the partitions
+ * in memory take more than budget bytes of _Allocated_memory, the least
+ * recently used ones are written to files in dir and freed, and read back
+ * when a key in them is next used. Keys and values are written as bytes
+ * (the string for pointer keys), so values must not point to memory.
+ *
+ * @param dir An existing directory for the spill files
+ * @param partitions The number of partitions, rounded up to a power of two
+ * @param budget The memory budget in bytes, 0 for no limit
+ * @return A pointer to the table, or NULL on failure
+ */
+extern struct aa_spill *aa_spill_new(const char *, size_t, size_t);
+
+/**
+ * @brief Deletes a spilling table, its partitions and its spill files
+ *
+ * @param spill A pointer to the spilling table
+ */
+extern void aa_spill_delete(struct aa_spill *);
+
+/**
+ * @brief Gets the number of entries in memory and on disk
+ *
+ * @param spill A pointer to the spilling table
+ * @return The number of entries
+ */
+extern size_t aa_spill_len(struct aa_spill *);
+
+/**
+ * @brief Sets a key-value pair, loading its partition if needed
+ *
+ * @param spill A pointer to the spilling table
+ * @param key The key to be set
+ * @param value The value to be associated with the key
+ * @return 0 on success, -1 on failure
+ */
+#ifdef _WIN32
+#define aa_spill_set(spill, key, value) aa_x_spill_set(spill, 2, key, value)
+#else
+#define aa_spill_set(spill, key, value) aa_x_spill_set(spill, key, value)
+#endif /* _WIN32 */
+
+/**
+ * @brief Gets the value of a key, loading its partition if needed
+ *
+ * @param spill A pointer to the spilling table
+ * @param key The key whose value is to be retrieved
+ * @param value A pointer to the variable where the value will be stored
+ * @return 0 on success, -1 on failure
+ */
+#ifdef _WIN32
+#define aa_spill_get(spill, key, value)                                                                                \
+    aa_x_spill_get(spill, 2, key, IS_POINTER(value) ? value : (typeof_unqual(value))NULL)
+#else
+#define aa_spill_get(spill, key, value)                                                                                \
+    aa_x_spill_get(spill, key, IS_POINTER(value) ? value : (typeof_unqual(value))NULL)
+#endif /* _WIN32 */
+
+/**
+ * @brief Removes a key, loading its partition if needed
+ *
+ * @param spill A pointer to the spilling table
+ * @param key The key to be removed
+ * @return 0 on success, -1 on failure
+ */
+#ifdef _WIN32
+#define aa_spill_remove(spill, key) aa_x_spill_remove(spill, 1, key)
+#else
+#define aa_spill_remove(spill, key) aa_x_spill_remove(spill, key)
+#endif /* _WIN32 */
+
+/**
+ * @brief Looks up many keys, grouped by partition
+ *
+ * Partitions in memory are served first, then every spilled partition
+ * with a pending key is read back once, in one sequential pass.
+ *
+ * @param spill A pointer to the spilling table
+ * @param keys An array of n keys
+ * @param n The number of keys
+ * @param values An array of n values receiving the values found, or NULL
+ * @param found An array of n flags set to whether each key was found, or NULL
+ * @return The number of keys found, or SIZE_MAX on failure
+ */
+#ifdef _WIN32
+#define aa_spill_get_batch(spill, keys, n, values, found) aa_x_spill_get_batch(spill, n, found, 2, keys, values)
+#else
+#define aa_spill_get_batch(spill, keys, n, values, found) aa_x_spill_get_batch(spill, n, found, keys, values)
+#endif /* _WIN32 */
+
+extern int aa_x_spill_set(struct aa_spill *,
+#ifdef _WIN32
+                          size_t,
+#endif /* _WIN32 */
+                          ...);
+extern int aa_x_spill_get(struct aa_spill *,
+#ifdef _WIN32
+                          size_t,
+#endif /* _WIN32 */
+                          ...);
+extern int aa_x_spill_remove(struct aa_spill *,
+#ifdef _WIN32
+                             size_t,
+#endif /* _WIN32 */
+                             ...);
+extern size_t aa_x_spill_get_batch(struct aa_spill *, size_t, bool *,
+#ifdef _WIN32
+                                   size_t,
+#endif /* _WIN32 */
+                                   ...);
+#endif /* AA_SPILL */
+
+#ifdef AA_PARALLEL
+/**
+ * @brief Calls a function for every entry, spreading the buckets over threads
+ *
+ * The calling thread takes part, the others are started for the call and
+ * joined before it returns. Buckets are handed out in chunks, so threads
+ * that finish early take over the rest. The function must not modify the
+ * table and must synchronize any shared state in ctx itself.
+ *
+ * @param aa A pointer to the hash table
+ * @param fn A function called for every entry with the user context
+ * @param ctx A user context passed to fn
+ * @param nthreads The number of threads including the calling one, 0 or 1 to stay on it
+ * @return 0 on success, -1 on failure
+ */
+extern int aa_for_each_parallel(struct aa *, void (*)(struct aa_node *, void *), void *, size_t);
+
+/**
+ * @brief Folds every entry into an accumulator, one private copy per thread
+ *
+ * Every thread starts from a copy of the acc_size bytes at acc, which must
+ * hold the identity of combine (zero for a sum), folds its entries into it
+ * with fn, and the partial results are merged into acc with combine in
+ * thread order once all threads are done.
+ *
+ * @param aa A pointer to the hash table
+ * @param fn A function folding an entry into a thread's accumulator
+ * @param combine A function merging a partial result (second argument) into acc (first argument)
+ * @param acc A pointer to the initial value, which receives the result
+ * @param acc_size The size of the accumulator in bytes
+ * @param nthreads The number of threads including the calling one, 0 or 1 to stay on it
+ * @return 0 on success, -1 on failure
+ */
+extern int aa_reduce(struct aa *, void (*)(struct aa_node *, void *), void (*)(void *, const void *), void *, size_t,
+                     size_t);
+#endif /* AA_PARALLEL */
+
+#ifdef AA_SET
+/**
+ * @brief Adds every key of the second hash set to the first one
+ *
+ * @param aa A pointer to the hash set to be updated
+ * @param other A pointer to the hash set to be merged in
+ * @return 0 on success, -1 on failure
+ */
+extern int aa_union(struct aa *, struct aa *);
+
+/**
+ * @brief Removes every key of the first hash set that is missing from the second one
+ *
+ * @param aa A pointer to the hash set to be updated
+ * @param other A pointer to the hash set to be intersected with
+ * @return 0 on success, -1 on failure
+ */
+extern int aa_intersection(struct aa *, struct aa *);
+
+/**
+ * @brief Removes every key of the second hash set from the first one
+ *
+ * @param aa A pointer to the hash set to be updated
+ * @param other A pointer to the hash set whose keys are to be removed
+ * @return 0 on success, -1 on failure
+ */
+extern int aa_difference(struct aa *, struct aa *);
+#endif /* AA_SET */
+
+#if !defined(AA_MULTI) && !defined(AA_TTL) && !defined(AA_CACHE)
+/**
+ * @brief Moves every entry of the second hash table into the first one
+ *
+ * dst is resized at most once, for the entries of both tables, and the
+ * entries of src are placed with the hashes stored with them. On the
+ * default engine their nodes move over as they are, keys included, nothing
+ * is copied. For a key held by both tables, conflict is called with the
+ * node of dst and the node of src and must leave the merged value in the
+ * node of dst; without conflict the value of src wins. src is empty
+ * afterwards. On failure src is untouched and dst may hold part of it.
+ *
+ * @param dst A pointer to the hash table to be merged into
+ * @param src A pointer to the hash table whose entries are moved
+ * @param conflict A function merging the node of src (second argument) into the node of dst (first argument), or NULL
+ * @param ctx A user context passed to conflict
+ * @return 0 on success, -1 on failure
+ */
+extern int aa_merge(struct aa *, struct aa *, void (*)(struct aa_node *, struct aa_node *, void *), void *);
+
+#if defined(AA_PARALLEL) && !defined(AA_COMPACT) && !defined(AA_CUCKOO) && !defined(AA_COW)
+/**
+ * @brief Moves every entry of the second hash table into the first one, on several threads
+ *
+ * The same as aa_merge, the slots of src being spread over threads as in
+ * aa_for_each_parallel. Threads claim the buckets of dst with atomic
+ * compare-and-swap, so conflict may run on several threads at once and
+ * must synchronize any shared state in ctx itself. Falls back to aa_merge
+ * when the nodes cannot move as they are.
+ *
+ * @param dst A pointer to the hash table to be merged into
+ * @param src A pointer to the hash table whose entries are moved
+ * @param conflict A function merging the node of src (second argument) into the node of dst (first argument), or NULL
+ * @param ctx A user context passed to conflict
+ * @param nthreads The number of threads including the calling one, 0 or 1 to stay on it
+ * @return 0 on success, -1 on failure
+ */
+extern int aa_merge_parallel(struct aa *, struct aa *, void (*)(struct aa_node *, struct aa_node *, void *), void *,
+                             size_t);
+#endif /* AA_PARALLEL && !AA_COMPACT && !AA_CUCKOO && !AA_COW */
+#endif /* !AA_MULTI && !AA_TTL && !AA_CACHE */
+
+#ifdef AA_AGG
+/**
+ * @brief Aggregates of a hash aggregation, count ignores the values
+ */
+enum aa_agg_op {
+    AA_AGG_COUNT,
+    AA_AGG_SUM,
+    AA_AGG_MIN,
+    AA_AGG_MAX,
+    AA_AGG_CUSTOM,
+};
+
+/**
+ * @brief Groups a thread keeps before flushing them to the shared partitions
+ */
+enum {
+    AA_AGG_FLUSH = 1 << 16,
+};
+
+/**
+ * @brief Forward declaration of the aa_agg structure (a group-by over threads)
+ */
+struct aa_agg;
+
+/**
+ * @brief Creates a hash aggregation fed by several threads
+ *
+ * Every feeding thread folds its rows into tables of its own, split by
+ * the high bits of the hash like the shared partitions. Rows of a group
+ * the thread holds fold in place without locking; new groups allocate
+ * under a lock. Once a thread holds flush_at groups, they move to the
+ * shared partitions as in aa_merge, each partition under a lock of its
+ * own. Values must be
+ * arithmetic; a custom fold must be associative and commutative, as it
+ * also merges the partial aggregates of different threads.
+ *
+ * @param op The aggregate
+ * @param fold For AA_AGG_CUSTOM, a function folding a value (second argument) into an aggregate (first argument)
+ * @param nthreads The number of feeding threads
+ * @param partitions The number of shared partitions, rounded up to a power of two
+ * @param flush_at The groups a thread keeps before flushing, 0 for AA_AGG_FLUSH
+ * @return A pointer to the aggregation, or NULL on failure
+ */
+extern struct aa_agg *aa_agg_new(enum aa_agg_op, void (*)(void *, const void *), size_t, size_t, size_t);
+
+/**
+ * @brief Deletes an aggregation and its groups
+ *
+ * @param agg A pointer to the aggregation
+ */
+extern void aa_agg_delete(struct aa_agg *);
+
+/**
+ * @brief Folds a batch of rows into the tables of a feeding thread
+ *
+ * Each thread index must be used by one thread at a time. On failure the
+ * aggregates are incomplete.
+ *
+ * @param agg A pointer to the aggregation
+ * @param thread The index of the feeding thread, below nthreads
+ * @param keys An array of n keys
+ * @param values An array of n values, NULL for AA_AGG_COUNT
+ * @param n The number of rows
+ * @return 0 on success, -1 on failure
+ */
+#ifdef _WIN32
+#define aa_agg_add_batch(agg, thread, keys, values, n) aa_x_agg_add_batch(agg, thread, n, 2, keys, values)
+#else
+#define aa_agg_add_batch(agg, thread, keys, values, n) aa_x_agg_add_batch(agg, thread, n, keys, values)
+#endif /* _WIN32 */
+
+/**
+ * @brief Flushes the tables of every feeding thread to the shared partitions
+ *
+ * Must be called once no thread is adding rows, before the groups are
+ * read. More rows may be added afterwards and finished again.
+ *
+ * @param agg A pointer to the aggregation
+ * @return 0 on success, -1 on failure
+ */
+extern int aa_agg_finish(struct aa_agg *);
+
+/**
+ * @brief Gets the number of groups flushed to the shared partitions
+ *
+ * @param agg A pointer to the aggregation
+ * @return The number of groups
+ */
+extern size_t aa_agg_len(struct aa_agg *);
+
+/**
+ * @brief Iterates over the groups, partition by partition
+ *
+ * The key of a node is its group and the value its aggregate. Once every
+ * group has been returned the iteration starts over.
+ *
+ * @param agg A pointer to the aggregation
+ * @return A pointer to the next group, or NULL if no more groups
+ */
+extern struct aa_node *aa_agg_next(struct aa_agg *);
+
+extern int aa_x_agg_add_batch(struct aa_agg *, size_t, size_t,
+#ifdef _WIN32
+                              size_t,
+#endif /* _WIN32 */
+                              ...);
+#endif /* AA_AGG */
+
+#if defined(AA_MULTI)
+extern int aa_x_add(struct aa *,
+#ifdef _WIN32
+                    size_t,
+#endif /* _WIN32 */
+                    ...);
+extern struct aa_span aa_x_get_all(struct aa *,
+#ifdef _WIN32
+                                   size_t,
+#endif /* _WIN32 */
+                                   ...);
+extern size_t aa_x_count(struct aa *,
+#ifdef _WIN32
+                         size_t,
+#endif /* _WIN32 */
+                         ...);
+extern int aa_x_remove_one(struct aa *,
+#ifdef _WIN32
+                           size_t,
+#endif /* _WIN32 */
+                           ...);
+#elif !defined(AA_SET)
+extern int aa_x_set(struct aa *,
+#ifdef _WIN32
+                    size_t,
+#endif /* _WIN32 */
+                    ...);
+extern int aa_x_get(struct aa *,
+#ifdef _WIN32
+                    size_t,
+#endif /* _WIN32 */
+                    ...);
+#else
+extern int aa_x_insert(struct aa *,
+#ifdef _WIN32
+                       size_t,
+#endif /* _WIN32 */
+                       ...);
+extern bool aa_x_contains(struct aa *,
+#ifdef _WIN32
+                          size_t,
+#endif /* _WIN32 */
+                          ...);
+#endif /* AA_SET */
+extern int aa_x_remove(struct aa *,
+#ifdef _WIN32
+                       size_t,
+#endif /* _WIN32 */
+                       ...);
+extern size_t aa_x_hash_key(
+#ifdef _WIN32
+    size_t,
+#endif /* _WIN32 */
+    ...);
+#if !defined(AA_SET) && !defined(AA_MULTI)
+extern int aa_x_set_hashed(struct aa *, size_t,
+#ifdef _WIN32
+                           size_t,
+#endif /* _WIN32 */
+                           ...);
+#ifdef AA_TTL
+extern int aa_x_set_ttl(struct aa *, uint64_t,
+#ifdef _WIN32
+                        size_t,
+#endif /* _WIN32 */
+                        ...);
+#endif /* AA_TTL */
+extern int aa_x_get_hashed(struct aa *, size_t,
+#ifdef _WIN32
+                           size_t,
+#endif /* _WIN32 */
+                           ...);
+#elif defined(AA_SET)
+extern int aa_x_insert_hashed(struct aa *, size_t,
+#ifdef _WIN32
+                              size_t,
+#endif /* _WIN32 */
+                              ...);
+extern bool aa_x_contains_hashed(struct aa *, size_t,
+#ifdef _WIN32
+                                 size_t,
+#endif /* _WIN32 */
+                                 ...);
+#endif /* AA_SET */
+extern int aa_x_remove_hashed(struct aa *, size_t,
+#ifdef _WIN32
+                              size_t,
+#endif /* _WIN32 */
+                              ...);
+
+#endif /* AA_H */
+
+#ifdef AA_IMPLEMENTATION
+
+#ifndef AA_KEY
+#error "Please define AA_KEY type"
+#endif /* AA_KEY */
+
+#if defined(AA_KEY_HASH) != defined(AA_KEY_EQUALS)
+#error "AA_KEY_HASH and AA_KEY_EQUALS must be defined together"
+#endif /* AA_KEY_HASH != AA_KEY_EQUALS */
+
+#if defined(AA_TTL) && defined(AA_SET)
+#error "AA_TTL needs values, it cannot be combined with AA_SET"
+#endif /* AA_TTL && AA_SET */
+
+#if defined(AA_KEY_POOL) && (defined(AA_KEY_EQUALS) || defined(AA_TTL) || defined(AA_COW))
+#error "AA_KEY_POOL stores string keys, it cannot be combined with AA_KEY_EQUALS, AA_TTL or AA_COW"
+#endif /* AA_KEY_POOL */
+
+#if defined(AA_SPILL) && (defined(AA_SET) || defined(AA_MULTI) || defined(AA_TTL))
+#error "AA_SPILL stores plain key-value pairs, it cannot be combined with AA_SET, AA_MULTI or AA_TTL"
+#endif /* AA_SPILL */
+
+#if defined(AA_AGG) && (!defined(AA_PARALLEL) || defined(AA_SET) || defined(AA_MULTI) || defined(AA_TTL) ||            \
+                        defined(AA_CACHE) || defined(AA_KEY_POOL))
+#error "AA_AGG folds values on threads, it needs AA_PARALLEL and cannot be combined with AA_SET, AA_MULTI, AA_TTL, AA_CACHE or AA_KEY_POOL"
+#endif /* AA_AGG */
+
+#if defined(AA_SMALL) && (defined(AA_COMPACT) || defined(AA_CUCKOO) || defined(AA_COW) || defined(AA_BLOOM) ||         \
+                          defined(AA_CACHE) || defined(AA_TTL) || defined(AA_TRACE))
+#error "AA_SMALL defers hashing on the default engine, it cannot be combined with AA_COMPACT, AA_CUCKOO, AA_COW, AA_BLOOM, AA_CACHE, AA_TTL or AA_TRACE"
+#endif /* AA_SMALL */
+
+#if defined(AA_DENSE) && (defined(AA_COMPACT) || defined(AA_CUCKOO) || defined(AA_COW) || defined(AA_SMALL) ||         \
+                          defined(AA_BLOOM) || defined(AA_CACHE) || defined(AA_TTL) || defined(AA_TRACE) ||            \
+                          defined(AA_KEY_POOL) || defined(AA_KEY_EQUALS) || defined(AA_KEY_HASH))
+#error "AA_DENSE indexes integer keys on the default engine, it cannot be combined with AA_COMPACT, AA_CUCKOO, AA_COW, AA_SMALL, AA_BLOOM, AA_CACHE, AA_TTL, AA_TRACE, AA_KEY_POOL, AA_KEY_EQUALS or AA_KEY_HASH"
+#endif /* AA_DENSE */
+
+#if defined(AA_MULTI) && (defined(AA_SET) || defined(AA_TTL) || defined(AA_WAL) || defined(AA_COW))
+#error "AA_MULTI cannot be combined with AA_SET, AA_TTL, AA_WAL or AA_COW"
+#endif /* AA_MULTI */
+
+#if defined(AA_COW) && (defined(AA_CACHE) || defined(AA_TTL))
+#error "AA_COW shares nodes between clones, it cannot be combined with AA_CACHE or AA_TTL"
+#endif /* AA_COW */
+
+#ifdef AA_SET
+#ifdef AA_VALUE
+#error "AA_SET stores keys only, do not define AA_VALUE"
+#endif /* AA_VALUE */
+#elif !defined(AA_VALUE)
+#error "Please define AA_VALUE type (or AA_SET for a hash set)"
+#endif /* AA_SET */
+
+#if __STDC_VERSION__ >= 202311L
+typedef typeof_unqual(AA_KEY) aa_key_t;
+#ifndef AA_SET
+typedef typeof_unqual(AA_VALUE) aa_value_t;
+#endif /* AA_SET */
+#if (__linux__)
+#include <stdbit.h>
+#endif /* __linux__ */
+#else
+#error "C23 or later required"
+#endif /* __STDC_VERSION__ */
+
+struct aa_node {
+    aa_key_t key;
+#if defined(AA_MULTI)
+    aa_value_t *values; /* count of cap values in a pooled chunk */
+    size_t count, cap;
+#elif !defined(AA_SET)
+    aa_value_t value;
+#endif /* AA_MULTI */
+#ifdef AA_CACHE
+    /* CLOCK reference bit, set by hits on the node they already load */
+    bool ref;
+#endif /* AA_CACHE */
+#ifdef AA_TTL
+    uint64_t expires;       /* 0 for entries that never expire */
+    struct aa_timer *timer; /* Its pending expiration, NULL for none */
+#endif /* AA_TTL */
+#ifdef AA_COW
+    atomic_size_t refs; /* Pages pointing to this node */
+#endif /* AA_COW */
+};
+
+#ifdef AA_MULTI
+struct aa_span {
+    const aa_value_t *data;
+    size_t len;
+};
+#endif /* AA_MULTI */
+
+extern size_t aa_len(struct aa *a) {
+    if (!a)
+        return 0;
+
+    if (a->deleted > a->used)
+        return 0;
+
+    return a->used - a->deleted;
+}
+
+static inline bool aa_equals(aa_key_t k1, aa_key_t k2) {
+#ifdef AA_KEY_EQUALS
+    return AA_KEY_EQUALS(k1, k2);
+#else
+#ifdef AA_KEY_POOL
+    /* Keys interned in the same pool compare by address */
+    if ((const char *)k1 == (const char *)k2)
+        return true;
+#endif /* AA_KEY_POOL */
+    if (IS_POINTER(k2))
+        return strcmp((const char *)k1, (const char *)k2) == 0;
+    else
+        return k1 == k2;
+#endif /* AA_KEY_EQUALS */
+}
+
+static size_t aa_bsr(size_t v) {
+    if (v == 0)
+        return 0;
+
+    size_t bit_position = SIZE_WIDTH;
+#ifdef _STDBIT_H
+    return bit_position - stdc_first_leading_one(v);
+#else
+    for (; bit_position > 0; bit_position--)
+        if ((v & ((size_t)1 << (bit_position - 1))) != 0)
+            return bit_position - 1;
+
+    return 0;
+#endif /* _STDBIT_H */
+}
+
+[[maybe_unused]] static size_t aa_ctz(uint64_t v) {
+#ifdef _STDBIT_H
+    return stdc_trailing_zeros(v);
+#else
+    size_t n = 0;
+    while (!(v & ((uint64_t)1 << n)))
+        n++;
+
+    return n;
+#endif /* _STDBIT_H */
+}
+
+static size_t aa_nextpow2(size_t n) {
+    if (n == 0)
+        return 1;
+
+    const bool is_power_of2 = !((n - 1) & n);
+    return (size_t)1 << (aa_bsr(n) + !is_power_of2);
+}
+
+[[maybe_unused]] static size_t aa_fnv1a(const void *data, size_t len) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    enum {
+#if SIZE_WIDTH == 128
+        FNV_OFFSET_BASIS = 144066263297769815596495629667062367629U,
+        FNV_PRIME = 309485009821345068724781371U,
+#elif SIZE_WIDTH == 64
+        FNV_OFFSET_BASIS = 14695981039346656037U,
+        FNV_PRIME = 1099511628211U,
+#elif SIZE_WIDTH == 32
+        FNV_OFFSET_BASIS = 2166136261U,
+        FNV_PRIME = 16777619U,
+#else
+#error "Not implemented"
+#endif
+    };
+
+    size_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+[[maybe_unused]] static size_t aa_mix(size_t x) {
+    /*
+     * Multiply-xorshift, twice: each multiplication by the golden ratio
+     * spreads the key bits upwards, each xorshift folds the high half back
+     * into the low bits that aa_mask keeps
+     */
+    enum {
+#if SIZE_WIDTH == 128
+        AA_MIX_MUL = 0x9E3779B97F4A7C15F39CC0605CEDC835U,
+#elif SIZE_WIDTH == 64
+        AA_MIX_MUL = 0x9E3779B97F4A7C15U,
+#elif SIZE_WIDTH == 32
+        AA_MIX_MUL = 0x9E3779B9U,
+#else
+#error "Not implemented"
+#endif
+    };
+
+    x *= AA_MIX_MUL;
+    x ^= x >> (SIZE_WIDTH / 2 - 3);
+    x *= AA_MIX_MUL;
+    x ^= x >> (SIZE_WIDTH / 2);
+
+    return x;
+}
+
+static size_t aa_calc_hash(aa_key_t key) {
+    size_t hash;
+
+#ifdef AA_KEY_HASH
+    hash = AA_KEY_HASH(key);
+#else
+    if (IS_POINTER(key))
+        hash = aa_fnv1a((const void *)key, strlen((const char *)key));
+    else if (sizeof(key) <= sizeof(size_t)) {
+        /* Integer-sized keys skip the byte loop */
+        size_t x = 0;
+        memcpy(&x, &key, sizeof(key));
+        hash = aa_mix(x);
+    } else
+        hash = aa_fnv1a(&key, sizeof(key));
+#endif /* AA_KEY_HASH */
+
+    return hash | AA_HASH_FILLED;
+}
+
+#ifdef AA_MULTI
+#ifndef AA_MULTI_SLAB
+#define AA_MULTI_SLAB 65536
+#endif /* AA_MULTI_SLAB */
+
+/* The owner lets a node give its chunk back without a pointer to the table */
+struct aa_chunk {
+    union {
+        struct aa *owner;
+        struct aa_chunk *next; /* On a free list */
+    };
+    aa_value_t values[];
+};
+
+static size_t aa_chunk_size(size_t cap) {
+    size_t align = _Alignof(struct aa_chunk), size = sizeof(struct aa_chunk) + sizeof(aa_value_t) * cap;
+
+    return (size + align - 1) / align * align;
+}
+
+/* Small chunks are carved from shared slabs, so the values of neighbouring keys share pages */
+static bool aa_chunk_pooled(size_t class) {
+    return class < AA_MULTI_CLASSES && aa_chunk_size((size_t)1 << class) <= AA_MULTI_SLAB / 8;
+}
+
+static aa_value_t *aa_values_alloc(struct aa *a, size_t class) {
+    struct aa_chunk *c;
+    size_t size = aa_chunk_size((size_t)1 << class), head = aa_chunk_size(0);
+
+    if (!aa_chunk_pooled(class))
+        c = (struct aa_chunk *)fat_malloc(size);
+    else if ((c = a->pool[class]))
+        a->pool[class] = c->next;
+    else {
+        if (!a->slabs || a->slab_used + size > AA_MULTI_SLAB) {
+            /* A slab starts with the link to the previous one */
+            void *slab = fat_malloc(AA_MULTI_SLAB);
+            if (!slab)
+                return NULL;
+            *(void **)slab = a->slabs;
+            a->slabs = slab;
+            a->slab_used = head;
+        }
+        c = (struct aa_chunk *)((unsigned char *)a->slabs + a->slab_used);
+        a->slab_used += size;
+    }
+    if (!c)
+        return NULL;
+
+    c->owner = a;
+
+    return c->values;
+}
+
+static void aa_values_free(aa_value_t *values, size_t cap) {
+    struct aa_chunk *c = (struct aa_chunk *)((unsigned char *)values - offsetof(struct aa_chunk, values));
+    size_t class = aa_bsr(cap);
+
+    if (!aa_chunk_pooled(class)) {
+        fat_free(c);
+        return;
+    }
+
+    struct aa *a = c->owner;
+    c->next = a->pool[class];
+    a->pool[class] = c;
+
+    return;
+}
+
+/* Moves the values of a node to a chunk of 2^class values */
+static int aa_values_resize(struct aa *a, struct aa_node *n, size_t class) {
+    aa_value_t *values = aa_values_alloc(a, class);
+    if (!values)
+        return -1;
+
+    if (n->values) {
+        memcpy(values, n->values, sizeof(aa_value_t) * n->count);
+        aa_values_free(n->values, n->cap);
+    }
+    n->values = values;
+    n->cap = (size_t)1 << class;
+
+    return 0;
+}
+
+static void aa_pool_free(struct aa *a) {
+    while (a->slabs) {
+        void *next = *(void **)a->slabs;
+        fat_free(a->slabs);
+        a->slabs = next;
+    }
+    memset(a->pool, 0, sizeof(a->pool));
+    a->slab_used = 0;
+
+    return;
+}
+#endif /* AA_MULTI */
+
+#ifdef AA_KEY_POOL
+#ifndef AA_KEY_POOL_PAGE_BITS
+#define AA_KEY_POOL_PAGE_BITS 16
+#endif /* AA_KEY_POOL_PAGE_BITS */
+
+#ifndef AA_KEY_POOL_PAGE_MIN
+#define AA_KEY_POOL_PAGE_MIN 256
+#endif /* AA_KEY_POOL_PAGE_MIN */
+
+/*
+ * A key in a shared pool, node keys point to its bytes. The private pool a
+ * table makes for itself stores the bytes alone, with no header.
+ */
+struct aa_pooled_key {
+    uint32_t mark; /* Set while the keys are counted, the new offset while a compaction runs */
+    char bytes[];
+};
+
+struct aa_key_page {
+    unsigned char *data;
+    size_t size, used;
+};
+
+struct aa_key_pool {
+    struct aa_key_page *pages;
+    size_t npages, pages_cap, page_size;
+    /* Shared pools only: key offsets, page number in the high bits and position in the low ones, 0 when empty */
+    uint32_t *index;
+    size_t index_dim, index_used;
+    struct aa **tables;
+    size_t ntables, tables_cap, refs;
+    bool shared;
+};
+
+static struct aa_pooled_key *aa_pooled(const char *bytes) {
+    return (struct aa_pooled_key *)(bytes - offsetof(struct aa_pooled_key, bytes));
+}
+
+static struct aa_pooled_key *aa_pool_key_at(struct aa_key_pool *pool, uint32_t off) {
+    struct aa_key_page *page = &pool->pages[off >> AA_KEY_POOL_PAGE_BITS];
+    return (struct aa_pooled_key *)(page->data + (off & (((uint32_t)1 << AA_KEY_POOL_PAGE_BITS) - 1)));
+}
+
+static size_t aa_pooled_size(struct aa_key_pool *pool, size_t len) {
+    size_t align = _Alignof(struct aa_pooled_key);
+    if (!pool->shared)
+        return len + 1;
+
+    return (sizeof(struct aa_pooled_key) + len + 1 + align - 1) / align * align;
+}
+
+/* Grows an array of fat_malloc'ed elements to hold at least n of them */
+static int aa_pool_reserve(void **array, size_t *cap, size_t n, size_t size) {
+    if (n <= *cap)
+        return 0;
+
+    size_t c = *cap ? *cap * 2 : 8;
+    void *p = fat_malloc(c * size);
+    if (!p)
+        return -1;
+    if (*array) {
+        memcpy(p, *array, *cap * size);
+        fat_free(*array);
+    }
+    *array = p;
+    *cap = c;
+
+    return 0;
+}
+
+/* Starts a page for at least size bytes, page sizes double up to 1 << AA_KEY_POOL_PAGE_BITS */
+static int aa_pool_add_page(struct aa_key_pool *pool, size_t size) {
+    size_t grow = pool->page_size ? pool->page_size : AA_KEY_POOL_PAGE_MIN;
+    if (pool->npages == (size_t)1 << (32 - AA_KEY_POOL_PAGE_BITS) ||
+        aa_pool_reserve((void **)&pool->pages, &pool->pages_cap, pool->npages + 1, sizeof(struct aa_key_page)) != 0)
+        return -1;
+
+    /* Offset 0 marks empty index slots, longer keys get a page of their own */
+    struct aa_key_page *page = &pool->pages[pool->npages];
+    *page = (struct aa_key_page){.used = pool->npages == 0 && pool->shared ? _Alignof(struct aa_pooled_key) : 0};
+    page->size = page->used + size > grow ? page->used + size : grow;
+    if (!(page->data = (unsigned char *)fat_malloc(page->size)))
+        return -1;
+    pool->npages++;
+    if (grow < (size_t)1 << AA_KEY_POOL_PAGE_BITS)
+        pool->page_size = grow * 2;
+
+    return 0;
+}
+
+static const char *aa_pool_append(struct aa_key_pool *pool, const char *key, size_t len, uint32_t *off) {
+    size_t size = aa_pooled_size(pool, len);
+    if ((!pool->npages || pool->pages[pool->npages - 1].used + size > pool->pages[pool->npages - 1].size) &&
+        aa_pool_add_page(pool, size) != 0)
+        return NULL;
+
+    struct aa_key_page *page = &pool->pages[pool->npages - 1];
+    *off = (uint32_t)((pool->npages - 1) << AA_KEY_POOL_PAGE_BITS | page->used);
+    char *bytes = (char *)page->data + page->used;
+    if (pool->shared) {
+        struct aa_pooled_key *k = (struct aa_pooled_key *)bytes;
+        k->mark = 0;
+        bytes = k->bytes;
+    }
+    memcpy(bytes, key, len);
+    bytes[len] = '\0';
+    page->used += size;
+
+    return bytes;
+}
+
+static void aa_pool_index_put(struct aa_key_pool *pool, uint32_t off, size_t hash) {
+    size_t m = pool->index_dim - 1, i = hash & m;
+    while (pool->index[i])
+        i = (i + 1) & m;
+    pool->index[i] = off;
+    pool->index_used++;
+
+    return;
+}
+
+static int aa_pool_index_resize(struct aa_key_pool *pool, size_t dim) {
+    uint32_t *old = pool->index;
+    size_t odim = pool->index_dim;
+
+    if (!(pool->index = (uint32_t *)fat_malloc(sizeof(uint32_t) * dim))) {
+        pool->index = old;
+        return -1;
+    }
+    memset(pool->index, 0, sizeof(uint32_t) * dim);
+    pool->index_dim = dim;
+    pool->index_used = 0;
+
+    for (size_t i = 0; i < odim; i++) {
+        if (old[i]) {
+            const char *bytes = aa_pool_key_at(pool, old[i])->bytes;
+            aa_pool_index_put(pool, old[i], aa_fnv1a(bytes, strlen(bytes)));
+        }
+    }
+    if (old)
+        fat_free(old);
+
+    return 0;
+}
+
+/*
+ * Returns the pooled copy of a key. A table looks the key up in its own
+ * buckets before it gets here, so a private pool just appends it. A shared
+ * pool looks it up in its index first: keys whose last node is gone stay
+ * there until a compaction, so adding them again costs nothing.
+ */
+static const char *aa_pool_intern(struct aa_key_pool *pool, const char *key) {
+    size_t len = strlen(key);
+    uint32_t off;
+    if (!pool->shared)
+        return aa_pool_append(pool, key, len, &off);
+
+    if ((pool->index_used + 1) * 4 > pool->index_dim * 3 &&
+        aa_pool_index_resize(pool, pool->index_dim ? pool->index_dim * 2 : 64) != 0)
+        return NULL;
+
+    size_t hash = aa_fnv1a(key, len);
+    for (size_t m = pool->index_dim - 1, i = hash & m; pool->index[i]; i = (i + 1) & m) {
+        const char *bytes = aa_pool_key_at(pool, pool->index[i])->bytes;
+        if (strcmp(bytes, key) == 0)
+            return bytes;
+    }
+
+    const char *bytes = aa_pool_append(pool, key, len, &off);
+    if (bytes)
+        aa_pool_index_put(pool, off, hash);
+
+    return bytes;
+}
+
+static void aa_pool_free_pages(struct aa_key_pool *pool) {
+    for (size_t i = 0; i < pool->npages; i++)
+        fat_free(pool->pages[i].data);
+    if (pool->pages)
+        fat_free(pool->pages);
+    if (pool->index)
+        fat_free(pool->index);
+    pool->pages = NULL;
+    pool->index = NULL;
+    pool->npages = pool->pages_cap = pool->page_size = pool->index_dim = pool->index_used = 0;
+
+    return;
+}
+
+extern struct aa_key_pool *aa_key_pool_new(void) {
+    struct aa_key_pool *pool = (struct aa_key_pool *)fat_malloc(sizeof(struct aa_key_pool));
+    if (!pool)
+        return NULL;
+
+    *pool = (struct aa_key_pool){.refs = 1, .shared = true};
+
+    return pool;
+}
+
+extern void aa_key_pool_release(struct aa_key_pool *pool) {
+    if (!pool || --pool->refs > 0)
+        return;
+
+    aa_pool_free_pages(pool);
+    if (pool->tables)
+        fat_free(pool->tables);
+    fat_free(pool);
+
+    return;
+}
+
+static void aa_pool_detach(struct aa *a) {
+    struct aa_key_pool *pool = a->key_pool;
+    if (!pool)
+        return;
+
+    for (size_t i = 0; i < pool->ntables; i++)
+        if (pool->tables[i] == a)
+            pool->tables[i] = pool->tables[--pool->ntables];
+    a->key_pool = NULL;
+    aa_key_pool_release(pool);
+
+    return;
+}
+
+static int aa_pool_attach(struct aa *a, struct aa_key_pool *pool) {
+    if (aa_pool_reserve((void **)&pool->tables, &pool->tables_cap, pool->ntables + 1, sizeof(struct aa *)) != 0)
+        return -1;
+
+    aa_pool_detach(a);
+    pool->tables[pool->ntables++] = a;
+    pool->refs++;
+    a->key_pool = pool;
+
+    return 0;
+}
+#else
+#ifndef AA_KEY_EQUALS
+static int aa_assign_key_ptr(struct aa_node *p, void *key) {
+    if (!p || !key)
+        return -1;
+
+    p->key = (aa_key_t)fat_malloc(strlen((const char *)key) + 1);
+    if (!(char *)p->key)
+        return -1;
+    strcpy((char *)p->key, (const char *)key);
+
+    return 0;
+}
+#endif /* AA_KEY_EQUALS */
+#endif /* AA_KEY_POOL */
+
+/* Keys with user-supplied hooks are stored as they are, strings are copied */
+static int aa_assign_key(struct aa *a, struct aa_node *p, aa_key_t key) {
+#if defined(AA_KEY_POOL)
+    static_assert(IS_POINTER(key), "AA_KEY_POOL needs string keys");
+    if (!a->key_pool) {
+        struct aa_key_pool *pool = aa_key_pool_new();
+        if (pool)
+            pool->shared = false;
+        int ret = pool ? aa_pool_attach(a, pool) : -1;
+        aa_key_pool_release(pool);
+        if (ret != 0)
+            return -1;
+    }
+
+    const char *bytes = aa_pool_intern(a->key_pool, (const char *)key);
+    if (!bytes)
+        return -1;
+    p->key = (aa_key_t)bytes;
+#elif defined(AA_KEY_EQUALS)
+    (void)a;
+    p->key = key;
+#else
+    (void)a;
+    if (!IS_POINTER(key))
+        p->key = key;
+    else if (aa_assign_key_ptr(p, (void *)key) != 0)
+        return -1;
+#endif /* AA_KEY_EQUALS */
+
+    return 0;
+}
+
+#ifdef AA_TTL
+static void aa_timer_free(struct aa_timer *t);
+#endif /* AA_TTL */
+
+static void aa_release_key(struct aa_node *p) {
+#ifdef AA_TTL
+    /* The pending expiration goes with the entry */
+    aa_timer_free(p->timer);
+    p->timer = NULL;
+#endif /* AA_TTL */
+#ifdef AA_MULTI
+    /* The values go with the key */
+    if (p->values)
+        aa_values_free(p->values, p->cap);
+    p->values = NULL;
+    p->count = p->cap = 0;
+#endif /* AA_MULTI */
+#if defined(AA_KEY_POOL)
+    /* The pool keeps the bytes, a compaction reclaims them */
+    p->key = (aa_key_t)NULL;
+#elif !defined(AA_KEY_EQUALS)
+    if ((void *)p->key && IS_POINTER(p->key))
+        fat_free((void *)p->key);
+#else
+    (void)p;
+#endif /* AA_KEY_POOL */
+
+    return;
+}
+
+#if defined(AA_COMPACT)
+/*
+ * Compact layout: a small index of slot numbers is probed exactly like the
+ * bucket array below, but it only points into a dense, insertion-ordered
+ * array of entries. Removed entries stay in place as holes until the next
+ * resize squeezes them out.
+ */
+struct aa_entry {
+    size_t hash;
+    struct aa_node node;
+};
+
+enum {
+    /* Index slot values, entry k is stored as k + AA_INDEX_FIRST */
+    AA_INDEX_EMPTY = 0,
+    AA_INDEX_DUMMY = 1,
+    AA_INDEX_FIRST = 2
+};
+
+static size_t aa_index_width(size_t dim) {
+    if (dim <= (size_t)1 << 7)
+        return sizeof(uint8_t);
+    if (dim <= (size_t)1 << 15)
+        return sizeof(uint16_t);
+    if (dim <= (size_t)1 << 31)
+        return sizeof(uint32_t);
+
+    return sizeof(size_t);
+}
+
+static size_t aa_index_get(struct aa *a, size_t i) {
+    switch (aa_index_width(a->dim)) {
+    case 1:
+        return ((uint8_t *)a->index)[i];
+    case 2:
+        return ((uint16_t *)a->index)[i];
+    case 4:
+        return ((uint32_t *)a->index)[i];
+    default:
+        return ((size_t *)a->index)[i];
+    }
+}
+
+static void aa_index_set(struct aa *a, size_t i, size_t ix) {
+    switch (aa_index_width(a->dim)) {
+    case 1:
+        ((uint8_t *)a->index)[i] = (uint8_t)ix;
+        break;
+    case 2:
+        ((uint16_t *)a->index)[i] = (uint16_t)ix;
+        break;
+    case 4:
+        ((uint32_t *)a->index)[i] = (uint32_t)ix;
+        break;
+    default:
+        ((size_t *)a->index)[i] = ix;
+        break;
+    }
+}
+
+/* Number of entries the dense array holds before the index has to grow */
+static size_t aa_usable(size_t dim) { return dim * AA_GROW_NUM / AA_GROW_DEN; }
+
+static int aa_alloc_htable(struct aa *a, size_t s) {
+    if (!a || s == 0)
+        return -1;
+
+    void *_Index = fat_malloc(aa_index_width(s) * s);
+    if (!_Index)
+        return -1;
+
+    struct aa_entry *_Entries = (struct aa_entry *)fat_malloc(sizeof(struct aa_entry) * aa_usable(s));
+    if (!_Entries) {
+        fat_free(_Index);
+        return -1;
+    }
+
+    a->index = _Index;
+    a->entries = _Entries;
+    a->dim = s;
+
+    return 0;
+}
+
+static int aa_init_table_if_needed(struct aa *a) {
+    if (!a)
+        return -1;
+
+    if (!a->index)
+        if (aa_alloc_htable(a, AA_INIT_NUM_BUCKETS) != 0)
+            return -1;
+
+    return 0;
+}
+
+static size_t aa_mask(struct aa *a) {
+    if (!a)
+        return 0;
+
+    return a->dim - 1;
+}
+
+static size_t aa_find_slot_insert(struct aa *a, size_t hash) {
+    for (size_t m = aa_mask(a), i = hash & m, j = 1;; j++) {
+        if (aa_index_get(a, i) < AA_INDEX_FIRST)
+            return i;
+
+        i = (i + j) & m;
+    }
+}
+
+/* Returns the index slot of the key, or SIZE_MAX if it is not there */
+static size_t aa_find_slot_lookup(struct aa *a, size_t hash, aa_key_t key) {
+    if (!a || !a->index)
+        return SIZE_MAX;
+
+    for (size_t m = aa_mask(a), i = hash & m, j = 1;; j++) {
+        size_t ix = aa_index_get(a, i);
+        if (ix == AA_INDEX_EMPTY)
+            return SIZE_MAX;
+
+        if (ix != AA_INDEX_DUMMY) {
+            struct aa_entry *e = &a->entries[ix - AA_INDEX_FIRST];
+            if (e->hash == hash && aa_equals(key, e->node.key))
+                return i;
+        }
+
+        i = (i + j) & m;
+    }
+}
+
+static void aa_clear_entry(struct aa_entry *e) {
+    if (!e)
+        return;
+
+    aa_release_key(&e->node);
+
+    e->hash = AA_HASH_DELETED;
+
+    return;
+}
+
+static int aa_resize(struct aa *a, size_t s) {
+    if (!a || s == 0 || aa_len(a) > aa_usable(s))
+        return -1;
+
+    void *oi = a->index;
+    struct aa_entry *oe = a->entries;
+    size_t od = a->dim, n = 0;
+
+    if (s != od || !oi) {
+        if (aa_alloc_htable(a, s) != 0)
+            return -1;
+    } else
+        memset(a->index, 0, aa_index_width(s) * s);
+
+    /* Squeeze the holes out, keeping the insertion order */
+    for (size_t i = 0; i < a->used; i++)
+        if (oe[i].hash & AA_HASH_FILLED)
+            a->entries[n++] = oe[i];
+    if (a->entries == oe)
+        memset(&oe[n], 0, sizeof(struct aa_entry) * (a->used - n));
+
+    for (size_t i = 0; i < n; i++)
+        aa_index_set(a, aa_find_slot_insert(a, a->entries[i].hash), i + AA_INDEX_FIRST);
+
+    a->used = n;
+    a->deleted = 0;
+
+    if (a->index != oi) {
+        if (oi)
+            fat_free(oi);
+        if (oe)
+            fat_free(oe);
+    }
+
+    return 0;
+}
+
+static int aa_grow(struct aa *a) {
+    if (!a || !a->index)
+        return -1;
+
+    /* clang-format off */
+    size_t s = aa_len(a) * AA_SHRINK_DEN < AA_GROW_FAC * a->dim * AA_SHRINK_NUM
+            ? a->dim
+            : (AA_GROW_FAC * a->dim);
+    /* clang-format on */
+
+    return aa_resize(a, s);
+}
+
+static int aa_shrink(struct aa *a) {
+    if (!a || !a->index)
+        return -1;
+
+    if (a->dim > AA_INIT_NUM_BUCKETS)
+        return aa_resize(a, a->dim / AA_GROW_FAC);
+
+    return 0;
+}
+
+static struct aa_node *aa_lookup(struct aa *a, size_t hash, aa_key_t key) {
+    size_t i = aa_find_slot_lookup(a, hash, key);
+    if (i == SIZE_MAX)
+        return NULL;
+
+    return &a->entries[aa_index_get(a, i) - AA_INDEX_FIRST].node;
+}
+
+static struct aa_node *aa_insert_with_hash(struct aa *a, size_t hash, aa_key_t key, bool *found) {
+    if (!a)
+        return NULL;
+
+    if (aa_init_table_if_needed(a) != 0)
+        return NULL;
+
+    struct aa_node *n = aa_lookup(a, hash, key);
+
+    if (found)
+        *found = n != NULL;
+    if (n)
+        return n;
+
+    if (a->used >= aa_usable(a->dim))
+        if (aa_grow(a) != 0)
+            return NULL;
+
+    struct aa_entry *e = &a->entries[a->used];
+    if (aa_assign_key(a, &e->node, key) != 0)
+        return NULL;
+
+    e->hash = hash;
+    aa_index_set(a, aa_find_slot_insert(a, hash), a->used + AA_INDEX_FIRST);
+    a->used++;
+
+    return &e->node;
+}
+
+static bool aa_erase(struct aa *a, size_t hash, aa_key_t key) {
+    size_t i = aa_find_slot_lookup(a, hash, key);
+    if (i == SIZE_MAX)
+        return false;
+
+    aa_clear_entry(&a->entries[aa_index_get(a, i) - AA_INDEX_FIRST]);
+    aa_index_set(a, i, AA_INDEX_DUMMY);
+    a->deleted++;
+
+    return true;
+}
+
+static size_t aa_slots(struct aa *a) {
+    if (!a || !a->index)
+        return 0;
+
+    return a->used;
+}
+
+static struct aa_node *aa_slot_node(struct aa *a, size_t i) {
+    return a->entries[i].hash & AA_HASH_FILLED ? &a->entries[i].node : NULL;
+}
+
+[[maybe_unused]] static size_t aa_slot_hash(struct aa *a, size_t i) { return a->entries[i].hash; }
+
+static void aa_erase_slot(struct aa *a, size_t i) {
+    for (size_t m = aa_mask(a), k = a->entries[i].hash & m, j = 1;; j++) {
+        if (aa_index_get(a, k) == i + AA_INDEX_FIRST) {
+            aa_index_set(a, k, AA_INDEX_DUMMY);
+            break;
+        }
+
+        k = (k + j) & m;
+    }
+
+    aa_clear_entry(&a->entries[i]);
+    a->deleted++;
+
+    return;
+}
+
+extern void aa_clear(struct aa *a) {
+    if (!a || !a->index)
+        return;
+
+    for (size_t i = 0; i < a->used; i++)
+        if (a->entries[i].hash & AA_HASH_FILLED)
+            aa_clear_entry(&a->entries[i]);
+
+    fat_free(a->index);
+    fat_free(a->entries);
+    a->index = NULL;
+    a->entries = NULL;
+    a->dim = a->deleted = a->used = 0;
+
+    return;
+}
+
+extern size_t aa_entries(struct aa *a) {
+    if (!a || !a->index)
+        return 0;
+
+    return a->dim;
+}
+#elif defined(AA_CUCKOO)
+/*
+ * Bucketized cuckoo hashing: a key lives in one of two buckets of
+ * AA_CUCKOO_SLOTS slots, and each bucket fills one cache line. Lookups never
+ * look past those two lines. Inserts move residents to their other bucket
+ * along the shortest path to a free slot, and grow the table only when no
+ * such path exists.
+ */
+enum {
+    AA_CACHE_LINE = 64,
+    AA_CUCKOO_SLOTS = AA_CACHE_LINE / sizeof(struct aa_bucket),
+
+    /* Grow threshold */
+    AA_CUCKOO_GROW_NUM = 19,
+    AA_CUCKOO_GROW_DEN = 20,
+    /* Grow factor */
+    AA_CUCKOO_GROW_FAC = 2,
+
+    /* Buckets visited while looking for a free slot */
+    AA_CUCKOO_MAX_VISITS = 256
+};
+
+static int aa_alloc_htable(struct aa *a, size_t s) {
+    if (!a || s == 0)
+        return -1;
+
+    if (s < AA_CUCKOO_SLOTS)
+        s = AA_CUCKOO_SLOTS;
+
+    void *_Block = fat_malloc(sizeof(struct aa_bucket) * s + AA_CACHE_LINE - 1);
+    if (!_Block)
+        return -1;
+
+    a->block = _Block;
+    a->buckets = (struct aa_bucket *)(((uintptr_t)_Block + AA_CACHE_LINE - 1) & ~(uintptr_t)(AA_CACHE_LINE - 1));
+    a->dim = s;
+
+    return 0;
+}
+
+static int aa_init_table_if_needed(struct aa *a) {
+    if (!a)
+        return -1;
+
+    if (!a->buckets)
+        if (aa_alloc_htable(a, AA_INIT_NUM_BUCKETS) != 0)
+            return -1;
+
+    return 0;
+}
+
+static bool aa_filled(struct aa_bucket *b) {
+    if (!b)
+        return false;
+
+    return b->hash & AA_HASH_FILLED;
+}
+
+/* Mask over cache-line buckets, not slots */
+static size_t aa_mask(struct aa *a) {
+    if (!a)
+        return 0;
+
+    return a->dim / AA_CUCKOO_SLOTS - 1;
+}
+
+/* The other bucket of a key, from either of its buckets */
+static size_t aa_alt(size_t i, size_t hash, size_t m) { return (i ^ (aa_mix(hash >> (SIZE_WIDTH / 2)) | 1)) & m; }
+
+static struct aa_bucket *aa_find_slot_lookup(struct aa *a, size_t hash, aa_key_t key) {
+    if (!a || !a->buckets)
+        return NULL;
+
+    size_t m = aa_mask(a), i = hash & m, k = aa_alt(i, hash, m);
+    struct aa_bucket *b[2] = {&a->buckets[i * AA_CUCKOO_SLOTS], &a->buckets[k * AA_CUCKOO_SLOTS]};
+    __builtin_prefetch(b[1]);
+
+    for (size_t j = 0; j < 2; j++)
+        for (size_t s = 0; s < AA_CUCKOO_SLOTS; s++)
+            if (b[j][s].hash == hash && aa_equals(key, b[j][s].entry->key))
+                return &b[j][s];
+
+    return NULL;
+}
+
+/*
+ * Returns a free slot in one of the two buckets of the hash, moving residents
+ * to their other bucket if both are full. The path is found with a breadth
+ * first search, so nothing moves unless it ends at a free slot.
+ */
+static struct aa_bucket *aa_find_slot_insert(struct aa *a, size_t hash) {
+    if (!a || !a->buckets)
+        return NULL;
+
+    struct aa_cuckoo_step {
+        size_t bucket;
+        short parent, slot;
+    } queue[AA_CUCKOO_MAX_VISITS];
+
+    size_t m = aa_mask(a), head = 0, tail = 0;
+    queue[tail++] = (struct aa_cuckoo_step){hash & m, -1, -1};
+    queue[tail++] = (struct aa_cuckoo_step){aa_alt(hash & m, hash, m), -1, -1};
+
+    for (; head < tail; head++) {
+        struct aa_bucket *b = &a->buckets[queue[head].bucket * AA_CUCKOO_SLOTS];
+
+        for (size_t s = 0; s < AA_CUCKOO_SLOTS; s++) {
+            if (aa_filled(&b[s]))
+                continue;
+
+            /* Shift every resident on the path one step towards the free slot */
+            struct aa_bucket *free_slot = &b[s];
+            for (size_t q = head; queue[q].parent >= 0; q = queue[q].parent) {
+                struct aa_bucket *from = &a->buckets[queue[queue[q].parent].bucket * AA_CUCKOO_SLOTS + queue[q].slot];
+                *free_slot = *from;
+                free_slot = from;
+            }
+
+            free_slot->hash = AA_HASH_EMPTY;
+            free_slot->entry = NULL;
+
+            return free_slot;
+        }
+
+        for (size_t s = 0; s < AA_CUCKOO_SLOTS && tail < AA_CUCKOO_MAX_VISITS; s++)
+            queue[tail++] = (struct aa_cuckoo_step){aa_alt(queue[head].bucket, b[s].hash, m), (short)head, (short)s};
+    }
+
+    return NULL;
+}
+
+static void aa_clear_entry(struct aa_bucket *b) {
+    if (!b || !b->entry)
+        return;
+
+    aa_release_key(b->entry);
+    fat_free(b->entry);
+
+    b->hash = AA_HASH_EMPTY;
+    b->entry = NULL;
+
+    return;
+}
+
+static int aa_resize(struct aa *a, size_t s) {
+    if (!a || s == 0)
+        return -1;
+
+    struct aa_bucket *o = a->buckets;
+    void *ob = a->block;
+    size_t od = a->dim;
+
+    for (;; s *= AA_CUCKOO_GROW_FAC) {
+        if (s * AA_CUCKOO_GROW_NUM < aa_len(a) * AA_CUCKOO_GROW_DEN)
+            continue;
+
+        if (aa_alloc_htable(a, s) != 0) {
+            a->buckets = o, a->block = ob, a->dim = od;
+            return -1;
+        }
+
+        size_t i = 0;
+        for (; i < od; i++) {
+            if (!aa_filled(&o[i]))
+                continue;
+
+            struct aa_bucket *nb = aa_find_slot_insert(a, o[i].hash);
+            if (!nb)
+                break;
+            *nb = o[i];
+        }
+
+        if (i == od)
+            break;
+
+        /* Unlucky placement, the old table still holds everything */
+        fat_free(a->block);
+    }
+
+    if (ob)
+        fat_free(ob);
+
+    return 0;
+}
+
+static int aa_grow(struct aa *a) {
+    if (!a || !a->buckets)
+        return -1;
+
+    return aa_resize(a, AA_CUCKOO_GROW_FAC * a->dim);
+}
+
+static int aa_shrink(struct aa *a) {
+    if (!a || !a->buckets)
+        return -1;
+
+    if (a->dim > AA_INIT_NUM_BUCKETS)
+        return aa_resize(a, a->dim / AA_GROW_FAC);
+
+    return 0;
+}
+
+static struct aa_node *aa_lookup(struct aa *a, size_t hash, aa_key_t key) {
+    struct aa_bucket *b = aa_find_slot_lookup(a, hash, key);
+
+    return b ? b->entry : NULL;
+}
+
+static struct aa_node *aa_insert_with_hash(struct aa *a, size_t hash, aa_key_t key, bool *found) {
+    if (!a)
+        return NULL;
+
+    if (aa_init_table_if_needed(a) != 0)
+        return NULL;
+
+    struct aa_bucket *b = aa_find_slot_lookup(a, hash, key);
+
+    if (found)
+        *found = b != NULL;
+    if (b)
+        return b->entry;
+
+    if ((a->used + 1) * AA_CUCKOO_GROW_DEN > a->dim * AA_CUCKOO_GROW_NUM)
+        if (aa_grow(a) != 0)
+            return NULL;
+
+    while (!(b = aa_find_slot_insert(a, hash)))
+        if (aa_grow(a) != 0)
+            return NULL;
+
+    struct aa_node *n = (struct aa_node *)fat_malloc(sizeof(struct aa_node));
+    if (!n)
+        return NULL;
+
+    if (aa_assign_key(a, n, key) != 0) {
+        fat_free(n);
+        return NULL;
+    }
+
+    b->hash = hash;
+    b->entry = n;
+    a->used++;
+
+    return n;
+}
+
+static bool aa_erase(struct aa *a, size_t hash, aa_key_t key) {
+    struct aa_bucket *p = aa_find_slot_lookup(a, hash, key);
+    if (!p)
+        return false;
+
+    /* No tombstones: a key never lives outside its two buckets */
+    aa_clear_entry(p);
+    a->used--;
+
+    return true;
+}
+
+static size_t aa_slots(struct aa *a) {
+    if (!a || !a->buckets)
+        return 0;
+
+    return a->dim;
+}
+
+static struct aa_node *aa_slot_node(struct aa *a, size_t i) {
+    return aa_filled(&a->buckets[i]) ? a->buckets[i].entry : NULL;
+}
+
+[[maybe_unused]] static size_t aa_slot_hash(struct aa *a, size_t i) { return a->buckets[i].hash; }
+
+static void aa_erase_slot(struct aa *a, size_t i) {
+    aa_clear_entry(&a->buckets[i]);
+    a->used--;
+
+    return;
+}
+
+extern void aa_clear(struct aa *a) {
+    if (!a || !a->buckets)
+        return;
+
+    for (size_t i = 0; i < a->dim; i++)
+        aa_clear_entry(&a->buckets[i]);
+
+    fat_free(a->block);
+    a->buckets = NULL;
+    a->block = NULL;
+    a->dim = a->deleted = a->used = 0;
+
+    return;
+}
+
+extern size_t aa_entries(struct aa *a) {
+    if (!a || !a->buckets)
+        return 0;
+
+    return a->dim;
+}
+#elif defined(AA_COW)
+/*
+ * Copy-on-write layout: the open addressing table below, cut into pages of
+ * AA_COW_PAGE buckets behind a page table. Pages count the tables holding
+ * them and nodes count the pages pointing to them, so aa_clone only copies
+ * the page table. A write first gives the table its own copy of the page
+ * and, for an existing entry, of the node.
+ */
+enum {
+    AA_COW_PAGE = 64,
+};
+
+struct aa_page {
+    atomic_size_t refs;
+    struct aa_bucket buckets[];
+};
+
+static size_t aa_page_dim(size_t dim) { return dim < AA_COW_PAGE ? dim : AA_COW_PAGE; }
+
+static size_t aa_num_pages(size_t dim) { return (dim + AA_COW_PAGE - 1) / AA_COW_PAGE; }
+
+static struct aa_page *aa_alloc_page(size_t dim) {
+    struct aa_page *p =
+        (struct aa_page *)fat_malloc(sizeof(struct aa_page) + sizeof(struct aa_bucket) * aa_page_dim(dim));
+    if (p)
+        atomic_init(&p->refs, 1);
+
+    return p;
+}
+
+static void aa_release_node(struct aa_node *n) {
+    if (n && atomic_fetch_sub(&n->refs, 1) == 1) {
+        aa_release_key(n);
+        fat_free(n);
+    }
+
+    return;
+}
+
+static void aa_release_page(struct aa_page *p, size_t dim) {
+    if (!p || atomic_fetch_sub(&p->refs, 1) != 1)
+        return;
+
+    for (size_t i = 0; i < aa_page_dim(dim); i++)
+        if (p->buckets[i].hash & AA_HASH_FILLED)
+            aa_release_node(p->buckets[i].entry);
+    fat_free(p);
+
+    return;
+}
+
+static void aa_release_pages(struct aa_page **pages, size_t dim) {
+    if (!pages)
+        return;
+
+    for (size_t i = 0; i < aa_num_pages(dim); i++)
+        aa_release_page(pages[i], dim);
+    fat_free(pages);
+
+    return;
+}
+
+static int aa_alloc_htable(struct aa *a, size_t s) {
+    if (!a || s == 0)
+        return -1;
+
+    struct aa_page **pages = (struct aa_page **)fat_malloc(sizeof(struct aa_page *) * aa_num_pages(s));
+    if (!pages)
+        return -1;
+
+    for (size_t i = 0; i < aa_num_pages(s); i++)
+        if (!(pages[i] = aa_alloc_page(s))) {
+            aa_release_pages(pages, s);
+            return -1;
+        }
+
+    a->pages = pages;
+    a->dim = s;
+
+    return 0;
+}
+
+static int aa_init_table_if_needed(struct aa *a) {
+    if (!a)
+        return -1;
+
+    if (!a->pages)
+        if (aa_alloc_htable(a, AA_INIT_NUM_BUCKETS) != 0)
+            return -1;
+
+    return 0;
+}
+
+static size_t aa_mask(struct aa *a) {
+    if (!a)
+        return 0;
+
+    return a->dim - 1;
+}
+
+static struct aa_bucket *aa_bucket_at(struct aa *a, size_t i) {
+    return &a->pages[i / AA_COW_PAGE]->buckets[i % AA_COW_PAGE];
+}
+
+/* Gives the table its own copy of the page holding bucket i */
+static struct aa_bucket *aa_bucket_mut(struct aa *a, size_t i) {
+    struct aa_page **pp = &a->pages[i / AA_COW_PAGE];
+    if (atomic_load(&(*pp)->refs) > 1) {
+        struct aa_page *p = aa_alloc_page(a->dim);
+        if (!p)
+            return NULL;
+
+        memcpy(p->buckets, (*pp)->buckets, sizeof(struct aa_bucket) * aa_page_dim(a->dim));
+        for (size_t k = 0; k < aa_page_dim(a->dim); k++)
+            if (p->buckets[k].hash & AA_HASH_FILLED)
+                atomic_fetch_add(&p->buckets[k].entry->refs, 1);
+
+        aa_release_page(*pp, a->dim);
+        *pp = p;
+    }
+
+    return &(*pp)->buckets[i % AA_COW_PAGE];
+}
+
+/* Gives the (already private) bucket its own copy of the node */
+static struct aa_node *aa_node_mut(struct aa *a, struct aa_bucket *b) {
+    struct aa_node *o = b->entry;
+    if (atomic_load(&o->refs) == 1)
+        return o;
+
+    struct aa_node *n = (struct aa_node *)fat_malloc(sizeof(struct aa_node));
+    if (!n)
+        return NULL;
+
+    memcpy(n, o, sizeof(struct aa_node));
+    atomic_init(&n->refs, 1);
+    if (aa_assign_key(a, n, o->key) != 0) {
+        fat_free(n);
+        return NULL;
+    }
+
+    aa_release_node(o);
+    b->entry = n;
+
+    return n;
+}
+
+static size_t aa_find_slot_insert(struct aa *a, size_t hash) {
+    for (size_t m = aa_mask(a), i = hash & m, j = 1;; j++) {
+        if (!(aa_bucket_at(a, i)->hash & AA_HASH_FILLED))
+            return i;
+
+        i = (i + j) & m;
+    }
+}
+
+static size_t aa_find_slot_lookup(struct aa *a, size_t hash, aa_key_t key) {
+    if (!a || !a->pages)
+        return SIZE_MAX;
+
+    for (size_t m = aa_mask(a), i = hash & m, j = 1;; j++) {
+        struct aa_bucket *b = aa_bucket_at(a, i);
+        if (b->hash == AA_HASH_EMPTY)
+            return SIZE_MAX;
+
+        if (b->hash == hash && aa_equals(key, b->entry->key))
+            return i;
+
+        i = (i + j) & m;
+    }
+}
+
+static int aa_resize(struct aa *a, size_t s) {
+    if (!a || s == 0)
+        return -1;
+
+    struct aa_page **o = a->pages;
+    size_t odim = a->dim;
+    if (aa_alloc_htable(a, s) != 0)
+        return -1;
+
+    /* The new pages are private, every moved node gains their reference */
+    for (size_t i = 0; i < odim; i++) {
+        struct aa_bucket *ob = &o[i / AA_COW_PAGE]->buckets[i % AA_COW_PAGE];
+        if (ob->hash & AA_HASH_FILLED) {
+            *aa_bucket_at(a, aa_find_slot_insert(a, ob->hash)) = *ob;
+            atomic_fetch_add(&ob->entry->refs, 1);
+        }
+    }
+    aa_release_pages(o, odim);
+
+    a->used -= a->deleted;
+    a->deleted = 0;
+
+    return 0;
+}
+
+static int aa_grow(struct aa *a) {
+    if (!a || !a->pages)
+        return -1;
+
+    /* clang-format off */
+    size_t s = aa_len(a) * AA_SHRINK_DEN < AA_GROW_FAC * a->dim * AA_SHRINK_NUM
+            ? a->dim
+            : (AA_GROW_FAC * a->dim);
+    /* clang-format on */
+
+    return aa_resize(a, s);
+}
+
+static int aa_shrink(struct aa *a) {
+    if (!a || !a->pages)
+        return -1;
+
+    if (a->dim > AA_INIT_NUM_BUCKETS)
+        return aa_resize(a, a->dim / AA_GROW_FAC);
+
+    return 0;
+}
+
+static struct aa_node *aa_lookup(struct aa *a, size_t hash, aa_key_t key) {
+    size_t i = aa_find_slot_lookup(a, hash, key);
+
+    return i != SIZE_MAX ? aa_bucket_at(a, i)->entry : NULL;
+}
+
+/* Returns a node the caller may write to */
+static struct aa_node *aa_insert_with_hash(struct aa *a, size_t hash, aa_key_t key, bool *found) {
+    if (!a)
+        return NULL;
+
+    if (aa_init_table_if_needed(a) != 0)
+        return NULL;
+
+    size_t i = aa_find_slot_lookup(a, hash, key);
+    if (i != SIZE_MAX) {
+        if (found)
+            *found = true;
+
+        struct aa_bucket *b = aa_bucket_mut(a, i);
+        return b ? aa_node_mut(a, b) : NULL;
+    }
+
+    if (found)
+        *found = false;
+
+    i = aa_find_slot_insert(a, hash);
+    if (aa_bucket_at(a, i)->hash == AA_HASH_DELETED && a->deleted > 0)
+        a->deleted--;
+    else if (++a->used * AA_GROW_DEN > a->dim * AA_GROW_NUM) {
+        if (aa_grow(a) != 0)
+            return NULL;
+        i = aa_find_slot_insert(a, hash);
+    }
+
+    struct aa_bucket *b = aa_bucket_mut(a, i);
+    if (!b)
+        return NULL;
+
+    struct aa_node *n = (struct aa_node *)fat_malloc(sizeof(struct aa_node));
+    if (!n)
+        return NULL;
+
+    atomic_init(&n->refs, 1);
+    if (aa_assign_key(a, n, key) != 0) {
+        fat_free(n);
+        return NULL;
+    }
+
+    b->entry = n;
+    b->hash = hash;
+
+    return n;
+}
+
+static size_t aa_slots(struct aa *a) {
+    if (!a || !a->pages)
+        return 0;
+
+    return a->dim;
+}
+
+static struct aa_node *aa_slot_node(struct aa *a, size_t i) {
+    struct aa_bucket *b = aa_bucket_at(a, i);
+
+    return b->hash & AA_HASH_FILLED ? b->entry : NULL;
+}
+
+[[maybe_unused]] static size_t aa_slot_hash(struct aa *a, size_t i) { return aa_bucket_at(a, i)->hash; }
+
+/* Unlike the plain table, a removed node is released at once, it may be shared */
+static void aa_erase_slot(struct aa *a, size_t i) {
+    struct aa_bucket *b = aa_bucket_mut(a, i);
+    if (!b)
+        return;
+
+    aa_release_node(b->entry);
+    b->entry = NULL;
+    b->hash = AA_HASH_DELETED;
+    a->deleted++;
+
+    return;
+}
+
+static bool aa_erase(struct aa *a, size_t hash, aa_key_t key) {
+    size_t i = aa_find_slot_lookup(a, hash, key);
+    if (i == SIZE_MAX)
+        return false;
+
+    size_t deleted = a->deleted;
+    aa_erase_slot(a, i);
+
+    return a->deleted != deleted;
+}
+
+extern void aa_clear(struct aa *a) {
+    if (!a || !a->pages)
+        return;
+
+    aa_release_pages(a->pages, a->dim);
+    a->pages = NULL;
+    a->dim = 0;
+    a->deleted = a->used = 0;
+
+    return;
+}
+
+extern size_t aa_entries(struct aa *a) {
+    if (!a || !a->pages)
+        return 0;
+
+    return a->dim;
+}
+
+extern struct aa *aa_clone(struct aa *a) {
+    if (!a)
+        return NULL;
+
+    struct aa *c = aa_new();
+    if (!c || !a->pages)
+        return c;
+
+    c->pages = (struct aa_page **)fat_malloc(sizeof(struct aa_page *) * aa_num_pages(a->dim));
+    if (!c->pages) {
+        aa_delete(c);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < aa_num_pages(a->dim); i++) {
+        c->pages[i] = a->pages[i];
+        atomic_fetch_add(&c->pages[i]->refs, 1);
+    }
+    c->dim = a->dim;
+    c->used = a->used;
+    c->deleted = a->deleted;
+
+    return c;
+}
+#else
+static int aa_alloc_htable(struct aa *a, size_t s) {
+    if (!a || s == 0)
+        return -1;
+
+    struct aa_bucket *_Htable = (struct aa_bucket *)fat_malloc(sizeof(struct aa_bucket) * s);
+    if (!_Htable)
+        return -1;
+    a->buckets = _Htable;
+
+    return 0;
+}
+
+#ifdef AA_SMALL
+static int aa_resize(struct aa *, size_t);
+#endif /* AA_SMALL */
+
+static int aa_init_table_if_needed(struct aa *a) {
+    if (!a)
+        return -1;
+
+#ifdef AA_SMALL
+    /* Leaving the small layout, with room for one more entry */
+    if (!a->buckets) {
+        size_t s = aa_nextpow2((aa_len(a) + 1) * AA_GROW_DEN / AA_GROW_NUM + 1);
+        return aa_resize(a, s < AA_INIT_NUM_BUCKETS ? AA_INIT_NUM_BUCKETS : s);
+    }
+#else
+    if (!a->buckets)
+        if (aa_alloc_htable(a, AA_INIT_NUM_BUCKETS) != 0)
+            return -1;
+#endif /* AA_SMALL */
+
+    return 0;
+}
 
 static bool aa_empty(struct aa_bucket *b) {
     if (!b)
         return false;
 
-    return b->hash == AA_HASH_EMPTY;
+    return b->hash == AA_HASH_EMPTY;
+}
+
+static bool aa_deleted(struct aa_bucket *b) {
+    if (!b)
+        return true;
+
+    return b->hash == AA_HASH_DELETED;
+}
+
+static bool aa_filled(struct aa_bucket *b) {
+    if (!b)
+        return false;
+
+    return b->hash & AA_HASH_FILLED;
+}
+
+static size_t aa_dim(struct aa_bucket *b) {
+    if (!b)
+        return 0;
+
+    return fat_len(b) / sizeof(struct aa_bucket);
+}
+
+static size_t aa_mask(struct aa *a) {
+    if (!a)
+        return 0;
+
+    return aa_dim(a->buckets) - 1;
+}
+
+static struct aa_bucket *aa_find_slot_insert(struct aa *a, size_t hash) {
+    if (!a || !a->buckets)
+        return NULL;
+
+    for (size_t m = aa_mask(a), i = hash & m, j = 1;; j++) {
+        if (!aa_filled(&a->buckets[i]))
+            return &a->buckets[i];
+
+        i = (i + j) & m;
+    }
+}
+
+static struct aa_bucket *aa_find_slot_lookup(struct aa *a, size_t hash, aa_key_t key) {
+    if (!a || !a->buckets)
+        return NULL;
+
+    for (size_t m = aa_mask(a), i = hash & m, j = 1;; j++) {
+        if (aa_empty(&a->buckets[i]))
+            return NULL;
+
+        if (a->buckets[i].hash == hash && aa_equals(key, a->buckets[i].entry->key))
+            return &a->buckets[i];
+
+        i = (i + j) & m;
+    }
+}
+
+#ifdef AA_SMALL
+/*
+ * Small layout: while a->buckets is NULL the entries are kept in the nodes
+ * allocated with the table. Lookups compare a 32-bit tag of every node at
+ * once and confirm candidates with aa_equals, no key is hashed
+ */
+static struct aa_node *aa_small_nodes(struct aa *a) { return (struct aa_node *)a->small; }
+
+/* Length and first 3 bytes of a string, the folded bits of any other key */
+static uint32_t aa_small_tag(aa_key_t key) {
+    uint32_t tag = 0;
+#ifndef AA_KEY_EQUALS
+    if (IS_POINTER(key)) {
+        const unsigned char *bytes = (const unsigned char *)key;
+        size_t len = 0;
+        for (; len < 3 && bytes[len]; len++)
+            tag |= (uint32_t)bytes[len] << (8 * len);
+        if (len == 3)
+            len += strlen((const char *)bytes + 3);
+        tag |= (uint32_t)(len < 0xFF ? len : 0xFF) << 24;
+    } else {
+        uint64_t bits = 0;
+        memcpy(&bits, &key, sizeof(key) < sizeof(bits) ? sizeof(key) : sizeof(bits));
+        tag = (uint32_t)(bits ^ bits >> 32);
+    }
+#else
+    /* Opaque keys, every node is a candidate */
+    (void)key;
+#endif /* AA_KEY_EQUALS */
+
+    return tag;
+}
+
+/* Bit i is set when node i is in use and carries the tag */
+static uint32_t aa_small_match(struct aa *a, uint32_t tag) {
+    uint32_t mask = 0;
+#ifdef __SSE2__
+    __m128i needle = _mm_set1_epi32((int)tag);
+    for (size_t i = 0; i < AA_SMALL_N; i += 4) {
+        __m128i hits = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)&a->small_tags[i]), needle);
+        mask |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(hits)) << i;
+    }
+#else
+    for (size_t i = 0; i < AA_SMALL_N; i++)
+        mask |= (uint32_t)(a->small_tags[i] == tag) << i;
+#endif /* __SSE2__ */
+
+    return mask & a->small_mask;
+}
+
+static struct aa_node *aa_small_find(struct aa *a, aa_key_t key) {
+    struct aa_node *nodes = aa_small_nodes(a);
+    for (uint32_t m = aa_small_match(a, aa_small_tag(key)); m; m &= m - 1) {
+        struct aa_node *n = &nodes[aa_ctz(m)];
+        if (aa_equals(key, n->key))
+            return n;
+    }
+
+    return NULL;
+}
+
+/* Returns NULL when the key is new and every node is taken */
+static struct aa_node *aa_small_insert(struct aa *a, aa_key_t key, bool *found) {
+    struct aa_node *n = aa_small_find(a, key);
+    if (found)
+        *found = n != NULL;
+    if (n || a->small_mask == (uint32_t)(((uint64_t)1 << AA_SMALL_N) - 1))
+        return n;
+
+    size_t i = aa_ctz(~a->small_mask);
+    n = &aa_small_nodes(a)[i];
+    memset(n, 0, sizeof(*n));
+    if (aa_assign_key(a, n, key) != 0)
+        return NULL;
+
+    a->small_tags[i] = aa_small_tag(key);
+    a->small_mask |= (uint32_t)1 << i;
+    a->used++;
+
+    return n;
+}
+
+static void aa_small_erase(struct aa *a, size_t i) {
+    aa_release_key(&aa_small_nodes(a)[i]);
+    a->small_mask &= ~((uint32_t)1 << i);
+    a->used--;
+
+    return;
+}
+
+/* Moves the nodes out of the table into a bucket array of s buckets */
+static int aa_small_upgrade(struct aa *a, size_t s) {
+    struct aa_node *moved[AA_SMALL_N];
+    size_t n = 0;
+
+    for (uint32_t m = a->small_mask; m; m &= m - 1, n++) {
+        if (!(moved[n] = (struct aa_node *)fat_malloc(sizeof(struct aa_node)))) {
+            while (n--)
+                fat_free(moved[n]);
+            return -1;
+        }
+    }
+    if (aa_alloc_htable(a, s) != 0) {
+        while (n--)
+            fat_free(moved[n]);
+        return -1;
+    }
+
+    n = 0;
+    for (uint32_t m = a->small_mask; m; m &= m - 1, n++) {
+        *moved[n] = aa_small_nodes(a)[aa_ctz(m)];
+        size_t hash = aa_calc_hash(moved[n]->key);
+        struct aa_bucket *b = aa_find_slot_insert(a, hash);
+        b->hash = hash;
+        b->entry = moved[n];
+    }
+    a->small_mask = 0;
+
+    return 0;
+}
+#endif /* AA_SMALL */
+
+static void aa_clear_entry(struct aa_bucket *b) {
+    if (!b || !b->entry)
+        return;
+
+    aa_release_key(b->entry);
+    fat_free(b->entry);
+
+    b->entry = NULL;
+
+    return;
+}
+
+#ifdef AA_DENSE
+/*
+ * Dense layout: while the integer keys fill at least AA_DENSE_NUM/AA_DENSE_DEN
+ * of their range, a->dense holds a node for every key of the range from
+ * dense_base, and the bit of a node in a->present tells it is in use. No key
+ * is hashed, a lookup is one bit test and one indexed load. The table goes
+ * back to buckets when it falls under the shrink threshold, or when a new key
+ * would widen the range past the density
+ */
+static_assert((aa_key_t)0.5 == 0 && sizeof(aa_key_t) <= sizeof(size_t),
+              "AA_DENSE needs integer keys no wider than size_t");
+
+/* The key as a size_t of the same order, signed keys are offset by half their range */
+static size_t aa_dense_ord(aa_key_t key) {
+    aa_key_t min = (aa_key_t)((size_t)1 << (8 * sizeof(aa_key_t) - 1));
+
+    return (size_t)key - (min < 1 ? (size_t)min : 0);
+}
+
+static size_t aa_dense_dim(struct aa *a) { return fat_len(a->dense) / sizeof(struct aa_node); }
+
+static bool aa_dense_has(struct aa *a, size_t i) { return a->present[i / 64] >> (i % 64) & 1; }
+
+static struct aa_node *aa_dense_find(struct aa *a, aa_key_t key) {
+    size_t i = aa_dense_ord(key) - a->dense_base;
+
+    return i < aa_dense_dim(a) && aa_dense_has(a, i) ? &a->dense[i] : NULL;
+}
+
+static void aa_dense_erase(struct aa *a, size_t i) {
+    aa_release_key(&a->dense[i]);
+    a->present[i / 64] &= ~((uint64_t)1 << (i % 64));
+    a->used--;
+
+    return;
+}
+
+/* Widens the range of keys seen while hashed */
+static void aa_dense_track(struct aa *a, aa_key_t key) {
+    size_t k = aa_dense_ord(key);
+    if (aa_len(a) == 1 || k < a->key_lo)
+        a->key_lo = k;
+    if (aa_len(a) == 1 || k > a->key_hi)
+        a->key_hi = k;
+
+    return;
+}
+
+/* Nodes and bits for dim keys from base, the nodes in use are moved over */
+static int aa_dense_alloc(struct aa *a, size_t base, size_t dim) {
+    if (base > SIZE_MAX - (dim - 1))
+        base = SIZE_MAX - (dim - 1);
+
+    struct aa_node *dense = (struct aa_node *)fat_malloc(sizeof(struct aa_node) * dim);
+    uint64_t *present = (uint64_t *)fat_malloc(sizeof(uint64_t) * ((dim + 63) / 64));
+    if (!dense || !present) {
+        if (dense)
+            fat_free(dense);
+        if (present)
+            fat_free(present);
+        return -1;
+    }
+
+    if (a->dense) {
+        for (size_t w = 0; w < (aa_dense_dim(a) + 63) / 64; w++) {
+            for (uint64_t m = a->present[w]; m; m &= m - 1) {
+                size_t i = w * 64 + aa_ctz(m), j = a->dense_base + i - base;
+                dense[j] = a->dense[i];
+                present[j / 64] |= (uint64_t)1 << (j % 64);
+            }
+        }
+        fat_free(a->dense);
+        fat_free(a->present);
+    }
+    a->dense = dense;
+    a->present = present;
+    a->dense_base = base;
+
+    return 0;
+}
+
+/* Takes the nodes of the buckets over once the keys are dense enough */
+static void aa_dense_enter(struct aa *a) {
+    size_t span = a->key_hi - a->key_lo + 1;
+    if (aa_len(a) < AA_DENSE_MIN || span == 0 || span > SIZE_MAX / 2 / sizeof(struct aa_node) ||
+        aa_len(a) * AA_DENSE_DEN < span * AA_DENSE_NUM)
+        return;
+
+    /* Stays hashed without the memory */
+    if (aa_dense_alloc(a, a->key_lo, aa_nextpow2(span)) != 0)
+        return;
+
+    for (size_t i = 0; i < aa_dim(a->buckets); i++) {
+        struct aa_bucket *b = &a->buckets[i];
+        if (aa_filled(b)) {
+            size_t j = aa_dense_ord(b->entry->key) - a->dense_base;
+            a->dense[j] = *b->entry;
+            a->present[j / 64] |= (uint64_t)1 << (j % 64);
+            fat_free(b->entry);
+        } else
+            aa_clear_entry(b);
+    }
+
+    fat_free(a->buckets);
+    a->buckets = NULL;
+    a->used -= a->deleted;
+    a->deleted = 0;
+
+    return;
+}
+
+/* Back to a bucket array sized for the entries, the range is kept for aa_dense_enter */
+static int aa_dense_leave(struct aa *a) {
+    size_t s = aa_nextpow2(AA_INIT_DEN * aa_len(a) / AA_INIT_NUM);
+    if (aa_alloc_htable(a, s < AA_INIT_NUM_BUCKETS ? AA_INIT_NUM_BUCKETS : s) != 0)
+        return -1;
+
+    bool lowest = true;
+    for (size_t w = 0; w < (aa_dense_dim(a) + 63) / 64; w++) {
+        for (uint64_t m = a->present[w]; m; m &= m - 1) {
+            size_t i = w * 64 + aa_ctz(m);
+            struct aa_node *n = (struct aa_node *)fat_malloc(sizeof(struct aa_node));
+            if (!n) {
+                /* The dense nodes are untouched, the copies go */
+                for (size_t j = 0; j < aa_dim(a->buckets); j++)
+                    if (a->buckets[j].entry)
+                        fat_free(a->buckets[j].entry);
+                fat_free(a->buckets);
+                a->buckets = NULL;
+                return -1;
+            }
+
+            *n = a->dense[i];
+            size_t hash = aa_calc_hash(n->key);
+            struct aa_bucket *b = aa_find_slot_insert(a, hash);
+            b->hash = hash;
+            b->entry = n;
+            /* Ascending, from the lowest key to the highest */
+            if (lowest) {
+                a->key_lo = a->dense_base + i;
+                lowest = false;
+            }
+            a->key_hi = a->dense_base + i;
+        }
+    }
+
+    fat_free(a->dense);
+    fat_free(a->present);
+    a->dense = NULL;
+    a->present = NULL;
+
+    return 0;
+}
+
+/* Widens the range to the key at k, or leaves the dense layout when that would be too sparse */
+static int aa_dense_cover(struct aa *a, size_t k) {
+    size_t lo = a->dense_base, hi = lo + aa_dense_dim(a) - 1;
+    if (k < lo)
+        lo = k;
+    else
+        hi = k;
+
+    size_t span = hi - lo + 1;
+    if (span == 0 || span > SIZE_MAX / 2 / sizeof(struct aa_node) ||
+        (aa_len(a) + 1) * AA_DENSE_DEN < span * AA_DENSE_NUM) {
+        /* The caller tells by a->dense whether the key now goes to the buckets */
+        aa_dense_leave(a);
+        return -1;
+    }
+
+    size_t dim = aa_nextpow2(span);
+
+    return aa_dense_alloc(a, k < a->dense_base ? (hi >= dim - 1 ? hi - (dim - 1) : 0) : lo, dim);
+}
+
+/* Returns NULL with a->dense cleared when the key is too far for the dense layout */
+static struct aa_node *aa_dense_insert(struct aa *a, aa_key_t key, bool *found) {
+    size_t k = aa_dense_ord(key);
+    if (k - a->dense_base >= aa_dense_dim(a) && aa_dense_cover(a, k) != 0)
+        return NULL;
+
+    size_t i = k - a->dense_base;
+    struct aa_node *n = &a->dense[i];
+    if (found)
+        *found = aa_dense_has(a, i);
+    if (aa_dense_has(a, i))
+        return n;
+
+    memset(n, 0, sizeof(*n));
+    if (aa_assign_key(a, n, key) != 0)
+        return NULL;
+
+    a->present[i / 64] |= (uint64_t)1 << (i % 64);
+    a->used++;
+
+    return n;
+}
+#endif /* AA_DENSE */
+
+static int aa_resize(struct aa *a, size_t s) {
+    if (!a || s == 0)
+        return -1;
+
+#ifdef AA_SMALL
+    if (!a->buckets)
+        return aa_small_upgrade(a, s);
+#endif /* AA_SMALL */
+
+    struct aa_bucket *o = a->buckets;
+    if (aa_alloc_htable(a, s) != 0)
+        return -1;
+
+#ifdef AA_DENSE
+    /* Removed keys no longer count in the range */
+    a->key_lo = SIZE_MAX;
+    a->key_hi = 0;
+#endif /* AA_DENSE */
+    for (size_t i = 0; i < aa_dim(o); i++) {
+        struct aa_bucket *ob = &o[i];
+        if (aa_filled(ob)) {
+            struct aa_bucket *nb = aa_find_slot_insert(a, ob->hash);
+            if (nb)
+                *nb = *ob;
+#ifdef AA_DENSE
+            size_t k = aa_dense_ord(ob->entry->key);
+            a->key_lo = k < a->key_lo ? k : a->key_lo;
+            a->key_hi = k > a->key_hi ? k : a->key_hi;
+#endif /* AA_DENSE */
+        } else if (aa_empty(ob) || aa_deleted(ob))
+            aa_clear_entry(ob);
+    }
+
+    a->used -= a->deleted;
+    a->deleted = 0;
+
+    if (o)
+        fat_free(o);
+
+    return 0;
+}
+
+static int aa_grow(struct aa *a) {
+    if (!a || !a->buckets)
+        return -1;
+
+    /* clang-format off */
+    size_t s = aa_len(a) * AA_SHRINK_DEN < AA_GROW_FAC * aa_dim(a->buckets) * AA_SHRINK_NUM
+            ? aa_dim(a->buckets)
+            : (AA_GROW_FAC * aa_dim(a->buckets));
+    /* clang-format on */
+
+    return aa_resize(a, s);
+}
+
+static int aa_shrink(struct aa *a) {
+#ifdef AA_DENSE
+    if (a && a->dense)
+        return aa_dense_leave(a);
+#endif /* AA_DENSE */
+    if (!a || !a->buckets)
+        return -1;
+
+    if (aa_dim(a->buckets) > AA_INIT_NUM_BUCKETS)
+        return aa_resize(a, aa_dim(a->buckets) / AA_GROW_FAC);
+
+    return 0;
+}
+
+static struct aa_node *aa_lookup(struct aa *a, size_t hash, aa_key_t key) {
+#ifdef AA_SMALL
+    if (a && !a->buckets)
+        return aa_small_find(a, key);
+#endif /* AA_SMALL */
+#ifdef AA_DENSE
+    if (a && a->dense)
+        return aa_dense_find(a, key);
+#endif /* AA_DENSE */
+    struct aa_bucket *b = aa_find_slot_lookup(a, hash, key);
+
+    return b ? b->entry : NULL;
+}
+
+static struct aa_node *aa_insert_with_hash(struct aa *a, size_t hash, aa_key_t key, bool *found) {
+    if (!a)
+        return NULL;
+
+#ifdef AA_SMALL
+    if (!a->buckets) {
+        struct aa_node *n = aa_small_insert(a, key, found);
+        if (n || aa_len(a) < AA_SMALL_N)
+            return n;
+        /* Full, the key goes to the bucket array with the others */
+        if (hash == AA_HASH_EMPTY)
+            hash = aa_calc_hash(key);
+    }
+#endif /* AA_SMALL */
+#ifdef AA_DENSE
+    if (a->dense) {
+        struct aa_node *n = aa_dense_insert(a, key, found);
+        if (n || a->dense)
+            return n;
+        /* Too far from the others, the key goes to the buckets they moved to */
+        if (hash == AA_HASH_EMPTY)
+            hash = aa_calc_hash(key);
+    }
+#endif /* AA_DENSE */
+
+    if (aa_init_table_if_needed(a) != 0)
+        return NULL;
+
+    struct aa_bucket *b = aa_find_slot_lookup(a, hash, key);
+
+    if (b && b->entry) {
+        if (found)
+            *found = true;
+        return b->entry;
+    }
+
+    if (found)
+        *found = false;
+
+    b = aa_find_slot_insert(a, hash);
+    if (!b)
+        return NULL;
+
+    if (aa_deleted(b) && a->deleted > 0)
+        a->deleted--;
+    else if (++a->used * AA_GROW_DEN > aa_dim(a->buckets) * AA_GROW_NUM) {
+        if (aa_grow(a) != 0)
+            return NULL;
+        b = aa_find_slot_insert(a, hash);
+    }
+
+    if (aa_deleted(b)) {
+        aa_release_key(b->entry);
+        if (aa_assign_key(a, b->entry, key) != 0)
+            return NULL;
+    } else {
+        struct aa_node *n = (struct aa_node *)fat_malloc(sizeof(struct aa_node));
+        if (!n)
+            return NULL;
+
+        if (aa_assign_key(a, n, key) != 0) {
+            fat_free(n);
+            return NULL;
+        }
+
+        b->entry = n;
+    }
+
+    b->hash = hash;
+#ifdef AA_DENSE
+    /* With the new key the keys may fill their range */
+    aa_dense_track(a, key);
+    aa_dense_enter(a);
+    if (a->dense)
+        return aa_dense_find(a, key);
+#endif /* AA_DENSE */
+
+    return b->entry;
+}
+
+static bool aa_erase(struct aa *a, size_t hash, aa_key_t key) {
+#ifdef AA_SMALL
+    if (a && !a->buckets) {
+        struct aa_node *n = aa_small_find(a, key);
+        if (n)
+            aa_small_erase(a, (size_t)(n - aa_small_nodes(a)));
+        return n != NULL;
+    }
+#endif /* AA_SMALL */
+#ifdef AA_DENSE
+    if (a && a->dense) {
+        struct aa_node *n = aa_dense_find(a, key);
+        if (n)
+            aa_dense_erase(a, (size_t)(n - a->dense));
+        return n != NULL;
+    }
+#endif /* AA_DENSE */
+    struct aa_bucket *p = aa_find_slot_lookup(a, hash, key);
+    if (!p)
+        return false;
+
+    p->hash = AA_HASH_DELETED;
+    a->deleted++;
+#ifdef AA_KEY_POOL
+    /* Tombstones must not hold pooled keys, a compaction only sees filled buckets */
+    aa_release_key(p->entry);
+#endif /* AA_KEY_POOL */
+
+    return true;
+}
+
+static size_t aa_slots(struct aa *a) {
+#ifdef AA_SMALL
+    if (a && !a->buckets)
+        return AA_SMALL_N;
+#endif /* AA_SMALL */
+#ifdef AA_DENSE
+    if (a && a->dense)
+        return aa_dense_dim(a);
+#endif /* AA_DENSE */
+    if (!a || !a->buckets)
+        return 0;
+
+    return aa_dim(a->buckets);
+}
+
+static struct aa_node *aa_slot_node(struct aa *a, size_t i) {
+#ifdef AA_SMALL
+    if (!a->buckets)
+        return a->small_mask & ((uint32_t)1 << i) ? &aa_small_nodes(a)[i] : NULL;
+#endif /* AA_SMALL */
+#ifdef AA_DENSE
+    if (a->dense)
+        return aa_dense_has(a, i) ? &a->dense[i] : NULL;
+#endif /* AA_DENSE */
+    return aa_filled(&a->buckets[i]) ? a->buckets[i].entry : NULL;
+}
+
+[[maybe_unused]] static size_t aa_slot_hash(struct aa *a, size_t i) {
+#ifdef AA_SMALL
+    /* Computed on demand, small tables keep no hashes */
+    if (!a->buckets)
+        return aa_calc_hash(aa_small_nodes(a)[i].key);
+#endif /* AA_SMALL */
+#ifdef AA_DENSE
+    /* Dense tables keep no hashes either */
+    if (a->dense)
+        return aa_calc_hash(a->dense[i].key);
+#endif /* AA_DENSE */
+    return a->buckets[i].hash;
+}
+
+static void aa_erase_slot(struct aa *a, size_t i) {
+#ifdef AA_SMALL
+    if (!a->buckets) {
+        aa_small_erase(a, i);
+        return;
+    }
+#endif /* AA_SMALL */
+#ifdef AA_DENSE
+    if (a->dense) {
+        aa_dense_erase(a, i);
+        return;
+    }
+#endif /* AA_DENSE */
+    a->buckets[i].hash = AA_HASH_DELETED;
+    a->deleted++;
+#ifdef AA_KEY_POOL
+    aa_release_key(a->buckets[i].entry);
+#endif /* AA_KEY_POOL */
+
+    return;
+}
+
+extern void aa_clear(struct aa *a) {
+#ifdef AA_SMALL
+    if (a && !a->buckets) {
+        for (uint32_t m = a->small_mask; m; m &= m - 1)
+            aa_small_erase(a, aa_ctz(m));
+        return;
+    }
+#endif /* AA_SMALL */
+#ifdef AA_DENSE
+    if (a && a->dense) {
+        for (size_t i = 0; i < aa_dense_dim(a); i++)
+            if (aa_dense_has(a, i))
+                aa_release_key(&a->dense[i]);
+        fat_free(a->dense);
+        fat_free(a->present);
+        a->dense = NULL;
+        a->present = NULL;
+        a->deleted = a->used = 0;
+        return;
+    }
+#endif /* AA_DENSE */
+    if (!a || !a->buckets)
+        return;
+
+    for (size_t i = 0; i < aa_dim(a->buckets); i++)
+        aa_clear_entry(&a->buckets[i]);
+
+    fat_free(a->buckets);
+    a->buckets = NULL;
+    a->deleted = a->used = 0;
+
+    return;
+}
+
+extern size_t aa_entries(struct aa *a) {
+#ifdef AA_DENSE
+    if (a && a->dense)
+        return aa_dense_dim(a);
+#endif /* AA_DENSE */
+    if (!a || !a->buckets)
+        return 0;
+
+    return aa_dim(a->buckets);
+}
+
+#if !defined(AA_MULTI) && !defined(AA_TTL) && !defined(AA_CACHE)
+/*
+ * Merging: the node of slot i of src goes to a as it is, with its hash, a
+ * has room for every entry of src. Returns the node of a holding the key,
+ * which is the one of src if it moved, the slot of src then lets go of it
+ */
+static struct aa_node *aa_move_slot(struct aa *a, struct aa *src, size_t i) {
+    struct aa_bucket *s = &src->buckets[i];
+
+    /* The node of src is only read on a matching hash */
+    for (size_t m = aa_mask(a), j = s->hash & m, k = 1; !aa_empty(&a->buckets[j]); j = (j + k++) & m)
+        if (a->buckets[j].hash == s->hash && aa_equals(s->entry->key, a->buckets[j].entry->key))
+            return a->buckets[j].entry;
+
+    struct aa_bucket *b = aa_find_slot_insert(a, s->hash);
+    if (aa_deleted(b)) {
+        aa_clear_entry(b);
+        a->deleted--;
+    } else
+        a->used++;
+    *b = *s;
+    s->entry = NULL;
+
+    return b->entry;
+}
+
+#ifdef AA_PARALLEL
+/*
+ * The same from several threads at once, a holding no tombstones and the
+ * caller counting the moves. A thread claims an empty bucket by its entry,
+ * the hash follows; a bucket whose hash is still 0 was claimed by another
+ * thread for another key of src, as src holds no key twice
+ */
+static struct aa_node *aa_claim_slot(struct aa *a, struct aa *src, size_t i) {
+    struct aa_bucket *s = &src->buckets[i];
+    struct aa_node *n = s->entry;
+
+    for (size_t m = aa_mask(a), j = s->hash & m, k = 1;; k++) {
+        struct aa_bucket *b = &a->buckets[j];
+        struct aa_node *e = __atomic_load_n(&b->entry, __ATOMIC_ACQUIRE);
+        if (!e && __atomic_compare_exchange_n(&b->entry, &e, n, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&b->hash, s->hash, __ATOMIC_RELAXED);
+            s->entry = NULL;
+            return n;
+        }
+
+        if (__atomic_load_n(&b->hash, __ATOMIC_RELAXED) == s->hash && aa_equals(n->key, e->key))
+            return e;
+
+        j = (j + k) & m;
+    }
+}
+#endif /* AA_PARALLEL */
+#endif /* !AA_MULTI && !AA_TTL && !AA_CACHE */
+#endif /* AA_COMPACT */
+
+[[maybe_unused]] static int aa_reserve(struct aa *a, size_t n) {
+    if (!a)
+        return -1;
+#ifdef AA_SMALL
+    if (!a->buckets && n <= AA_SMALL_N)
+        return 0;
+#endif /* AA_SMALL */
+#ifdef AA_DENSE
+    /* The range widens with the keys */
+    if (a->dense)
+        return 0;
+#endif /* AA_DENSE */
+
+    if (aa_init_table_if_needed(a) != 0)
+        return -1;
+
+    /* Room for n live entries without crossing the grow threshold */
+    if (n * AA_GROW_DEN <= aa_entries(a) * AA_GROW_NUM)
+        return 0;
+
+    return aa_resize(a, aa_nextpow2(n * AA_GROW_DEN / AA_GROW_NUM + 1));
+}
+
+static int aa_shrink_to_fit(struct aa *a) {
+    if (!a)
+        return -1;
+
+    if (aa_len(a) == 0)
+        aa_clear(a);
+    else if (aa_len(a) * AA_SHRINK_DEN < aa_entries(a) * AA_SHRINK_NUM)
+        return aa_rehash(a);
+    else if (a->deleted > aa_len(a))
+        /* Mostly tombstones, rebuild at the same size */
+        return aa_resize(a, aa_entries(a));
+
+    return 0;
+}
+
+#ifdef AA_TTL
+/**
+ * @brief The pending expiration of an entry, keeps its own copy of the key.
+ * An entry holds at most one, the slot lists are doubly linked so that
+ * setting or removing the entry moves or unlinks it in place
+ */
+struct aa_timer {
+    struct aa_timer *next, **prev; /* prev points at the link to this timer */
+    size_t *count;                  /* Count of its wheel level, NULL on the due list */
+    size_t hash;
+    uint64_t expires;
+    struct aa_node node;
+};
+
+static void aa_timer_push(struct aa_timer **head, struct aa_timer *t, size_t *count) {
+    t->next = *head;
+    if (t->next)
+        t->next->prev = &t->next;
+    t->prev = head;
+    *head = t;
+    t->count = count;
+    if (count)
+        (*count)++;
+
+    return;
+}
+
+static void aa_timer_unlink(struct aa_timer *t) {
+    if (!t->prev)
+        return;
+
+    *t->prev = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+    if (t->count)
+        (*t->count)--;
+    t->next = NULL;
+    t->prev = NULL;
+    t->count = NULL;
+
+    return;
+}
+
+static void aa_timer_free(struct aa_timer *t) {
+    if (!t)
+        return;
+
+    aa_timer_unlink(t);
+    aa_release_key(&t->node);
+    fat_free(t);
+
+    return;
+}
+
+static void aa_wheel_link(struct aa *a, struct aa_timer *t) {
+    if (t->expires <= a->tick) {
+        aa_timer_push(&a->due, t, NULL);
+        return;
+    }
+
+    /* The lowest level whose span covers the delay, far timers park at the top */
+    uint64_t delta = t->expires - a->tick, expires = t->expires;
+    size_t level = 0;
+    while (level < AA_WHEEL_LEVELS - 1 && delta >> (AA_WHEEL_BITS * (level + 1)))
+        level++;
+    if (delta >> (AA_WHEEL_BITS * AA_WHEEL_LEVELS))
+        expires = a->tick + ((uint64_t)1 << (AA_WHEEL_BITS * AA_WHEEL_LEVELS)) - 1;
+
+    size_t i = level * AA_WHEEL_SLOTS + (size_t)(expires >> (AA_WHEEL_BITS * level) & (AA_WHEEL_SLOTS - 1));
+    aa_timer_push(&a->wheel[i], t, &a->wheel_count[level]);
+
+    return;
+}
+
+/* The timer t an entry already has, or a new unlinked one for key */
+static struct aa_timer *aa_wheel_timer(struct aa *a, struct aa_timer *t, size_t hash, aa_key_t key) {
+    if (!a->wheel) {
+        a->wheel = (struct aa_timer **)fat_malloc(AA_WHEEL_LEVELS * AA_WHEEL_SLOTS * sizeof(*a->wheel));
+        if (!a->wheel)
+            return NULL;
+        a->tick = a->now;
+    }
+    if (t)
+        return t;
+
+    t = (struct aa_timer *)fat_malloc(sizeof(struct aa_timer));
+    if (!t)
+        return NULL;
+    if (aa_assign_key(a, &t->node, key) != 0) {
+        fat_free(t);
+        return NULL;
+    }
+    t->hash = hash;
+
+    return t;
+}
+
+/* Moves the slot a level has just reached down to the lower levels */
+static void aa_wheel_cascade(struct aa *a, size_t level) {
+    size_t i = level * AA_WHEEL_SLOTS + (size_t)(a->tick >> (AA_WHEEL_BITS * level) & (AA_WHEEL_SLOTS - 1));
+    struct aa_timer *t = a->wheel[i];
+    a->wheel[i] = NULL;
+
+    /* Detached first, far timers may land in this slot again */
+    while (t) {
+        struct aa_timer *next = t->next;
+        a->wheel_count[level]--;
+        aa_wheel_link(a, t);
+        t = next;
+    }
+
+    return;
+}
+
+/*
+ * Moves the wheel to the next tick holding timers, no further than a->now,
+ * and puts the timers of that tick on the due list. Returns false when
+ * there is no such tick
+ */
+static bool aa_wheel_step(struct aa *a) {
+    size_t level = 0;
+    while (level < AA_WHEEL_LEVELS && !a->wheel_count[level])
+        level++;
+    if (level == AA_WHEEL_LEVELS) {
+        a->tick = a->now;
+        return false;
+    }
+
+    /* With the lower levels empty, nothing happens before the next boundary of this one */
+    uint64_t span = (uint64_t)1 << (AA_WHEEL_BITS * level), next = (a->tick + span) & ~(span - 1);
+    if (next > a->now || next <= a->tick)
+        return false;
+    a->tick = next;
+
+    for (size_t l = AA_WHEEL_LEVELS - 1; l > 0; l--)
+        if (!(a->tick & (((uint64_t)1 << (AA_WHEEL_BITS * l)) - 1)))
+            aa_wheel_cascade(a, l);
+
+    struct aa_timer **slot = &a->wheel[a->tick & (AA_WHEEL_SLOTS - 1)];
+    while (*slot) {
+        struct aa_timer *t = *slot;
+        aa_timer_unlink(t);
+        aa_timer_push(&a->due, t, NULL);
+    }
+
+    return true;
+}
+
+/* Every timer belongs to an entry, aa_clear has freed them all */
+static void aa_wheel_free(struct aa *a) {
+    if (a->wheel)
+        fat_free(a->wheel);
+    a->wheel = NULL;
+
+    return;
+}
+#endif /* AA_TTL */
+
+#ifdef AA_BLOOM
+#ifndef AA_BLOOM_BITS
+#define AA_BLOOM_BITS 8
+#endif /* AA_BLOOM_BITS */
+
+/* Blocked Bloom filter: every key sets 4 bits of a single 64-bit word */
+static uint64_t aa_bloom_bits(size_t hash) {
+    uint64_t bits = 0;
+    size_t h = aa_mix(hash);
+    for (size_t i = 0; i < 4; i++, h >>= 6)
+        bits |= (uint64_t)1 << (h & 63);
+
+    return bits;
+}
+
+static bool aa_bloom_test(struct aa *a, size_t hash) {
+    if (!a->bloom)
+        return true;
+
+    uint64_t bits = aa_bloom_bits(hash);
+    return (a->bloom[hash & (a->bloom_words - 1)] & bits) == bits;
+}
+
+static void aa_bloom_free(struct aa *a) {
+    if (a->bloom)
+        fat_free(a->bloom);
+    a->bloom = NULL;
+    a->bloom_words = a->bloom_dim = a->bloom_stale = 0;
+
+    return;
+}
+
+/* Fills the filter from the stored hashes, without a filter lookups probe the table */
+static void aa_bloom_rebuild(struct aa *a) {
+    size_t dim = aa_entries(a), words = aa_nextpow2(dim * AA_BLOOM_BITS / 64);
+    if (dim == 0) {
+        aa_bloom_free(a);
+        return;
+    }
+
+    if (words != a->bloom_words) {
+        aa_bloom_free(a);
+        a->bloom = (uint64_t *)fat_malloc(sizeof(uint64_t) * words);
+        if (a->bloom)
+            a->bloom_words = words;
+    }
+    /* Not retried on failure before the next resize */
+    a->bloom_dim = dim;
+    a->bloom_stale = 0;
+    if (!a->bloom)
+        return;
+
+    memset(a->bloom, 0, sizeof(uint64_t) * words);
+    for (size_t i = 0; i < aa_slots(a); i++) {
+        if (aa_slot_node(a, i)) {
+            size_t hash = aa_slot_hash(a, i);
+            a->bloom[hash & (words - 1)] |= aa_bloom_bits(hash);
+        }
+    }
+
+    return;
+}
+
+/* Called after a key was added, a resize rebuilds the filter at the new size */
+static void aa_bloom_add(struct aa *a, size_t hash) {
+    if (a->bloom_dim != aa_entries(a))
+        aa_bloom_rebuild(a);
+    else if (a->bloom)
+        a->bloom[hash & (a->bloom_words - 1)] |= aa_bloom_bits(hash);
+
+    return;
+}
+
+/* Removed keys leave their bits set, rebuild once they outnumber the live ones */
+static void aa_bloom_remove(struct aa *a) {
+    if (a->bloom_dim != aa_entries(a) || ++a->bloom_stale > aa_len(a))
+        aa_bloom_rebuild(a);
+
+    return;
+}
+#endif /* AA_BLOOM */
+
+#ifdef AA_KEY_POOL
+#ifndef AA_KEY_POOL_COMPACT_MIN
+#define AA_KEY_POOL_COMPACT_MIN 65536
+#endif /* AA_KEY_POOL_COMPACT_MIN */
+
+/* Visits the nodes of every table in the pool */
+static struct aa_node *aa_pool_node(struct aa_key_pool *pool, size_t *t, size_t *i) {
+    for (; *t < pool->ntables; (*t)++, *i = 0) {
+        while (*i < aa_slots(pool->tables[*t])) {
+            struct aa_node *n = aa_slot_node(pool->tables[*t], (*i)++);
+            if (n && (const char *)n->key)
+                return n;
+        }
+    }
+
+    return NULL;
+}
+
+static void aa_pool_unmark(struct aa_key_pool *pool) {
+    size_t t = 0, i = 0;
+    for (struct aa_node *n; pool->shared && (n = aa_pool_node(pool, &t, &i));)
+        aa_pooled((const char *)n->key)->mark = 0;
+
+    return;
+}
+
+extern struct aa_key_pool_stats aa_key_pool_stats(struct aa_key_pool *pool) {
+    struct aa_key_pool_stats stats = {};
+    if (!pool)
+        return stats;
+
+    /* Every node of a private pool has a key of its own, shared keys count on the first node */
+    size_t t = 0, i = 0;
+    for (struct aa_node *n; (n = aa_pool_node(pool, &t, &i));) {
+        const char *bytes = (const char *)n->key;
+        if (pool->shared && aa_pooled(bytes)->mark)
+            continue;
+        if (pool->shared)
+            aa_pooled(bytes)->mark = 1;
+        stats.keys++;
+        stats.bytes += aa_pooled_size(pool, strlen(bytes));
+    }
+    aa_pool_unmark(pool);
+
+    for (i = 0; i < pool->npages; i++)
+        stats.capacity += pool->pages[i].size;
+    stats.capacity += sizeof(uint32_t) * pool->index_dim;
+
+    return stats;
+}
+
+extern int aa_key_pool_compact(struct aa_key_pool *pool) {
+    if (!pool)
+        return -1;
+
+    struct aa_key_pool_stats stats = aa_key_pool_stats(pool);
+    struct aa_key_pool fresh = {.shared = pool->shared};
+    size_t t = 0, i = 0;
+    uint32_t off;
+
+    /* The first page fits the live keys */
+    if (stats.keys) {
+        fresh.page_size = stats.bytes + _Alignof(struct aa_pooled_key);
+        if (fresh.page_size > (size_t)1 << AA_KEY_POOL_PAGE_BITS)
+            fresh.page_size = (size_t)1 << AA_KEY_POOL_PAGE_BITS;
+    }
+    if (!pool->shared) {
+        /* Nothing points into private pages, one page takes all the keys and the copies cannot fail */
+        if (stats.keys && aa_pool_add_page(&fresh, stats.bytes) != 0)
+            return -1;
+        for (struct aa_node *n; (n = aa_pool_node(pool, &t, &i));)
+            n->key = (aa_key_t)aa_pool_append(&fresh, (const char *)n->key, strlen((const char *)n->key), &off);
+    } else {
+        /* Copy the live keys first, the pool stays untouched if that fails */
+        if (stats.keys && aa_pool_index_resize(&fresh, aa_nextpow2(stats.keys * 4 / 3 + 1)) != 0)
+            return -1;
+        for (struct aa_node *n; (n = aa_pool_node(pool, &t, &i));) {
+            const char *bytes = (const char *)n->key;
+            size_t len = strlen(bytes);
+            if (aa_pooled(bytes)->mark)
+                continue;
+            if (!aa_pool_append(&fresh, bytes, len, &off)) {
+                aa_pool_unmark(pool);
+                aa_pool_free_pages(&fresh);
+                return -1;
+            }
+            aa_pool_index_put(&fresh, off, aa_fnv1a(bytes, len));
+            /* The old key forwards the nodes that share it */
+            aa_pooled(bytes)->mark = off;
+        }
+
+        t = i = 0;
+        for (struct aa_node *n; (n = aa_pool_node(pool, &t, &i));)
+            n->key = (aa_key_t)aa_pool_key_at(&fresh, aa_pooled((const char *)n->key)->mark)->bytes;
+    }
+
+    aa_pool_free_pages(pool);
+    pool->pages = fresh.pages;
+    pool->npages = fresh.npages;
+    pool->pages_cap = fresh.pages_cap;
+    pool->page_size = fresh.page_size;
+    pool->index = fresh.index;
+    pool->index_dim = fresh.index_dim;
+    pool->index_used = fresh.index_used;
+
+    return 0;
+}
+
+/*
+ * Runs after removals that shrank a table, once dead keys outweigh the live
+ * ones. Only private pools: compacting a shared one moves the keys of the
+ * other tables, which may be in use on other threads
+ */
+static void aa_pool_maybe_compact(struct aa *a) {
+    struct aa_key_pool *pool = a->key_pool;
+    if (!pool || pool->shared)
+        return;
+
+    size_t used = 0;
+    for (size_t i = 0; i < pool->npages; i++)
+        used += pool->pages[i].used;
+    if (used < AA_KEY_POOL_COMPACT_MIN)
+        return;
+
+    if (aa_key_pool_stats(pool).bytes * 2 < used)
+        aa_key_pool_compact(pool);
+
+    return;
+}
+
+extern int aa_set_key_pool(struct aa *a, struct aa_key_pool *pool) {
+    if (!a || !pool || aa_len(a) != 0)
+        return -1;
+
+    if (a->key_pool == pool)
+        return 0;
+
+    return aa_pool_attach(a, pool);
+}
+#endif /* AA_KEY_POOL */
+
+/* A lookup that skips the probe when the prefilter rules the key out */
+static struct aa_node *aa_find(struct aa *a, size_t hash, aa_key_t key) {
+#ifdef AA_BLOOM
+    if (!aa_bloom_test(a, hash))
+        return NULL;
+#endif /* AA_BLOOM */
+
+    return aa_lookup(a, hash, key);
+}
+
+/* The hash taken by the entry points, small and dense tables are searched without one */
+static size_t aa_key_hash(struct aa *a, aa_key_t key) {
+    (void)a;
+#ifdef AA_SMALL
+    if (a && !a->buckets)
+        return AA_HASH_EMPTY;
+#endif /* AA_SMALL */
+#ifdef AA_DENSE
+    if (a && a->dense)
+        return AA_HASH_EMPTY;
+#endif /* AA_DENSE */
+
+    return aa_calc_hash(key);
+}
+
+extern struct aa *aa_new(void) {
+#ifdef AA_SMALL
+    struct aa *a = (struct aa *)fat_malloc(sizeof(struct aa) + sizeof(struct aa_node) * AA_SMALL_N);
+#else
+    struct aa *a = (struct aa *)fat_malloc(sizeof(struct aa));
+#endif /* AA_SMALL */
+    if (!a)
+        return NULL;
+
+    *a = (struct aa){};
+
+    return a;
+}
+
+extern void aa_delete(struct aa *a) {
+    if (!a)
+        return;
+
+#ifdef AA_WAL
+    aa_wal_close(a);
+#endif /* AA_WAL */
+#ifdef AA_BLOOM
+    aa_bloom_free(a);
+#endif /* AA_BLOOM */
+    aa_clear(a);
+#ifdef AA_TTL
+    aa_wheel_free(a);
+#endif /* AA_TTL */
+#ifdef AA_MULTI
+    aa_pool_free(a);
+#endif /* AA_MULTI */
+#ifdef AA_KEY_POOL
+    aa_pool_detach(a);
+#endif /* AA_KEY_POOL */
+    fat_free(a);
+
+    return;
+}
+
+#if defined(AA_TRACE) || defined(AA_WAL) || defined(AA_SPILL)
+/* On-disk form of a key: the string for pointer keys, the raw bytes otherwise */
+static size_t aa_key_bytes(const aa_key_t *key, const void **bytes) {
+#ifndef AA_KEY_EQUALS
+    if (IS_POINTER(*key)) {
+        *bytes = (const void *)*key;
+        return strlen((const char *)*key);
+    }
+#endif /* AA_KEY_EQUALS */
+    *bytes = key;
+
+    return sizeof(*key);
+}
+
+static size_t aa_put_varint(unsigned char *buf, uint64_t x) {
+    size_t n = 0;
+    for (; x >= 0x80; x >>= 7)
+        buf[n++] = (unsigned char)(x & 0x7F) | 0x80;
+    buf[n++] = (unsigned char)x;
+
+    return n;
+}
+
+static int aa_get_varint(FILE *in, uint64_t *x) {
+    *x = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        int c = getc(in);
+        if (c == EOF)
+            return -1;
+        *x |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80))
+            return 0;
+    }
+
+    return -1;
+}
+
+/* Pointer keys point into bytes, which needs room for the terminator */
+[[maybe_unused]] static int aa_key_from_bytes(aa_key_t *key, unsigned char *bytes, size_t len) {
+    memset(key, 0, sizeof(*key));
+#ifndef AA_KEY_EQUALS
+    if (IS_POINTER(*key)) {
+        bytes[len] = '\0';
+        memcpy(key, &bytes, sizeof(*key) < sizeof(bytes) ? sizeof(*key) : sizeof(bytes));
+        return 0;
+    }
+#endif /* AA_KEY_EQUALS */
+    if (len != sizeof(*key))
+        return -1;
+    memcpy(key, bytes, len);
+
+    return 0;
+}
+#endif /* AA_TRACE || AA_WAL || AA_SPILL */
+
+#ifdef AA_TRACE
+static const unsigned char aa_trace_magic[8] = {'A', 'A', 'T', 'R', 'A', 'C', 'E', 1};
+
+static uint64_t aa_trace_clock(void) {
+    struct timespec ts;
+    if (timespec_get(&ts, TIME_UTC) != TIME_UTC)
+        return 0;
+
+    return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+}
+
+static void aa_trace_op(struct aa *a, enum aa_trace_op op, size_t hash, aa_key_t key) {
+    if (!a || !a->trace)
+        return;
+
+    const void *bytes;
+    size_t len = aa_key_bytes(&key, &bytes);
+    if (len > AA_TRACE_KEY_MAX)
+        len = AA_TRACE_KEY_MAX;
+
+    uint64_t now = aa_trace_clock();
+    uint64_t delta = now > a->trace_time ? now - a->trace_time : 0;
+    a->trace_time = now;
+
+    unsigned char head[1 + 10 + sizeof(uint64_t) + 10];
+    size_t n = 0;
+    head[n++] = (unsigned char)op;
+    n += aa_put_varint(head + n, delta);
+    for (size_t i = 0; i < sizeof(uint64_t); i++)
+        head[n++] = (unsigned char)((uint64_t)hash >> (i * 8));
+    n += aa_put_varint(head + n, len);
+    fwrite(head, 1, n, a->trace);
+    fwrite(bytes, 1, len, a->trace);
+
+    /* A broken stream stops the recording instead of failing the table */
+    if (ferror(a->trace))
+        a->trace = NULL;
+
+    return;
+}
+
+extern int aa_trace(struct aa *a, FILE *out) {
+    if (!a)
+        return -1;
+
+    a->trace = out;
+    if (!out)
+        return 0;
+
+    if (ftell(out) <= 0 && fwrite(aa_trace_magic, 1, sizeof(aa_trace_magic), out) != sizeof(aa_trace_magic)) {
+        a->trace = NULL;
+        return -1;
+    }
+    a->trace_time = aa_trace_clock();
+
+    return 0;
+}
+
+extern int aa_trace_read(FILE *in, struct aa_trace_record *r) {
+    if (!in || !r)
+        return -1;
+
+    int c = getc(in);
+    if (c == aa_trace_magic[0]) {
+        unsigned char magic[sizeof(aa_trace_magic)] = {(unsigned char)c};
+        if (fread(magic + 1, 1, sizeof(magic) - 1, in) != sizeof(magic) - 1 ||
+            memcmp(magic, aa_trace_magic, sizeof(magic)) != 0)
+            return -1;
+        c = getc(in);
+    }
+    if (c < AA_TRACE_SET || c > AA_TRACE_REMOVE)
+        return -1;
+    r->op = (enum aa_trace_op)c;
+
+    uint64_t delta, len;
+    if (aa_get_varint(in, &delta) != 0)
+        return -1;
+    r->time += delta;
+
+    r->hash = 0;
+    for (size_t i = 0; i < sizeof(uint64_t); i++) {
+        if ((c = getc(in)) == EOF)
+            return -1;
+        r->hash |= (uint64_t)c << (i * 8);
+    }
+
+    if (aa_get_varint(in, &len) != 0 || len > AA_TRACE_KEY_MAX)
+        return -1;
+    r->key_len = (size_t)len;
+    if (fread(r->key, 1, r->key_len, in) != r->key_len)
+        return -1;
+    r->key[r->key_len] = '\0';
+
+    return 0;
+}
+#endif /* AA_TRACE */
+
+#ifdef AA_WAL
+#ifndef AA_WAL_COMPACT_MIN
+#define AA_WAL_COMPACT_MIN 65536
+#endif /* AA_WAL_COMPACT_MIN */
+
+enum {
+    AA_WAL_SET = 1,
+    AA_WAL_REMOVE,
+#ifdef AA_SET
+    AA_WAL_VALUE_SIZE = 0,
+#else
+    AA_WAL_VALUE_SIZE = sizeof(aa_value_t),
+#endif /* AA_SET */
+};
+
+static const unsigned char aa_wal_magic[8] = {'A', 'A', 'S', 'N', 'A', 'P', 0, 1};
+
+static uint32_t aa_wal_sum(uint32_t sum, const void *data, size_t len) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++) {
+        sum ^= bytes[i];
+        sum *= 16777619U;
+    }
+
+    return sum;
+}
+
+static int aa_wal_fsync(FILE *f) {
+    if (fflush(f) != 0)
+        return -1;
+#ifdef _WIN32
+    return _commit(_fileno(f));
+#else
+    return fsync(fileno(f));
+#endif /* _WIN32 */
+}
+
+/* Empties the open log, which keeps appending from the start */
+static int aa_wal_truncate(FILE *f) {
+    if (fflush(f) != 0)
+        return -1;
+#ifdef _WIN32
+    return _chsize_s(_fileno(f), 0) == 0 ? 0 : -1;
+#else
+    return ftruncate(fileno(f), 0);
+#endif /* _WIN32 */
+}
+
+/* A rename is durable once the directory holding the file is synced, Windows has no such call */
+static int aa_wal_fsync_dir(const char *path) {
+#ifdef _WIN32
+    (void)path;
+
+    return 0;
+#else
+    const char *slash = strrchr(path, '/');
+    size_t len = !slash ? 1 : slash == path ? 1 : (size_t)(slash - path);
+    char *dir = (char *)fat_malloc(len + 1);
+    if (!dir)
+        return -1;
+    memcpy(dir, slash ? path : ".", len);
+    dir[len] = '\0';
+
+    int fd = open(dir, O_RDONLY), ret = -1;
+    fat_free(dir);
+    if (fd >= 0) {
+        ret = fsync(fd);
+        close(fd);
+    }
+
+    return ret;
+#endif /* _WIN32 */
+}
+
+/* Record: op, varint key length, key bytes, value bytes, FNV-1a checksum of all of them */
+static int aa_wal_write(FILE *out, unsigned char op, aa_key_t key, const void *value, size_t value_len) {
+    const void *bytes;
+    size_t len = aa_key_bytes(&key, &bytes);
+
+    unsigned char head[1 + 10], tail[sizeof(uint32_t)];
+    size_t n = 0;
+    head[n++] = op;
+    n += aa_put_varint(head + n, len);
+
+    uint32_t sum = aa_wal_sum(2166136261U, head, n);
+    sum = aa_wal_sum(aa_wal_sum(sum, bytes, len), value, value_len);
+    for (size_t i = 0; i < sizeof(tail); i++)
+        tail[i] = (unsigned char)(sum >> (i * 8));
+
+    if (fwrite(head, 1, n, out) != n || fwrite(bytes, 1, len, out) != len ||
+        (value_len && fwrite(value, 1, value_len, out) != value_len) || fwrite(tail, 1, sizeof(tail), out) != sizeof(tail))
+        return -1;
+
+    return 0;
+}
+
+/* A table with a log path but no open log has lost its log, nothing can be logged durably */
+static int aa_wal_append(struct aa *a, unsigned char op, aa_key_t key, const void *value) {
+    if (!a->wal)
+        return a->wal_path ? -1 : 0;
+
+    if (aa_wal_write(a->wal, op, key, value, op == AA_WAL_SET ? AA_WAL_VALUE_SIZE : 0) != 0)
+        return -1;
+    a->wal_records++;
+
+    if (a->wal_sync != AA_WAL_NO_SYNC && ++a->wal_pending >= a->wal_sync)
+        return aa_wal_sync(a);
+
+    return 0;
+}
+
+static int aa_wal_log(struct aa *a, unsigned char op, aa_key_t key, const void *value) {
+    if (!a->wal)
+        return a->wal_path ? -1 : 0;
+
+    if (aa_wal_append(a, op, key, value) != 0)
+        return -1;
+
+    /* The operation is already applied, so a snapshot taken now includes it */
+    if (a->wal_records >= AA_WAL_COMPACT_MIN && a->wal_records >= 2 * aa_len(a))
+        return aa_wal_checkpoint(a);
+
+    return 0;
+}
+#endif /* AA_WAL */
+
+#ifdef AA_CACHE
+static int aa_evict(struct aa *a) {
+    size_t slots = aa_slots(a);
+
+    /* Two turns of the hand clear every reference bit and find a victim */
+    for (size_t step = 0; step < 2 * slots; step++) {
+        if (a->hand >= slots)
+            a->hand = 0;
+
+        size_t i = a->hand++;
+        struct aa_node *n = aa_slot_node(a, i);
+        if (!n)
+            continue;
+        if (n->ref) {
+            n->ref = false;
+            continue;
+        }
+
+#ifdef AA_WAL
+        /* An eviction that cannot be logged would come back on recovery, the entry stays */
+        if (aa_wal_append(a, AA_WAL_REMOVE, n->key, NULL) != 0)
+            return -1;
+#endif /* AA_WAL */
+        if (a->on_evict)
+            a->on_evict(n, a->evict_ctx);
+        aa_erase_slot(a, i);
+        a->stats.evictions++;
+#ifdef AA_BLOOM
+        aa_bloom_remove(a);
+#endif /* AA_BLOOM */
+
+        return 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Makes room for a key about to be added, hits and updates never evict. A
+ * full table looks the key up first, the node found is returned in hit so
+ * the caller does not look it up again.
+ */
+static int aa_make_room(struct aa *a, size_t hash, aa_key_t key, struct aa_node **hit) {
+    *hit = NULL;
+    if (!a->capacity || aa_len(a) < a->capacity || (*hit = aa_lookup(a, hash, key)))
+        return 0;
+
+    return aa_evict(a);
+}
+
+/* Adds a key to a cache, evicting first if it is full */
+static struct aa_node *aa_cache_insert(struct aa *a, size_t hash, aa_key_t key, bool *found) {
+    struct aa_node *n;
+    if (aa_make_room(a, hash, key, &n) != 0)
+        return NULL;
+
+    *found = n != NULL;
+    if (!n && !(n = aa_insert_with_hash(a, hash, key, found)))
+        return NULL;
+    n->ref = *found;
+
+    return n;
+}
+
+extern int aa_set_capacity(struct aa *a, size_t capacity, void (*on_evict)(struct aa_node *, void *), void *ctx) {
+    if (!a)
+        return -1;
+
+    a->capacity = capacity;
+    a->on_evict = on_evict;
+    a->evict_ctx = ctx;
+
+    if (!capacity || aa_len(a) <= capacity)
+        return 0;
+
+    while (aa_len(a) > capacity)
+        if (aa_evict(a) != 0)
+            return -1;
+
+    return aa_shrink_to_fit(a);
+}
+
+extern struct aa_cache_stats aa_cache_stats(struct aa *a) {
+    if (!a)
+        return (struct aa_cache_stats){};
+
+    return a->stats;
+}
+#endif /* AA_CACHE */
+
+/* Bulk operations are not logged entry by entry, a snapshot covers them */
+static int aa_bulk_done(struct aa *a, int ret) {
+#ifdef AA_BLOOM
+    /* Also after a failure, keys added before it must pass the filter */
+    aa_bloom_rebuild(a);
+#endif /* AA_BLOOM */
+#ifdef AA_KEY_POOL
+    aa_pool_maybe_compact(a);
+#endif /* AA_KEY_POOL */
+#ifdef AA_WAL
+    if (ret == 0 && a->wal)
+        return aa_wal_checkpoint(a);
+#else
+    (void)a;
+#endif /* AA_WAL */
+
+    return ret;
+}
+
+#if defined(AA_MULTI)
+static int aa_add_with_hash(struct aa *a, size_t hash, aa_key_t key, aa_value_t value) {
+#ifdef AA_TRACE
+    aa_trace_op(a, AA_TRACE_SET, hash, key);
+#endif /* AA_TRACE */
+    bool found;
+#ifdef AA_CACHE
+    struct aa_node *n = aa_cache_insert(a, hash, key, &found);
+#else
+    struct aa_node *n = aa_insert_with_hash(a, hash, key, &found);
+#endif /* AA_CACHE */
+    if (!n)
+        return -1;
+
+    if (!found) {
+        n->values = NULL;
+        n->count = n->cap = 0;
+#ifdef AA_BLOOM
+        aa_bloom_add(a, hash);
+#endif /* AA_BLOOM */
+    }
+
+    if (n->count == n->cap && aa_values_resize(a, n, n->cap ? aa_bsr(n->cap) + 1 : 0) != 0) {
+        /* A key is never left without values, the insert may have moved it out of a small or dense layout */
+        if (!found)
+            aa_erase(a, aa_key_hash(a, key), key);
+        return -1;
+    }
+    n->values[n->count++] = value;
+
+    return 0;
+}
+
+extern int aa_x_add(struct aa *a,
+#ifdef _WIN32
+                    size_t n_memb,
+#endif
+                    ...) {
+    if (!a)
+        return -1;
+
+    va_list args;
+#ifdef _WIN32
+    va_start(args, n_memb);
+#else
+    va_start(args);
+#endif
+    aa_key_t key = va_arg(args, aa_key_t);
+    aa_value_t value = va_arg(args, aa_value_t);
+    va_end(args);
+
+    return aa_add_with_hash(a, aa_key_hash(a, key), key, value);
+}
+#elif !defined(AA_SET)
+static struct aa_node *aa_put_with_hash(struct aa *a, size_t hash, aa_key_t key, aa_value_t value) {
+#ifdef AA_TRACE
+    aa_trace_op(a, AA_TRACE_SET, hash, key);
+#endif /* AA_TRACE */
+#ifdef AA_CACHE
+    bool found;
+    struct aa_node *n = aa_cache_insert(a, hash, key, &found);
+    if (!n)
+        return NULL;
+#else
+    struct aa_node *n = aa_insert_with_hash(a, hash, key, NULL);
+    if (!n)
+        return NULL;
+#endif /* AA_CACHE */
+#ifdef AA_BLOOM
+    aa_bloom_add(a, hash);
+#endif /* AA_BLOOM */
+
+    n->value = value;
+#ifdef AA_TTL
+    n->expires = 0;
+#endif /* AA_TTL */
+#ifdef AA_WAL
+    if (aa_wal_log(a, AA_WAL_SET, key, &value) != 0)
+        return NULL;
+#endif /* AA_WAL */
+
+    return n;
+}
+
+static int aa_set_with_hash(struct aa *a, size_t hash, aa_key_t key, aa_value_t value) {
+    struct aa_node *n = aa_put_with_hash(a, hash, key, value);
+    if (!n)
+        return -1;
+#ifdef AA_TTL
+    /* Set without a TTL, the entry no longer expires */
+    aa_timer_free(n->timer);
+    n->timer = NULL;
+#endif /* AA_TTL */
+
+    return 0;
+}
+
+extern int aa_x_set(struct aa *a,
+#ifdef _WIN32
+                    size_t n_memb,
+#endif
+                    ...) {
+    va_list args;
+#ifdef _WIN32
+    va_start(args, n_memb);
+#else
+    va_start(args);
+#endif
+    aa_key_t key = va_arg(args, aa_key_t);
+    aa_value_t value = va_arg(args, aa_value_t);
+    va_end(args);
+
+    return aa_set_with_hash(a, aa_key_hash(a, key), key, value);
+}
+
+extern int aa_x_set_hashed(struct aa *a, size_t hash,
+#ifdef _WIN32
+                           size_t n_memb,
+#endif
+                           ...) {
+    va_list args;
+#ifdef _WIN32
+    va_start(args, n_memb);
+#else
+    va_start(args);
+#endif
+    aa_key_t key = va_arg(args, aa_key_t);
+    aa_value_t value = va_arg(args, aa_value_t);
+    va_end(args);
+
+    return aa_set_with_hash(a, hash | AA_HASH_FILLED, key, value);
+}
+
+#ifdef AA_TTL
+extern int aa_x_set_ttl(struct aa *a, uint64_t ttl,
+#ifdef _WIN32
+                        size_t n_memb,
+#endif
+                        ...) {
+    va_list args;
+#ifdef _WIN32
+    va_start(args, n_memb);
+#else
+    va_start(args);
+#endif
+    aa_key_t key = va_arg(args, aa_key_t);
+    aa_value_t value = va_arg(args, aa_value_t);
+    va_end(args);
+
+    if (!a || ttl == 0 || ttl > UINT64_MAX - a->now)
+        return -1;
+
+    /* A new timer is ready before the entry is written, so a failure leaves the table as it was */
+    size_t hash = aa_calc_hash(key);
+    struct aa_node *n = aa_lookup(a, hash, key);
+    struct aa_timer *t = aa_wheel_timer(a, n ? n->timer : NULL, hash, key);
+    if (!t)
+        return -1;
+
+    n = aa_put_with_hash(a, hash, key, value);
+    if (!n) {
+        if (!t->prev)
+            aa_timer_free(t);
+        return -1;
+    }
+
+    /* Setting the key again moves its timer in place */
+    aa_timer_unlink(t);
+    n->timer = t;
+    n->expires = t->expires = a->now + ttl;
+    aa_wheel_link(a, t);
+
+    return 0;
+}
+#endif /* AA_TTL */
+#else
+static int aa_insert_key_with_hash(struct aa *a, size_t hash, aa_key_t key) {
+#ifdef AA_TRACE
+    aa_trace_op(a, AA_TRACE_SET, hash, key);
+#endif /* AA_TRACE */
+    bool found;
+#ifdef AA_CACHE
+    struct aa_node *n = aa_cache_insert(a, hash, key, &found);
+#else
+    struct aa_node *n = aa_insert_with_hash(a, hash, key, &found);
+#endif /* AA_CACHE */
+    if (!n)
+        return -1;
+#ifdef AA_BLOOM
+    if (!found)
+        aa_bloom_add(a, hash);
+#endif /* AA_BLOOM */
+#ifdef AA_WAL
+    if (!found && aa_wal_log(a, AA_WAL_SET, key, NULL) != 0)
+        return -1;
+#endif /* AA_WAL */
+
+    return found ? 1 : 0;
+}
+
+extern int aa_x_insert(struct aa *a,
+#ifdef _WIN32
+                       size_t n_memb,
+#endif
+                       ...) {
+    va_list args;
+#ifdef _WIN32
+    va_start(args, n_memb);
+#else
+    va_start(args);
+#endif
+    aa_key_t key = va_arg(args, aa_key_t);
+    va_end(args);
+
+    return aa_insert_key_with_hash(a, aa_key_hash(a, key), key);
+}
+
+extern int aa_x_insert_hashed(struct aa *a, size_t hash,
+#ifdef _WIN32
+                              size_t n_memb,
+#endif
+                              ...) {
+    va_list args;
+#ifdef _WIN32
+    va_start(args, n_memb);
+#else
+    va_start(args);
+#endif
+    aa_key_t key = va_arg(args, aa_key_t);
+    va_end(args);
+
+    return aa_insert_key_with_hash(a, hash | AA_HASH_FILLED, key);
+}
+#endif /* AA_SET */
+
+#if defined(AA_MULTI)
+static struct aa_node *aa_get_node(struct aa *a, aa_key_t key) {
+    if (!a)
+        return NULL;
+
+    size_t hash = aa_key_hash(a, key);
+#ifdef AA_TRACE
+    aa_trace_op(a, AA_TRACE_GET, hash, key);
+#endif /* AA_TRACE */
+
+    struct aa_node *n = aa_find(a, hash, key);
+#ifdef AA_CACHE
+    if (n)
+        n->ref = true, a->stats.hits++;
+    else
+        a->stats.misses++;
+#endif /* AA_CACHE */
+
+    return n;
+}
+
+extern struct aa_span aa_x_get_all(struct aa *a,
+#ifdef _WIN32
+                                   size_t n_memb,
+#endif
+                                   ...) {
+    va_list args;
+#ifdef _WIN32
+    va_start(args, n_memb);
+#else
+    va_start(args);
+#endif
+    aa_key_t key = va_arg(args, aa_key_t);
+    va_end(args);
+
+    struct aa_node *n = aa_get_node(a, key);
+    if (!n)
+        return (struct aa_span){};
+
+    return (struct aa_span){n->values, n->count};
+}
+
+extern size_t aa_x_count(struct aa *a,
+#ifdef _WIN32
+                         size_t n_memb,
+#endif
+                         ...) {
+    va_list args;
+#ifdef _WIN32
+    va_start(args, n_memb);
+#else
+    va_start(args);
+#endif
+    aa_key_t key = va_arg(args, aa_key_t);
+    va_end(args);
+
+    struct aa_node *n = aa_get_node(a, key);
+
+    return n ? n->count : 0;
+}
+#elif !defined(AA_SET)
+static int aa_get_with_hash(struct aa *a, size_t hash, aa_key_t key, aa_value_t *value) {
+    if (!a)
+        return -1;
+#ifdef AA_TRACE
+    aa_trace_op(a, AA_TRACE_GET, hash, key);
+#endif /* AA_TRACE */
+
+    struct aa_node *n = aa_find(a, hash, key);
+#ifdef AA_TTL
+    /* Expired entries read as misses until aa_expire gets to them */
+    if (n && n->expires && n->expires <= a->now)
+        n = NULL;
+#endif /* AA_TTL */
+    if (n) {
+#ifdef AA_CACHE
+        n->ref = true, a->stats.hits++;
+#endif /* AA_CACHE */
+        if (value)
+            *value = n->value;
+        return 0;
+    }
+#ifdef AA_CACHE
+    a->stats.misses++;
+#endif /* AA_CACHE */
+
+    return -1;
+}
+
+extern int aa_x_get(struct aa *a,
+#ifdef _WIN32
+                    size_t n_memb,
+#endif
+                    ...) {
+    va_list args;
+#ifdef _WIN32
+    va_start(args, n_memb);
+#else
+    va_start(args);
+#endif
+    aa_key_t key = va_arg(args, aa_key_t);
+    aa_value_t *value = va_arg(args, aa_value_t *);
+    va_end(args);
+
+    return aa_get_with_hash(a, aa_key_hash(a, key), key, value);
+}
+
+extern int aa_x_get_hashed(struct aa *a, size_t hash,
+#ifdef _WIN32
+                           size_t n_memb,
+#endif
+                           ...) {
+    va_list args;
+#ifdef _WIN32
+    va_start(args, n_memb);
+#else
+    va_start(args);
+#endif
+    aa_key_t key = va_arg(args, aa_key_t);
+    aa_value_t *value = va_arg(args, aa_value_t *);
+    va_end(args);
+
+    return aa_get_with_hash(a, hash | AA_HASH_FILLED, key, value);
+}
+#else
+static bool aa_contains_with_hash(struct aa *a, size_t hash, aa_key_t key) {
+    if (!a)
+        return false;
+#ifdef AA_TRACE
+    aa_trace_op(a, AA_TRACE_GET, hash, key);
+#endif /* AA_TRACE */
+
+    struct aa_node *n = aa_find(a, hash, key);
+#ifdef AA_CACHE
+    if (n)
+        n->ref = true, a->stats.hits++;
+    else
+        a->stats.misses++;
+#endif /* AA_CACHE */
+
+    return n != NULL;
+}
+
+extern bool aa_x_contains(struct aa *a,
+#ifdef _WIN32
+                          size_t n_memb,
+#endif
+                          ...) {
+    va_list args;
+#ifdef _WIN32
+    va_start(args, n_memb);
+#else
+    va_start(args);
+#endif
+    aa_key_t key = va_arg(args, aa_key_t);
+    va_end(args);
+
+    return aa_contains_with_hash(a, aa_key_hash(a, key), key);
+}
+
+extern bool aa_x_contains_hashed(struct aa *a, size_t hash,
+#ifdef _WIN32
+                                 size_t n_memb,
+#endif
+                                 ...) {
+    va_list args;
+#ifdef _WIN32
+    va_start(args, n_memb);
+#else
+    va_start(args);
+#endif
+    aa_key_t key = va_arg(args, aa_key_t);
+    va_end(args);
+
+    return aa_contains_with_hash(a, hash | AA_HASH_FILLED, key);
+}
+#endif /* AA_SET */
+
+extern int aa_rehash(struct aa *a) {
+    if (!a)
+        return -1;
+#ifdef AA_SMALL
+    /* Small tables have no buckets to rehash */
+    if (!a->buckets)
+        return 0;
+#endif /* AA_SMALL */
+#ifdef AA_DENSE
+    /* Nothing to rehash, a sparse range goes back to buckets */
+    if (a->dense)
+        return aa_len(a) * AA_SHRINK_DEN < aa_entries(a) * AA_SHRINK_NUM ? aa_dense_leave(a) : 0;
+#endif /* AA_DENSE */
+
+    if (aa_len(a) != 0)
+        return aa_resize(a, aa_nextpow2(AA_INIT_DEN * aa_len(a) / AA_INIT_NUM));
+
+    return 0;
+}
+
+static int aa_remove_with_hash(struct aa *a, size_t hash, aa_key_t key) {
+    if (!a)
+        return -1;
+#ifdef AA_TRACE
+    aa_trace_op(a, AA_TRACE_REMOVE, hash, key);
+#endif /* AA_TRACE */
+
+    if (aa_len(a) == 0)
+        return -1;
+
+    if (aa_erase(a, hash, key)) {
+#ifdef AA_KEY_POOL
+        size_t dim = aa_entries(a);
+#endif /* AA_KEY_POOL */
+        if (aa_len(a) == 0)
+            aa_clear(a);
+        else if (aa_len(a) * AA_SHRINK_DEN < aa_entries(a) * AA_SHRINK_NUM)
+            if (aa_shrink(a) != 0)
+                return -1;
+#ifdef AA_KEY_POOL
+        if (aa_entries(a) != dim)
+            aa_pool_maybe_compact(a);
+#endif /* AA_KEY_POOL */
+#ifdef AA_BLOOM
+        aa_bloom_remove(a);
+#endif /* AA_BLOOM */
+#ifdef AA_WAL
+        if (aa_wal_log(a, AA_WAL_REMOVE, key, NULL) != 0)
+            return -1;
+#endif /* AA_WAL */
+
+        return 0;
+    }
+
+    return -1;
+}
+
+extern int aa_x_remove(struct aa *a,
+#ifdef _WIN32
+                       size_t n_memb,
+#endif
+                       ...) {
+    va_list args;
+#ifdef _WIN32
+    va_start(args, n_memb);
+#else
+    va_start(args);
+#endif
+    aa_key_t key = va_arg(args, aa_key_t);
+    va_end(args);
+
+    return aa_remove_with_hash(a, aa_key_hash(a, key), key);
+}
+
+extern int aa_x_remove_hashed(struct aa *a, size_t hash,
+#ifdef _WIN32
+                              size_t n_memb,
+#endif
+                              ...) {
+    va_list args;
+#ifdef _WIN32
+    va_start(args, n_memb);
+#else
+    va_start(args);
+#endif
+    aa_key_t key = va_arg(args, aa_key_t);
+    va_end(args);
+
+    return aa_remove_with_hash(a, hash | AA_HASH_FILLED, key);
+}
+
+#ifdef AA_MULTI
+static inline bool aa_value_equals(aa_value_t v1, aa_value_t v2) {
+#ifdef AA_VALUE_EQUALS
+    return AA_VALUE_EQUALS(v1, v2);
+#else
+    return memcmp(&v1, &v2, sizeof(aa_value_t)) == 0;
+#endif /* AA_VALUE_EQUALS */
+}
+
+extern int aa_x_remove_one(struct aa *a,
+#ifdef _WIN32
+                           size_t n_memb,
+#endif
+                           ...) {
+    if (!a)
+        return -1;
+
+    va_list args;
+#ifdef _WIN32
+    va_start(args, n_memb);
+#else
+    va_start(args);
+#endif
+    aa_key_t key = va_arg(args, aa_key_t);
+    aa_value_t value = va_arg(args, aa_value_t);
+    va_end(args);
+
+    size_t hash = aa_key_hash(a, key);
+    struct aa_node *n = aa_find(a, hash, key);
+    if (!n)
+        return -1;
+
+    size_t i = 0;
+    while (i < n->count && !aa_value_equals(n->values[i], value))
+        i++;
+    if (i == n->count)
+        return -1;
+
+    if (n->count == 1)
+        return aa_remove_with_hash(a, hash, key);
+
+    /* Keep the insertion order, halve the chunk once it is a quarter full */
+    memmove(n->values + i, n->values + i + 1, sizeof(aa_value_t) * (n->count - i - 1));
+    n->count--;
+    if (n->count * 4 <= n->cap)
+        aa_values_resize(a, n, aa_bsr(n->cap) - 1);
+#ifdef AA_TRACE
+    aa_trace_op(a, AA_TRACE_REMOVE, hash, key);
+#endif /* AA_TRACE */
+
+    return 0;
+}
+#endif /* AA_MULTI */
+
+extern size_t aa_x_hash_key(
+#ifdef _WIN32
+    size_t n_memb,
+#endif
+    ...) {
+    va_list args;
+#ifdef _WIN32
+    va_start(args, n_memb);
+#else
+    va_start(args);
+#endif
+    aa_key_t key = va_arg(args, aa_key_t);
+    va_end(args);
+
+    return aa_calc_hash(key);
+}
+
+extern struct aa_node *aa_next(struct aa *a) {
+    static size_t i = 0;
+    static struct aa *prev = NULL;
+
+    /* Push NULL if you want to reset the iterator */
+    if (prev != a) {
+        i = 0;
+        prev = a;
+    }
+
+    if (!a)
+        return NULL;
+
+    size_t len = aa_slots(a);
+    for (; i < len; i++) {
+        struct aa_node *n = aa_slot_node(a, i);
+        if (n) {
+            i++;
+            return n;
+        }
+    }
+
+    i = 0;
+    return NULL;
+}
+
+static size_t aa_sweep(struct aa *a, bool (*predicate)(struct aa_node *, void *), void *ctx, bool keep) {
+    if (!a || !predicate)
+        return 0;
+
+    size_t removed = 0;
+    for (size_t i = 0; i < aa_slots(a); i++) {
+        struct aa_node *n = aa_slot_node(a, i);
+        if (n && predicate(n, ctx) != keep) {
+            aa_erase_slot(a, i);
+            removed++;
+        }
+    }
+
+    if (removed)
+        aa_bulk_done(a, aa_shrink_to_fit(a));
+
+    return removed;
+}
+
+extern size_t aa_remove_if(struct aa *a, bool (*predicate)(struct aa_node *, void *), void *ctx) {
+    return aa_sweep(a, predicate, ctx, false);
+}
+
+extern size_t aa_retain_if(struct aa *a, bool (*predicate)(struct aa_node *, void *), void *ctx) {
+    return aa_sweep(a, predicate, ctx, true);
+}
+
+#ifdef AA_TTL
+extern size_t aa_expire(struct aa *a, uint64_t now, size_t budget) {
+    if (!a)
+        return 0;
+
+    if (now > a->now)
+        a->now = now;
+
+    /* The wheel moves only as far as the budget needs due timers */
+    size_t removed = 0;
+    while (budget && (a->due || (a->wheel && aa_wheel_step(a)))) {
+        struct aa_timer *t = a->due;
+        if (!t)
+            continue;
+        budget--;
+
+        /* The entry lets go of its timer, whose key outlives the removal */
+        aa_timer_unlink(t);
+        struct aa_node *n = aa_lookup(a, t->hash, t->node.key);
+        if (n)
+            n->timer = NULL;
+        if (n && aa_remove_with_hash(a, t->hash, t->node.key) == 0)
+            removed++;
+
+        aa_timer_free(t);
+    }
+
+    return removed;
+}
+#endif /* AA_TTL */
+
+#ifdef AA_PARALLEL
+enum {
+    AA_PARALLEL_CHUNK = 4096, /* Slots per work item */
+    AA_PARALLEL_LINE = 64,    /* Partial results are padded to this */
+};
+
+struct aa_worker {
+    struct aa *a;
+    void (*fn)(struct aa_node *, void *);
+    void *arg;
+    atomic_size_t *next;
+};
+
+static int aa_worker_run(void *p) {
+    struct aa_worker *w = (struct aa_worker *)p;
+    size_t slots = aa_slots(w->a);
+
+    for (;;) {
+        size_t start = atomic_fetch_add(w->next, AA_PARALLEL_CHUNK);
+        if (start >= slots)
+            break;
+
+        /*
+         * Each slot is read once. The slots are read in order and the node
+         * loads of successive visits overlap on their own, prefetching them
+         * ahead only added work. The callback may write anywhere, so what
+         * the visits need is kept out of memory
+         */
+        size_t end = slots - start > AA_PARALLEL_CHUNK ? start + AA_PARALLEL_CHUNK : slots;
+        struct aa *a = w->a;
+        void (*fn)(struct aa_node *, void *) = w->fn;
+        void *arg = w->arg;
+        for (size_t i = start; i < end; i++) {
+            struct aa_node *n = aa_slot_node(a, i);
+            if (n)
+                fn(n, arg);
+        }
+    }
+
+    return 0;
+}
+
+/* Runs worker 0 on the calling thread, a worker that cannot start leaves its share to the others */
+static void aa_workers_run(thrd_start_t run, void *w, size_t size, size_t nthreads) {
+    thrd_t *threads = nthreads > 1 ? (thrd_t *)fat_malloc(sizeof(thrd_t) * (nthreads - 1)) : NULL;
+    bool *started = nthreads > 1 ? (bool *)fat_malloc(sizeof(bool) * (nthreads - 1)) : NULL;
+
+    for (size_t t = 1; threads && started && t < nthreads; t++)
+        started[t - 1] = thrd_create(&threads[t - 1], run, (char *)w + t * size) == thrd_success;
+
+    run(w);
+
+    for (size_t t = 1; threads && started && t < nthreads; t++)
+        if (started[t - 1])
+            thrd_join(threads[t - 1], NULL);
+
+    if (threads)
+        fat_free(threads);
+    if (started)
+        fat_free(started);
+
+    return;
+}
+
+static size_t aa_thread_count(struct aa *a, size_t nthreads) {
+    size_t chunks = (aa_slots(a) + AA_PARALLEL_CHUNK - 1) / AA_PARALLEL_CHUNK;
+
+    if (nthreads > chunks)
+        nthreads = chunks;
+
+    return nthreads ? nthreads : 1;
+}
+
+extern int aa_for_each_parallel(struct aa *a, void (*fn)(struct aa_node *, void *), void *ctx, size_t nthreads) {
+    if (!a || !fn)
+        return -1;
+
+    nthreads = aa_thread_count(a, nthreads);
+    struct aa_worker *w = (struct aa_worker *)fat_malloc(sizeof(struct aa_worker) * nthreads);
+    if (!w)
+        return -1;
+
+    atomic_size_t next;
+    atomic_init(&next, 0);
+    for (size_t t = 0; t < nthreads; t++)
+        w[t] = (struct aa_worker){.a = a, .fn = fn, .arg = ctx, .next = &next};
+
+    aa_workers_run(aa_worker_run, w, sizeof(*w), nthreads);
+    fat_free(w);
+
+    return 0;
+}
+
+extern int aa_reduce(struct aa *a, void (*fn)(struct aa_node *, void *), void (*combine)(void *, const void *),
+                     void *acc, size_t acc_size, size_t nthreads) {
+    if (!a || !fn || !combine || !acc)
+        return -1;
+
+    nthreads = aa_thread_count(a, nthreads);
+    struct aa_worker *w = (struct aa_worker *)fat_malloc(sizeof(struct aa_worker) * nthreads);
+    if (!w)
+        return -1;
+
+    /* Partial results sit a cache line apart so threads do not share lines */
+    size_t stride = (acc_size + AA_PARALLEL_LINE - 1) / AA_PARALLEL_LINE * AA_PARALLEL_LINE;
+    unsigned char *parts = (unsigned char *)fat_malloc(stride * nthreads + AA_PARALLEL_LINE);
+    if (!parts) {
+        fat_free(w);
+        return -1;
+    }
+    unsigned char *base = parts + (AA_PARALLEL_LINE - (uintptr_t)parts % AA_PARALLEL_LINE) % AA_PARALLEL_LINE;
+
+    atomic_size_t next;
+    atomic_init(&next, 0);
+    for (size_t t = 0; t < nthreads; t++) {
+        memcpy(base + t * stride, acc, acc_size);
+        w[t] = (struct aa_worker){.a = a, .fn = fn, .arg = base + t * stride, .next = &next};
+    }
+
+    aa_workers_run(aa_worker_run, w, sizeof(*w), nthreads);
+
+    for (size_t t = 0; t < nthreads; t++)
+        combine(acc, base + t * stride);
+
+    fat_free(parts);
+    fat_free(w);
+
+    return 0;
 }
+#endif /* AA_PARALLEL */
 
-static bool aa_deleted(struct aa_bucket *b) {
-    if (!b)
-        return true;
+#ifdef AA_WAL
+static char *aa_wal_name(const char *path, const char *suffix) {
+    size_t len = strlen(path);
+    char *name = (char *)fat_malloc(len + strlen(suffix) + 1);
+    if (!name)
+        return NULL;
+    strcpy(name, path), strcpy(name + len, suffix);
 
-    return b->hash == AA_HASH_DELETED;
+    return name;
 }
 
-static bool aa_filled(struct aa_bucket *b) {
-    if (!b)
-        return false;
+/* Reads a record into buf as the key, a NUL and the value */
+static int aa_wal_read(FILE *in, unsigned char **buf, size_t *cap, unsigned char *op, size_t *key_len) {
+    int c = getc(in);
+    if (c != AA_WAL_SET && c != AA_WAL_REMOVE)
+        return -1;
 
-    return b->hash & AA_HASH_FILLED;
+    uint64_t len;
+    if (aa_get_varint(in, &len) != 0 || len > (1U << 30))
+        return -1;
+
+    unsigned char head[1 + 10];
+    size_t n = 0;
+    head[n++] = (unsigned char)c;
+    n += aa_put_varint(head + n, len);
+
+    size_t value_len = c == AA_WAL_SET ? AA_WAL_VALUE_SIZE : 0;
+    if (len + 1 + value_len > *cap) {
+        if (*buf)
+            fat_free(*buf);
+        *cap = 0;
+        if (!(*buf = (unsigned char *)fat_malloc(len + 1 + value_len)))
+            return -1;
+        *cap = len + 1 + value_len;
+    }
+
+    unsigned char tail[sizeof(uint32_t)];
+    if (fread(*buf, 1, len, in) != len || fread(*buf + len + 1, 1, value_len, in) != value_len ||
+        fread(tail, 1, sizeof(tail), in) != sizeof(tail))
+        return -1;
+
+    uint32_t sum = aa_wal_sum(2166136261U, head, n);
+    sum = aa_wal_sum(aa_wal_sum(sum, *buf, len), *buf + len + 1, value_len);
+    for (size_t i = 0; i < sizeof(tail); i++)
+        if (tail[i] != (unsigned char)(sum >> (i * 8)))
+            return -1;
+
+    *op = (unsigned char)c;
+    *key_len = (size_t)len;
+
+    return 0;
 }
 
-static size_t aa_dim(struct aa_bucket *b) {
-    if (!b)
-        return 0;
+/* Counts the intact records up to the first torn one, end is the offset right after them */
+static size_t aa_wal_scan(FILE *in, unsigned char **buf, size_t *cap, size_t *sets, long *end) {
+    size_t records = 0, key_len;
+    unsigned char op;
 
-    return fat_len(b) / sizeof(struct aa_bucket);
+    *end = ftell(in);
+    while (aa_wal_read(in, buf, cap, &op, &key_len) == 0) {
+        records++;
+        *sets += op == AA_WAL_SET;
+        *end = ftell(in);
+    }
+
+    return records;
 }
 
-extern size_t aa_len(struct aa *a) {
-    if (!a)
-        return 0;
+static int aa_wal_replay(struct aa *a, FILE *in, size_t records, unsigned char **buf, size_t *cap) {
+    for (size_t i = 0; i < records; i++) {
+        unsigned char op;
+        size_t key_len;
+        aa_key_t key;
+        if (aa_wal_read(in, buf, cap, &op, &key_len) != 0 || aa_key_from_bytes(&key, *buf, key_len) != 0)
+            return -1;
 
-    if (a->deleted > a->used)
-        return 0;
+        size_t hash = aa_calc_hash(key);
+        if (op == AA_WAL_REMOVE)
+            aa_remove_with_hash(a, hash, key);
+#ifdef AA_SET
+        else if (aa_insert_key_with_hash(a, hash, key) < 0)
+            return -1;
+#else
+        else {
+            aa_value_t value;
+            memcpy(&value, *buf + key_len + 1, sizeof(value));
+            if (aa_set_with_hash(a, hash, key, value) != 0)
+                return -1;
+        }
+#endif /* AA_SET */
+    }
 
-    return a->used - a->deleted;
+    return 0;
 }
 
-static size_t aa_mask(struct aa *a) {
+/* Scans a file once to size the table, then replays it without intermediate growth */
+static int aa_wal_load(struct aa *a, FILE *in, unsigned char **buf, size_t *cap, size_t *records, bool *torn) {
+    long start = ftell(in), end;
+    size_t sets = 0;
+    *records = aa_wal_scan(in, buf, cap, &sets, &end);
+
+    if (fseek(in, 0, SEEK_END) != 0)
+        return -1;
+    *torn = ftell(in) > end;
+
+    if (fseek(in, start, SEEK_SET) != 0 || aa_reserve(a, aa_len(a) + sets) != 0)
+        return -1;
+
+    return aa_wal_replay(a, in, *records, buf, cap);
+}
+
+extern int aa_wal_open(struct aa *a, const char *path, size_t sync_every) {
+    if (!a || !path || a->wal || a->wal_path)
+        return -1;
+
+    unsigned char *buf = NULL;
+    size_t cap = 0, records = 0;
+    bool torn = false;
+    int ret = -1;
+    char *snap = aa_wal_name(path, ".snap");
+    if (!snap)
+        goto out;
+
+    FILE *in = fopen(snap, "rb");
+    if (in) {
+        /* A snapshot is renamed into place complete, anything short of that is corruption */
+        unsigned char magic[sizeof(aa_wal_magic)];
+        uint64_t count;
+        bool ok = fread(magic, 1, sizeof(magic), in) == sizeof(magic) &&
+                  memcmp(magic, aa_wal_magic, sizeof(magic)) == 0 && aa_get_varint(in, &count) == 0 &&
+                  aa_wal_load(a, in, &buf, &cap, &records, &torn) == 0 && !torn && records == count;
+        fclose(in);
+        if (!ok)
+            goto out;
+    }
+
+    if ((in = fopen(path, "rb"))) {
+        int loaded = aa_wal_load(a, in, &buf, &cap, &records, &torn);
+        fclose(in);
+        if (loaded != 0)
+            goto out;
+        a->wal_records = records;
+    }
+    aa_shrink_to_fit(a);
+
+    /* Logging starts here, the replayed records are not logged again */
+    if (!(a->wal_path = (char *)fat_malloc(strlen(path) + 1)))
+        goto out;
+    strcpy(a->wal_path, path);
+    if (!(a->wal = fopen(path, "ab")))
+        goto out;
+    a->wal_sync = sync_every;
+    a->wal_pending = 0;
+
+    /* Rewriting the state drops the torn tail from the log */
+    ret = torn ? aa_wal_checkpoint(a) : 0;
+
+out:
+    if (buf)
+        fat_free(buf);
+    if (snap)
+        fat_free(snap);
+    if (ret != 0)
+        aa_wal_close(a);
+
+    return ret;
+}
+
+extern int aa_wal_sync(struct aa *a) {
+    if (!a || !a->wal)
+        return -1;
+
+    a->wal_pending = 0;
+
+    return aa_wal_fsync(a->wal);
+}
+
+extern int aa_wal_checkpoint(struct aa *a) {
+    if (!a || !a->wal)
+        return -1;
+
+    int ret = -1;
+    char *snap = aa_wal_name(a->wal_path, ".snap"), *tmp = aa_wal_name(a->wal_path, ".snap.tmp");
+    FILE *out = snap && tmp ? fopen(tmp, "wb") : NULL;
+    if (out) {
+        unsigned char head[10];
+        size_t n = aa_put_varint(head, aa_len(a));
+        bool ok = fwrite(aa_wal_magic, 1, sizeof(aa_wal_magic), out) == sizeof(aa_wal_magic) &&
+                  fwrite(head, 1, n, out) == n;
+
+        for (size_t i = 0; ok && i < aa_slots(a); i++) {
+            struct aa_node *node = aa_slot_node(a, i);
+#ifdef AA_SET
+            ok = !node || aa_wal_write(out, AA_WAL_SET, node->key, NULL, 0) == 0;
+#else
+            ok = !node || aa_wal_write(out, AA_WAL_SET, node->key, &node->value, AA_WAL_VALUE_SIZE) == 0;
+#endif /* AA_SET */
+        }
+        ok = aa_wal_fsync(out) == 0 && ok;
+        ok = fclose(out) == 0 && ok;
+
+        /*
+         * The rename is the commit point: a crash before the log is truncated
+         * replays the old log over the new snapshot, which ends in the same state.
+         * On Windows MoveFileEx replaces the old snapshot in the same step.
+         */
+#ifdef _WIN32
+        ok = ok && MoveFileExA(tmp, snap, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+        ok = ok && rename(tmp, snap) == 0;
+#endif /* _WIN32 */
+        if (ok) {
+            /* The log is kept until the rename itself is on disk, then emptied in place */
+            if (aa_wal_fsync_dir(snap) == 0 && aa_wal_truncate(a->wal) == 0) {
+                a->wal_records = a->wal_pending = 0;
+                ret = 0;
+            }
+        } else
+            remove(tmp);
+    }
+
+    if (snap)
+        fat_free(snap);
+    if (tmp)
+        fat_free(tmp);
+
+    return ret;
+}
+
+extern int aa_wal_close(struct aa *a) {
     if (!a)
+        return -1;
+
+    int ret = 0;
+    if (a->wal) {
+        if (a->wal_sync != AA_WAL_NO_SYNC && aa_wal_fsync(a->wal) != 0)
+            ret = -1;
+        if (fclose(a->wal) != 0)
+            ret = -1;
+        a->wal = NULL;
+    }
+    if (a->wal_path) {
+        fat_free(a->wal_path);
+        a->wal_path = NULL;
+    }
+
+    return ret;
+}
+#endif /* AA_WAL */
+
+#ifdef AA_SET
+extern int aa_union(struct aa *a, struct aa *other) {
+    if (!a || !other)
+        return -1;
+
+    if (a == other || aa_len(other) == 0)
         return 0;
 
-    return aa_dim(a->buckets) - 1;
+    if (aa_reserve(a, aa_len(a) + aa_len(other)) != 0)
+        return -1;
+
+    for (size_t i = 0; i < aa_slots(other); i++) {
+        struct aa_node *n = aa_slot_node(other, i);
+        if (n && !aa_insert_with_hash(a, aa_slot_hash(other, i), n->key, NULL))
+            return aa_bulk_done(a, -1);
+    }
+
+    return aa_bulk_done(a, 0);
 }
 
-static struct aa_bucket *aa_find_slot_insert(struct aa *a, size_t hash) {
-    if (!a || !a->buckets)
-        return NULL;
+extern int aa_intersection(struct aa *a, struct aa *other) {
+    if (!a || !other)
+        return -1;
 
-    for (size_t m = aa_mask(a), i = hash & m, j = 1;; j++) {
-        if (!aa_filled(&a->buckets[i]))
-            return &a->buckets[i];
+    if (a == other || aa_len(a) == 0)
+        return 0;
 
-        i = (i + j) & m;
+    if (aa_len(other) == 0) {
+        aa_clear(a);
+        return aa_bulk_done(a, 0);
+    }
+
+    for (size_t i = 0; i < aa_slots(a); i++) {
+        struct aa_node *n = aa_slot_node(a, i);
+        if (n && !aa_find(other, aa_slot_hash(a, i), n->key))
+            aa_erase_slot(a, i);
     }
+
+    return aa_bulk_done(a, aa_shrink_to_fit(a));
 }
 
-static inline bool aa_equals(aa_key_t k1, aa_key_t k2) {
-    if (IS_POINTER(k2))
-        return strcmp((const char *)k1, (const char *)k2) == 0;
+extern int aa_difference(struct aa *a, struct aa *other) {
+    if (!a || !other)
+        return -1;
+
+    if (aa_len(a) == 0 || aa_len(other) == 0)
+        return 0;
+
+    if (a == other) {
+        aa_clear(a);
+        return aa_bulk_done(a, 0);
+    }
+
+    /* Walk whichever bucket array holds fewer entries */
+    if (aa_len(other) < aa_len(a)) {
+        for (size_t i = 0; i < aa_slots(other); i++) {
+            struct aa_node *n = aa_slot_node(other, i);
+            if (n)
+                aa_erase(a, aa_slot_hash(other, i), n->key);
+        }
+    } else {
+        for (size_t i = 0; i < aa_slots(a); i++) {
+            struct aa_node *n = aa_slot_node(a, i);
+            if (n && aa_find(other, aa_slot_hash(a, i), n->key))
+                aa_erase_slot(a, i);
+        }
+    }
+
+    return aa_bulk_done(a, aa_shrink_to_fit(a));
+}
+#endif /* AA_SET */
+
+#if !defined(AA_MULTI) && !defined(AA_TTL) && !defined(AA_CACHE)
+static void aa_merge_node(struct aa_node *n, struct aa_node *other,
+                          void (*conflict)(struct aa_node *, struct aa_node *, void *), void *ctx) {
+    if (conflict)
+        conflict(n, other, ctx);
+#ifndef AA_SET
     else
-        return k1 == k2;
+        n->value = other->value;
+#endif /* AA_SET */
+
+    return;
 }
 
-static struct aa_bucket *aa_find_slot_lookup(struct aa *a, size_t hash, aa_key_t key) {
-    if (!a || !a->buckets)
-        return NULL;
+#if !defined(AA_COMPACT) && !defined(AA_CUCKOO) && !defined(AA_COW)
+/* Whether the nodes of src can move to a presized a as they are */
+static bool aa_merge_moves(struct aa *a, struct aa *src) {
+    /* Small and dense layouts keep their nodes in place */
+    if (!a->buckets || !src->buckets)
+        return false;
+#ifdef AA_KEY_POOL
+    if (a->key_pool != src->key_pool)
+        return false;
+#endif /* AA_KEY_POOL */
 
-    for (size_t m = aa_mask(a), i = hash & m, j = 1;; j++) {
-        if (aa_empty(&a->buckets[i]))
-            return NULL;
+    return (a->used + aa_len(src)) * AA_GROW_DEN <= aa_entries(a) * AA_GROW_NUM;
+}
+#endif /* !AA_COMPACT && !AA_CUCKOO && !AA_COW */
 
-        if (a->buckets[i].hash == hash && aa_equals(key, a->buckets[i].entry->key))
-            return &a->buckets[i];
+/* Room for both tables in a, with no tombstones left when they would take it */
+static int aa_merge_presize(struct aa *a, struct aa *src) {
+#ifdef AA_KEY_POOL
+    /* An empty table takes the pool of src, so the keys can move */
+    if (!a->key_pool && src->key_pool && aa_pool_attach(a, src->key_pool) != 0)
+        return -1;
+#endif /* AA_KEY_POOL */
+    if (aa_reserve(a, aa_len(a) + aa_len(src)) != 0)
+        return -1;
+    if (a->deleted && (a->used + aa_len(src)) * AA_GROW_DEN > aa_entries(a) * AA_GROW_NUM)
+        return aa_resize(a, aa_entries(a));
 
-        i = (i + j) & m;
-    }
+    return 0;
 }
 
-static size_t aa_bsr(size_t v) {
-    if (v == 0)
+extern int aa_merge(struct aa *dst, struct aa *src, void (*conflict)(struct aa_node *, struct aa_node *, void *),
+                    void *ctx) {
+    if (!dst || !src)
+        return -1;
+
+    if (dst == src || aa_len(src) == 0)
         return 0;
 
-    size_t bit_position = SIZE_WIDTH;
-#ifdef _STDBIT_H
-    return bit_position - stdc_first_leading_one(v);
-#else
-    for (; bit_position > 0; bit_position--)
-        if ((v & ((size_t)1 << (bit_position - 1))) != 0)
-            return bit_position - 1;
+    if (aa_merge_presize(dst, src) != 0)
+        return -1;
+
+#if !defined(AA_COMPACT) && !defined(AA_CUCKOO) && !defined(AA_COW)
+    if (aa_merge_moves(dst, src)) {
+        /* Cannot fail from here on, nothing is allocated */
+        for (size_t i = 0; i < aa_slots(src); i++) {
+            struct aa_node *n = aa_slot_node(src, i);
+            if (!n)
+                continue;
+
+            struct aa_node *held = aa_move_slot(dst, src, i);
+            if (held != n)
+                aa_merge_node(held, n, conflict, ctx);
+        }
+        aa_clear(src);
+
+        return aa_bulk_done(src, aa_bulk_done(dst, 0));
+    }
+#endif /* !AA_COMPACT && !AA_CUCKOO && !AA_COW */
+
+    /* Copied with the stored hashes, src stays as it is until every entry is in */
+    for (size_t i = 0; i < aa_slots(src); i++) {
+        struct aa_node *n = aa_slot_node(src, i);
+        if (!n)
+            continue;
+
+        bool found;
+        struct aa_node *held = aa_insert_with_hash(dst, aa_slot_hash(src, i), n->key, &found);
+        if (!held)
+            return aa_bulk_done(dst, -1);
+        if (found)
+            aa_merge_node(held, n, conflict, ctx);
+#ifndef AA_SET
+        else
+            held->value = n->value;
+#endif /* AA_SET */
+    }
+    aa_clear(src);
+
+    return aa_bulk_done(src, aa_bulk_done(dst, 0));
+}
+
+#if defined(AA_PARALLEL) && !defined(AA_COMPACT) && !defined(AA_CUCKOO) && !defined(AA_COW)
+struct aa_merger {
+    struct aa *dst, *src;
+    void (*conflict)(struct aa_node *, struct aa_node *, void *);
+    void *ctx;
+    atomic_size_t *next;
+    size_t moved;
+};
+
+/*
+ * Slots of src are handed out in chunks. A chunk of src holds a range of
+ * hashes, so the buckets of dst its keys go to are mostly apart from the
+ * ones of the other threads
+ */
+static int aa_merger_run(void *p) {
+    struct aa_merger *m = (struct aa_merger *)p;
+    size_t slots = aa_slots(m->src);
+
+    for (;;) {
+        size_t start = atomic_fetch_add(m->next, AA_PARALLEL_CHUNK);
+        if (start >= slots)
+            break;
+
+        size_t end = slots - start > AA_PARALLEL_CHUNK ? start + AA_PARALLEL_CHUNK : slots;
+        for (size_t i = start; i < end; i++) {
+            struct aa_node *n = aa_slot_node(m->src, i);
+            if (!n)
+                continue;
+
+            struct aa_node *held = aa_claim_slot(m->dst, m->src, i);
+            if (held == n)
+                m->moved++;
+            else
+                aa_merge_node(held, n, m->conflict, m->ctx);
+        }
+    }
 
     return 0;
-#endif /* _STDBIT_H */
 }
 
-static size_t aa_nextpow2(size_t n) {
-    if (n == 0)
-        return 1;
+extern int aa_merge_parallel(struct aa *dst, struct aa *src,
+                             void (*conflict)(struct aa_node *, struct aa_node *, void *), void *ctx, size_t nthreads) {
+    if (!dst || !src)
+        return -1;
 
-    const bool is_power_of2 = !((n - 1) & n);
-    return 1 << (aa_bsr(n) + !is_power_of2);
+    if (dst == src || aa_len(src) == 0)
+        return 0;
+
+    nthreads = aa_thread_count(src, nthreads);
+    if (nthreads < 2 || aa_merge_presize(dst, src) != 0 || !aa_merge_moves(dst, src))
+        return aa_merge(dst, src, conflict, ctx);
+    /* Claims only take empty buckets */
+    if (dst->deleted && aa_resize(dst, aa_entries(dst)) != 0)
+        return -1;
+
+    struct aa_merger *m = (struct aa_merger *)fat_malloc(sizeof(struct aa_merger) * nthreads);
+    if (!m)
+        return -1;
+
+    atomic_size_t next;
+    atomic_init(&next, 0);
+    for (size_t t = 0; t < nthreads; t++)
+        m[t] = (struct aa_merger){.dst = dst, .src = src, .conflict = conflict, .ctx = ctx, .next = &next};
+
+    aa_workers_run(aa_merger_run, m, sizeof(*m), nthreads);
+    for (size_t t = 0; t < nthreads; t++)
+        dst->used += m[t].moved;
+    fat_free(m);
+    aa_clear(src);
+
+    return aa_bulk_done(src, aa_bulk_done(dst, 0));
 }
+#endif /* AA_PARALLEL && !AA_COMPACT && !AA_CUCKOO && !AA_COW */
+#endif /* !AA_MULTI && !AA_TTL && !AA_CACHE */
+
+#ifdef AA_SPILL
+#ifndef AA_SPILL_LOGS
+#define AA_SPILL_LOGS 16
+#endif /* AA_SPILL_LOGS */
+
+struct aa_spill_part {
+    struct aa *table;
+    FILE *log;         /* Appends to the spill file while spilled */
+    size_t bytes, len; /* bytes is the memory in use, len the entries, an upper bound while pending */
+    uint64_t used;     /* Tick of the last access */
+    bool spilled, dirty, pending;
+};
 
-static size_t aa_fnv1a(const void *data, size_t len) {
-    const unsigned char *bytes = (const unsigned char *)data;
-    enum {
-#if SIZE_WIDTH == 128
-        FNV_OFFSET_BASIS = 144066263297769815596495629667062367629U,
-        FNV_PRIME = 309485009821345068724781371U,
-#elif SIZE_WIDTH == 64
-        FNV_OFFSET_BASIS = 14695981039346656037U,
-        FNV_PRIME = 1099511628211U,
-#elif SIZE_WIDTH == 32
-        FNV_OFFSET_BASIS = 2166136261U,
-        FNV_PRIME = 16777619U,
-#else
-#error "Not implemented"
-#endif
-    };
+struct aa_spill {
+    struct aa_spill_part *parts;
+    size_t nparts, bits, budget, resident, logs; /* logs counts the open append logs */
+    uint64_t tick;
+    unsigned long pid;
+    char *dir;
+};
 
-    size_t hash = FNV_OFFSET_BASIS;
-    for (size_t i = 0; i < len; i++) {
-        hash ^= bytes[i];
-        hash *= FNV_PRIME;
-    }
+static size_t aa_spill_part_of(struct aa_spill *s, size_t hash) {
+    /* The top bit is AA_HASH_FILLED, the partition takes the ones below it */
+    return s->bits ? (hash << 1) >> (SIZE_WIDTH - s->bits) : 0;
+}
 
-    return hash;
+/*
+ * Opens the spill file of a partition, a NULL mode removes it. The process id
+ * and the table address keep the names of live tables apart; a file left by a
+ * crashed run that got the same name is truncated before anything reads it.
+ */
+static FILE *aa_spill_open(struct aa_spill *s, size_t part, const char *mode) {
+    int len = snprintf(NULL, 0, "%s/aa_spill_%lu_%p_%zu.bin", s->dir, s->pid, (void *)s, part);
+    char *path = len > 0 ? (char *)fat_malloc((size_t)len + 1) : NULL;
+    if (!path)
+        return NULL;
+
+    snprintf(path, (size_t)len + 1, "%s/aa_spill_%lu_%p_%zu.bin", s->dir, s->pid, (void *)s, part);
+    FILE *f = NULL;
+    if (mode)
+        f = fopen(path, mode);
+    else
+        remove(path);
+    fat_free(path);
+
+    return f;
 }
 
-static size_t aa_calc_hash(aa_key_t key) {
-    /* clang-format off */
-    size_t hash = !IS_POINTER(key)
-        ? aa_fnv1a(&key, sizeof(key))
-        : aa_fnv1a((const void *)key, strlen((const char *)key));
-    /* clang-format on */
+/* Record: varint key length, key bytes, value bytes, later records of a key win */
+static bool aa_spill_put(FILE *out, const aa_key_t *key, const aa_value_t *value) {
+    const void *bytes;
+    unsigned char head[10];
+    size_t len = aa_key_bytes(key, &bytes), n = aa_put_varint(head, len);
 
-    return hash | AA_HASH_FILLED;
+    return fwrite(head, 1, n, out) == n && fwrite(bytes, 1, len, out) == len &&
+           fwrite(value, 1, sizeof(aa_value_t), out) == sizeof(aa_value_t);
 }
 
-static void aa_clear_entry(struct aa_bucket *b) {
-    if (!b || !b->entry)
-        return;
+static int aa_spill_write(struct aa_spill *s, size_t part) {
+    struct aa *t = s->parts[part].table;
+    FILE *out = aa_spill_open(s, part, "wb");
+    if (!out)
+        return -1;
 
-    if ((void *)b->entry->key && IS_POINTER(b->entry->key))
-        fat_free((void *)b->entry->key);
-    fat_free(b->entry);
+    bool ok = true;
+    for (size_t i = 0; ok && i < aa_slots(t); i++) {
+        struct aa_node *node = aa_slot_node(t, i);
+        ok = !node || aa_spill_put(out, &node->key, &node->value);
+    }
+    ok = fclose(out) == 0 && ok;
 
-    b->entry = NULL;
+    return ok ? 0 : -1;
+}
 
-    return;
+static int aa_spill_close_log(struct aa_spill *s, struct aa_spill_part *p) {
+    if (!p->log)
+        return 0;
+
+    int ret = fclose(p->log);
+    p->log = NULL;
+    s->logs--;
+
+    return ret == 0 ? 0 : -1;
 }
 
-static int aa_resize(struct aa *a, size_t s) {
-    if (!a || s == 0)
+/* Opens the append log of a partition, closing the least recently used one past AA_SPILL_LOGS */
+static int aa_spill_open_log(struct aa_spill *s, size_t part) {
+    struct aa_spill_part *p = &s->parts[part];
+    if (p->log)
+        return 0;
+
+    if (s->logs >= AA_SPILL_LOGS) {
+        size_t victim = SIZE_MAX;
+        for (size_t i = 0; i < s->nparts; i++)
+            if (s->parts[i].log && (victim == SIZE_MAX || s->parts[i].used < s->parts[victim].used))
+                victim = i;
+        if (victim != SIZE_MAX && aa_spill_close_log(s, &s->parts[victim]) != 0)
+            return -1;
+    }
+    if (!(p->log = aa_spill_open(s, part, "ab")))
         return -1;
+    s->logs++;
 
-    struct aa_bucket *o = a->buckets;
-    if (aa_alloc_htable(a, s) != 0)
+    return 0;
+}
+
+static int aa_spill_read(struct aa_spill *s, size_t part) {
+    struct aa_spill_part *p = &s->parts[part];
+    if (aa_spill_close_log(s, p) != 0)
         return -1;
 
-    for (size_t i = 0; i < aa_dim(o); i++) {
-        struct aa_bucket *ob = &o[i];
-        if (aa_filled(ob)) {
-            struct aa_bucket *nb = aa_find_slot_insert(a, ob->hash);
-            if (nb)
-                *nb = *ob;
-        } else if (aa_empty(ob) || aa_deleted(ob))
-            aa_clear_entry(ob);
+    FILE *in = aa_spill_open(s, part, "rb");
+    if (!in)
+        return -1;
+
+    unsigned char *buf = NULL;
+    size_t cap = 0;
+    int ret = aa_reserve(p->table, p->len), c;
+    bool torn = false;
+
+    while (ret == 0 && (c = getc(in)) != EOF) {
+        aa_key_t key;
+        aa_value_t value;
+        uint64_t len;
+
+        /* A record cut short by a failed append can only be the last one */
+        ungetc(c, in);
+        if (aa_get_varint(in, &len) != 0 || len > (1U << 30)) {
+            torn = feof(in);
+            ret = torn ? 0 : -1;
+            break;
+        }
+        if (len + 1 > cap) {
+            if (buf)
+                fat_free(buf);
+            cap = 0;
+            if (!(buf = (unsigned char *)fat_malloc(len + 1))) {
+                ret = -1;
+                break;
+            }
+            cap = len + 1;
+        }
+        if (fread(buf, 1, len, in) != len || fread(&value, 1, sizeof(value), in) != sizeof(value)) {
+            torn = feof(in);
+            ret = torn ? 0 : -1;
+            break;
+        }
+        if (aa_key_from_bytes(&key, buf, len) != 0 || aa_set_with_hash(p->table, aa_calc_hash(key), key, value) != 0)
+            ret = -1;
     }
+    if (buf)
+        fat_free(buf);
+    fclose(in);
 
-    a->used -= a->deleted;
-    a->deleted = 0;
+    /* Rewriting the partition on its next spill drops the torn tail */
+    if (torn)
+        p->dirty = true;
+
+    return ret;
+}
+
+/* Frees a partition's memory, measured on _Allocated_memory */
+static void aa_spill_free(struct aa_spill *s, struct aa_spill_part *p) {
+    size_t before = _Allocated_memory;
+    aa_clear(p->table);
+#ifdef AA_KEY_POOL
+    /* The keys of a cleared table stay in its pool until a compaction */
+    aa_key_pool_compact(p->table->key_pool);
+#endif /* AA_KEY_POOL */
+    p->bytes -= before - _Allocated_memory;
+    s->resident -= before - _Allocated_memory;
+
+    return;
+}
+
+/* Writes a partition out unless its file is still current, then frees it */
+static int aa_spill_out(struct aa_spill *s, size_t part) {
+    struct aa_spill_part *p = &s->parts[part];
+    if (p->dirty && aa_spill_write(s, part) != 0)
+        return -1;
 
-    if (o)
-        fat_free(o);
+    aa_spill_free(s, p);
+    p->spilled = true;
+    p->dirty = false;
 
     return 0;
 }
 
-static int aa_grow(struct aa *a) {
-    if (!a || !a->buckets)
-        return -1;
-
-    /* clang-format off */
-    size_t s = aa_len(a) * AA_SHRINK_DEN < AA_GROW_FAC * aa_dim(a->buckets) * AA_SHRINK_NUM
-            ? aa_dim(a->buckets)
-            : (AA_GROW_FAC * aa_dim(a->buckets));
-    /* clang-format on */
+/* Spills the least recently used partitions other than keep until the rest fits the budget */
+static void aa_spill_fit(struct aa_spill *s, size_t keep, size_t extra) {
+    while (s->budget && s->resident + extra > s->budget) {
+        size_t victim = SIZE_MAX;
+        for (size_t i = 0; i < s->nparts; i++)
+            if (i != keep && !s->parts[i].spilled && s->parts[i].len &&
+                (victim == SIZE_MAX || s->parts[i].used < s->parts[victim].used))
+                victim = i;
+        if (victim == SIZE_MAX || aa_spill_out(s, victim) != 0)
+            break;
+    }
 
-    return aa_resize(a, s);
+    return;
 }
 
-static int aa_shrink(struct aa *a) {
-    if (!a || !a->buckets)
-        return -1;
+/* Runs before a read of a partition, loads it if it was spilled */
+static struct aa *aa_spill_touch(struct aa_spill *s, size_t part) {
+    struct aa_spill_part *p = &s->parts[part];
+    p->used = ++s->tick;
+    if (!p->spilled)
+        return p->table;
+
+    /* The entries take about as much memory as before the spill */
+    aa_spill_fit(s, part, p->len * (sizeof(struct aa_node) + 2 * sizeof(struct aa_bucket)));
+
+    size_t before = _Allocated_memory;
+    int ret = aa_spill_read(s, part);
+    p->bytes += _Allocated_memory - before;
+    s->resident += _Allocated_memory - before;
+    if (ret != 0) {
+        aa_spill_free(s, p);
+        return NULL;
+    }
 
-    if (aa_dim(a->buckets) > AA_INIT_NUM_BUCKETS)
-        return aa_resize(a, aa_dim(a->buckets) / AA_GROW_FAC);
+    /* Appended records repeat keys, the file is rewritten on the next spill */
+    p->dirty = p->dirty || p->pending;
+    p->spilled = p->pending = false;
+    p->len = aa_len(p->table);
 
-    return 0;
+    return p->table;
 }
 
-static int aa_assign_key_ptr(struct aa_node *p, void *key) {
-    if (!p || !key)
-        return -1;
-
-    p->key = (aa_key_t)fat_malloc(strlen((const char *)key) + 1);
-    if (!(char *)p->key)
-        return -1;
-    strcpy((char *)p->key, (const char *)key);
+/* Accounts a change to a partition's memory, then enforces the budget */
+static void aa_spill_account(struct aa_spill *s, size_t part, size_t before) {
+    struct aa_spill_part *p = &s->parts[part];
+    p->bytes += _Allocated_memory - before;
+    s->resident += _Allocated_memory - before;
+    p->len = aa_len(p->table);
+    aa_spill_fit(s, part, 0);
 
-    return 0;
+    return;
 }
 
-extern struct aa *aa_new(void) {
-    struct aa *a = (struct aa *)fat_malloc(sizeof(struct aa));
-    if (!a)
+extern struct aa_spill *aa_spill_new(const char *dir, size_t partitions, size_t budget) {
+    if (!dir || partitions == 0)
         return NULL;
 
-    a->buckets = NULL;
-    a->deleted = a->used = 0;
+    struct aa_spill *s = (struct aa_spill *)fat_malloc(sizeof(struct aa_spill));
+    if (!s)
+        return NULL;
 
-    return a;
+    *s = (struct aa_spill){.nparts = aa_nextpow2(partitions), .budget = budget};
+    s->bits = aa_bsr(s->nparts);
+#ifdef _WIN32
+    s->pid = (unsigned long)_getpid();
+#else
+    s->pid = (unsigned long)getpid();
+#endif /* _WIN32 */
+    s->dir = (char *)fat_malloc(strlen(dir) + 1);
+    s->parts = (struct aa_spill_part *)fat_malloc(sizeof(struct aa_spill_part) * s->nparts);
+    if (!s->dir || !s->parts) {
+        if (s->dir)
+            fat_free(s->dir);
+        if (s->parts)
+            fat_free(s->parts);
+        fat_free(s);
+        return NULL;
+    }
+    strcpy(s->dir, dir);
+    memset(s->parts, 0, sizeof(struct aa_spill_part) * s->nparts);
+
+    for (size_t i = 0; i < s->nparts; i++) {
+        if (!(s->parts[i].table = aa_new())) {
+            aa_spill_delete(s);
+            return NULL;
+        }
+    }
+
+    return s;
 }
 
-extern void aa_delete(struct aa *a) {
-    if (!a)
+extern void aa_spill_delete(struct aa_spill *s) {
+    if (!s)
         return;
 
-    aa_clear(a), fat_free(a);
+    for (size_t i = 0; i < s->nparts; i++) {
+        if (!s->parts[i].table)
+            continue;
+        aa_delete(s->parts[i].table);
+        aa_spill_close_log(s, &s->parts[i]);
+        aa_spill_open(s, i, NULL);
+    }
+    fat_free(s->parts);
+    fat_free(s->dir);
+    fat_free(s);
 
     return;
 }
 
-extern int aa_x_set(struct aa *a,
+extern size_t aa_spill_len(struct aa_spill *s) {
+    if (!s)
+        return 0;
+
+    /* Partitions with appended records are loaded to count their distinct keys */
+    size_t len = 0;
+    for (size_t i = 0; i < s->nparts; i++)
+        len += s->parts[i].pending && aa_spill_touch(s, i) ? aa_len(s->parts[i].table) : s->parts[i].len;
+
+    return len;
+}
+
+extern int aa_x_spill_set(struct aa_spill *s,
 #ifdef _WIN32
-                    size_t n_memb,
+                          size_t n_memb,
 #endif
-                    ...) {
+                          ...) {
+    if (!s)
+        return -1;
+
     va_list args;
 #ifdef _WIN32
     va_start(args, n_memb);
@@ -523,67 +6126,47 @@ extern int aa_x_set(struct aa *a,
     aa_value_t value = va_arg(args, aa_value_t);
     va_end(args);
 
-    if (!a)
-        return -1;
-
-    if (aa_init_table_if_needed(a) != 0)
-        return -1;
-
-    const size_t hash = aa_calc_hash(key);
-    struct aa_bucket *b = aa_find_slot_lookup(a, hash, key);
-
-    if (b && b->entry) {
-        b->entry->value = value;
-        return 0;
-    }
-
-    b = aa_find_slot_insert(a, hash);
-    if (!b)
-        return -1;
-
-    if (aa_deleted(b) && a->deleted > 0)
-        a->deleted--;
-    else if (++a->used * AA_GROW_DEN > aa_dim(a->buckets) * AA_GROW_NUM) {
-        if (aa_grow(a) != 0)
-            return -1;
-        b = aa_find_slot_insert(a, hash);
-    }
-
-    if (aa_deleted(b)) {
-        if (!IS_POINTER(b->entry->key))
-            b->entry->key = key;
-        else {
-            fat_free((void *)b->entry->key);
-            if (aa_assign_key_ptr(b->entry, (void *)key) != 0)
-                return -1;
+    size_t hash = aa_calc_hash(key), part = aa_spill_part_of(s, hash);
+    struct aa_spill_part *p = &s->parts[part];
+    if (p->spilled) {
+        /* Writes to a spilled partition go to its file, without loading it */
+        p->used = ++s->tick;
+        if (aa_spill_open_log(s, part) == 0 && aa_spill_put(p->log, &key, &value)) {
+            p->pending = true;
+            p->len++;
+            return 0;
         }
-        b->entry->value = value;
-    } else {
-        struct aa_node *n = (struct aa_node *)fat_malloc(sizeof(struct aa_node));
-        if (!n)
-            return -1;
 
-        if (!IS_POINTER(n->key))
-            n->key = key;
-        else if (aa_assign_key_ptr(n, (void *)key) != 0) {
-            fat_free(n);
+        /* A failed append may leave a torn record, loading drops it and the set goes to memory */
+        if (!aa_spill_touch(s, part))
             return -1;
-        }
-        n->value = value;
-
-        b->entry = n;
     }
 
-    b->hash = hash;
+    struct aa *t = p->table;
+    p->used = ++s->tick;
+    size_t before = _Allocated_memory;
+    int ret = aa_set_with_hash(t, hash, key, value);
+    if (ret != 0 && s->budget) {
+        /* Out of memory, make room with the other partitions and try again */
+        aa_spill_account(s, part, before);
+        aa_spill_fit(s, part, s->budget);
+        before = _Allocated_memory;
+        ret = aa_set_with_hash(t, hash, key, value);
+    }
+    p->dirty = true;
+    aa_spill_account(s, part, before);
 
-    return 0;
+    return ret;
 }
 
-extern int aa_x_get(struct aa *a,
+extern int aa_x_spill_get(struct aa_spill *s,
 #ifdef _WIN32
-                    size_t n_memb,
+                          size_t n_memb,
 #endif
-                    ...) {
+                          ...) {
+    if (!s)
+        return -1;
+
     va_list args;
 #ifdef _WIN32
     va_start(args, n_memb);
@@ -594,34 +6177,25 @@ extern int aa_x_get(struct aa *a,
     aa_value_t *value = va_arg(args, aa_value_t *);
     va_end(args);
 
-    if (!a || !a->buckets)
+    size_t hash = aa_calc_hash(key), part = aa_spill_part_of(s, hash);
+    if (!s->parts[part].len)
         return -1;
 
-    struct aa_bucket *b = aa_find_slot_lookup(a, aa_calc_hash(key), key);
-    if (b && aa_filled(b)) {
-        if (value)
-            *value = b->entry->value;
-        return 0;
-    }
-
-    return -1;
-}
-
-extern int aa_rehash(struct aa *a) {
-    if (!a)
+    struct aa *t = aa_spill_touch(s, part);
+    if (!t)
         return -1;
 
-    if (aa_len(a) != 0)
-        return aa_resize(a, aa_nextpow2(AA_INIT_DEN * aa_len(a) / AA_INIT_NUM));
-
-    return 0;
+    return aa_get_with_hash(t, hash, key, value);
 }
 
-extern int aa_x_remove(struct aa *a,
+extern int aa_x_spill_remove(struct aa_spill *s,
 #ifdef _WIN32
-                       size_t n_memb,
+                             size_t n_memb,
 #endif
-                       ...) {
+                             ...) {
+    if (!s)
+        return -1;
+
     va_list args;
 #ifdef _WIN32
     va_start(args, n_memb);
@@ -631,72 +6205,408 @@ extern int aa_x_remove(struct aa *a,
     aa_key_t key = va_arg(args, aa_key_t);
     va_end(args);
 
-    if (!a)
+    size_t hash = aa_calc_hash(key), part = aa_spill_part_of(s, hash);
+    if (!s->parts[part].len)
         return -1;
 
-    if (aa_len(a) == 0)
+    struct aa *t = aa_spill_touch(s, part);
+    if (!t)
         return -1;
 
-    const size_t hash = aa_calc_hash(key);
-    struct aa_bucket *p = aa_find_slot_lookup(a, hash, key);
-    if (p) {
-        p->hash = AA_HASH_DELETED;
+    size_t before = _Allocated_memory;
+    int ret = aa_remove_with_hash(t, hash, key);
+    if (ret == 0)
+        s->parts[part].dirty = true;
+    aa_spill_account(s, part, before);
 
-        a->deleted++;
-        if (aa_len(a) == 0)
-            aa_clear(a);
-        else if (aa_len(a) * AA_SHRINK_DEN < aa_dim(a->buckets) * AA_SHRINK_NUM)
-            if (aa_shrink(a) != 0)
-                return -1;
+    return ret;
+}
+
+extern size_t aa_x_spill_get_batch(struct aa_spill *s, size_t n, bool *found,
+#ifdef _WIN32
+                                   size_t n_memb,
+#endif
+                                   ...) {
+    if (!s)
+        return SIZE_MAX;
+
+    va_list args;
+#ifdef _WIN32
+    va_start(args, n_memb);
+#else
+    va_start(args);
+#endif
+    aa_key_t *keys = va_arg(args, aa_key_t *);
+    aa_value_t *values = va_arg(args, aa_value_t *);
+    va_end(args);
 
+    if (n == 0)
         return 0;
+
+    /* Counting sort of the key indices by partition, the hashes are kept */
+    size_t *start = (size_t *)fat_malloc(sizeof(size_t) * (s->nparts + 1));
+    size_t *order = (size_t *)fat_malloc(sizeof(size_t) * n), *hashes = (size_t *)fat_malloc(sizeof(size_t) * n);
+    if (!start || !order || !hashes) {
+        if (start)
+            fat_free(start);
+        if (order)
+            fat_free(order);
+        if (hashes)
+            fat_free(hashes);
+        return SIZE_MAX;
     }
 
-    return -1;
+    memset(start, 0, sizeof(size_t) * (s->nparts + 1));
+    for (size_t i = 0; i < n; i++) {
+        hashes[i] = aa_calc_hash(keys[i]);
+        start[aa_spill_part_of(s, hashes[i]) + 1]++;
+    }
+    for (size_t p = 0; p < s->nparts; p++)
+        start[p + 1] += start[p];
+    for (size_t i = 0; i < n; i++)
+        order[start[aa_spill_part_of(s, hashes[i])]++] = i;
+    for (size_t p = s->nparts; p > 0; p--)
+        start[p] = start[p - 1];
+    start[0] = 0;
+
+    if (found)
+        memset(found, 0, sizeof(bool) * n);
+
+    /* Resident partitions first, before reading the spilled ones pushes them out; served ranges are emptied */
+    size_t hits = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t p = 0; p < s->nparts; p++) {
+            if (start[p] == start[p + 1] || !s->parts[p].len || s->parts[p].spilled != (pass == 1))
+                continue;
+
+            struct aa *t = aa_spill_touch(s, p);
+            if (!t) {
+                hits = SIZE_MAX;
+                goto done;
+            }
+            for (size_t j = start[p]; j < start[p + 1]; j++) {
+                size_t i = order[j];
+                if (aa_get_with_hash(t, hashes[i], keys[i], values ? &values[i] : NULL) == 0) {
+                    hits++;
+                    if (found)
+                        found[i] = true;
+                }
+            }
+            start[p] = start[p + 1];
+        }
+    }
+
+done:
+    fat_free(start);
+    fat_free(order);
+    fat_free(hashes);
+
+    return hits;
 }
+#endif /* AA_SPILL */
 
-extern void aa_clear(struct aa *a) {
-    if (!a || !a->buckets)
-        return;
+#ifdef AA_AGG
+struct aa_agg_local {
+    struct aa **parts; /* One table per shared partition */
+    size_t groups;
+};
 
-    for (size_t i = 0; i < aa_dim(a->buckets); i++)
-        aa_clear_entry(&a->buckets[i]);
+struct aa_agg {
+    struct aa **parts;
+    struct aa_agg_local *locals;
+    void (*fold)(void *, const void *);
+    enum aa_agg_op op;
+    size_t nparts, bits, nlocals, flush_at;
+    size_t part, slot; /* Position of aa_agg_next */
+    mtx_t *locks;      /* One per shared partition, held while a thread flushes to it */
+    size_t nlocks;
+    mtx_t lock; /* _Allocated_memory is a plain counter, threads allocate and free under this lock */
+};
 
-    fat_free(a->buckets);
-    a->buckets = NULL;
-    a->deleted = a->used = 0;
+static size_t aa_agg_part_of(struct aa_agg *g, size_t hash) {
+    /* The top bit is AA_HASH_FILLED, the partition takes the ones below it */
+    return g->bits ? (hash << 1) >> (SIZE_WIDTH - g->bits) : 0;
+}
+
+static void aa_agg_fold(struct aa_agg *g, aa_value_t *acc, const aa_value_t *value) {
+    switch (g->op) {
+    case AA_AGG_COUNT:
+    case AA_AGG_SUM:
+        *acc += *value;
+        break;
+    case AA_AGG_MIN:
+        if (*value < *acc)
+            *acc = *value;
+        break;
+    case AA_AGG_MAX:
+        if (*value > *acc)
+            *acc = *value;
+        break;
+    case AA_AGG_CUSTOM:
+        g->fold(acc, value);
+        break;
+    }
 
     return;
 }
 
-extern size_t aa_entries(struct aa *a) {
-    if (!a || !a->buckets)
+/*
+ * Moves the groups of a thread in partition p to the shared one, as
+ * aa_merge does, under the lock of the partition. Only the steps that
+ * allocate or free take g->lock, so moves into different partitions run
+ * side by side. Partial aggregates of a group fold into each other like
+ * rows, counts add up.
+ */
+static int aa_agg_flush_part(struct aa_agg *g, size_t p, struct aa *src) {
+    struct aa *dst = g->parts[p];
+    if (aa_len(src) == 0)
         return 0;
 
-    return aa_dim(a->buckets);
+    mtx_lock(&g->locks[p]);
+    mtx_lock(&g->lock);
+    int ret = aa_merge_presize(dst, src);
+    mtx_unlock(&g->lock);
+
+    bool moved = false;
+#if !defined(AA_COMPACT) && !defined(AA_CUCKOO) && !defined(AA_COW)
+    /* The shared partitions hold no tombstones, moving a node frees nothing */
+    moved = ret == 0 && aa_merge_moves(dst, src);
+    for (size_t i = 0; moved && i < aa_slots(src); i++) {
+        struct aa_node *n = aa_slot_node(src, i);
+        struct aa_node *held = n ? aa_move_slot(dst, src, i) : NULL;
+        if (held && held != n)
+            aa_agg_fold(g, &held->value, &n->value);
+    }
+#endif /* !AA_COMPACT && !AA_CUCKOO && !AA_COW */
+
+    for (size_t i = 0; ret == 0 && !moved && i < aa_slots(src); i++) {
+        struct aa_node *n = aa_slot_node(src, i);
+        if (!n)
+            continue;
+
+        bool found;
+        mtx_lock(&g->lock);
+        struct aa_node *held = aa_insert_with_hash(dst, aa_slot_hash(src, i), n->key, &found);
+        mtx_unlock(&g->lock);
+        if (!held) {
+            ret = -1;
+            break;
+        }
+        if (found)
+            aa_agg_fold(g, &held->value, &n->value);
+        else
+            held->value = n->value;
+
+        /* A group leaves the thread once counted, a failure keeps only the ones not yet moved */
+        mtx_lock(&g->lock);
+        aa_erase_slot(src, i);
+        mtx_unlock(&g->lock);
+    }
+
+    mtx_lock(&g->lock);
+    if (ret == 0)
+        aa_clear(src);
+    ret = aa_bulk_done(src, aa_bulk_done(dst, ret));
+    mtx_unlock(&g->lock);
+    mtx_unlock(&g->locks[p]);
+
+    return ret;
 }
 
-extern struct aa_node *aa_next(struct aa *a) {
-    static size_t i = 0;
-    static struct aa *prev = NULL;
+/* Moves the groups of a thread to the shared partitions, groups left behind by a failure stay counted */
+static int aa_agg_flush(struct aa_agg *g, struct aa_agg_local *l) {
+    int ret = 0;
+
+    /* Threads start at partitions of their own, so their flushes seldom wait on each other */
+    size_t first = (size_t)(l - g->locals) * g->nparts / g->nlocals;
+    l->groups = 0;
+    for (size_t i = 0; i < g->nparts; i++) {
+        size_t p = (first + i) & (g->nparts - 1);
+        if (aa_agg_flush_part(g, p, l->parts[p]) != 0)
+            ret = -1;
+        l->groups += aa_len(l->parts[p]);
+    }
 
-    /* Push NULL if you want to reset the iterator */
-    if (prev != a) {
-        i = 0;
-        prev = a;
+    return ret;
+}
+
+extern struct aa_agg *aa_agg_new(enum aa_agg_op op, void (*fold)(void *, const void *), size_t nthreads,
+                                 size_t partitions, size_t flush_at) {
+    if (op > AA_AGG_CUSTOM || (op == AA_AGG_CUSTOM && !fold) || nthreads == 0 || partitions == 0)
+        return NULL;
+
+    struct aa_agg *g = (struct aa_agg *)fat_malloc(sizeof(struct aa_agg));
+    if (!g)
+        return NULL;
+
+    *g = (struct aa_agg){
+        .fold = fold, .op = op, .nparts = aa_nextpow2(partitions), .nlocals = nthreads, .flush_at = flush_at};
+    if (!g->flush_at)
+        g->flush_at = AA_AGG_FLUSH;
+    g->bits = aa_bsr(g->nparts);
+    if (mtx_init(&g->lock, mtx_plain) != thrd_success) {
+        fat_free(g);
+        return NULL;
     }
 
-    if (!a || !a->buckets)
+    g->parts = (struct aa **)fat_malloc(sizeof(struct aa *) * g->nparts);
+    g->locals = (struct aa_agg_local *)fat_malloc(sizeof(struct aa_agg_local) * g->nlocals);
+    g->locks = (mtx_t *)fat_malloc(sizeof(mtx_t) * g->nparts);
+    if (!g->parts || !g->locals || !g->locks) {
+        aa_agg_delete(g);
         return NULL;
+    }
+    memset(g->parts, 0, sizeof(struct aa *) * g->nparts);
+    memset(g->locals, 0, sizeof(struct aa_agg_local) * g->nlocals);
 
-    size_t len = aa_entries(a);
-    for (; i < len; i++)
-        if (a->buckets[i].hash & AA_HASH_FILLED)
-            if (a->buckets[i].entry)
-                return a->buckets[i++].entry;
+    for (; g->nlocks < g->nparts; g->nlocks++) {
+        if (mtx_init(&g->locks[g->nlocks], mtx_plain) != thrd_success) {
+            aa_agg_delete(g);
+            return NULL;
+        }
+    }
 
-    i = 0;
+    for (size_t p = 0; p < g->nparts; p++) {
+        if (!(g->parts[p] = aa_new())) {
+            aa_agg_delete(g);
+            return NULL;
+        }
+    }
+
+    for (size_t t = 0; t < g->nlocals; t++) {
+        struct aa_agg_local *l = &g->locals[t];
+        if (!(l->parts = (struct aa **)fat_malloc(sizeof(struct aa *) * g->nparts))) {
+            aa_agg_delete(g);
+            return NULL;
+        }
+        memset(l->parts, 0, sizeof(struct aa *) * g->nparts);
+        for (size_t p = 0; p < g->nparts; p++) {
+            if (!(l->parts[p] = aa_new())) {
+                aa_agg_delete(g);
+                return NULL;
+            }
+        }
+    }
+
+    return g;
+}
+
+extern void aa_agg_delete(struct aa_agg *g) {
+    if (!g)
+        return;
+
+    for (size_t t = 0; g->locals && t < g->nlocals; t++) {
+        if (!g->locals[t].parts)
+            continue;
+        for (size_t p = 0; p < g->nparts; p++)
+            aa_delete(g->locals[t].parts[p]);
+        fat_free(g->locals[t].parts);
+    }
+    for (size_t p = 0; g->parts && p < g->nparts; p++)
+        aa_delete(g->parts[p]);
+    if (g->locals)
+        fat_free(g->locals);
+    if (g->parts)
+        fat_free(g->parts);
+    for (size_t p = 0; p < g->nlocks; p++)
+        mtx_destroy(&g->locks[p]);
+    if (g->locks)
+        fat_free(g->locks);
+    mtx_destroy(&g->lock);
+    fat_free(g);
+
+    return;
+}
+
+extern int aa_x_agg_add_batch(struct aa_agg *g, size_t thread, size_t n,
+#ifdef _WIN32
+                              size_t n_memb,
+#endif
+                              ...) {
+    if (!g || thread >= g->nlocals)
+        return -1;
+
+    va_list args;
+#ifdef _WIN32
+    va_start(args, n_memb);
+#else
+    va_start(args);
+#endif
+    aa_key_t *keys = va_arg(args, aa_key_t *);
+    aa_value_t *values = va_arg(args, aa_value_t *);
+    va_end(args);
+
+    if (n == 0)
+        return 0;
+    if (!keys || (!values && g->op != AA_AGG_COUNT))
+        return -1;
+
+    struct aa_agg_local *l = &g->locals[thread];
+    for (size_t i = 0; i < n; i++) {
+        /* The hash picks the partition and stays with the group when it moves */
+        size_t hash = aa_calc_hash(keys[i]);
+        struct aa *t = l->parts[aa_agg_part_of(g, hash)];
+        aa_value_t value = g->op == AA_AGG_COUNT ? (aa_value_t)1 : values[i];
+
+        /* Rows of a known group fold in place, without the lock */
+        struct aa_node *node = aa_lookup(t, hash, keys[i]);
+        if (node) {
+            aa_agg_fold(g, &node->value, &value);
+            continue;
+        }
+
+        mtx_lock(&g->lock);
+        node = aa_insert_with_hash(t, hash, keys[i], NULL);
+        mtx_unlock(&g->lock);
+        if (!node)
+            return -1;
+        node->value = value;
+        if (++l->groups >= g->flush_at && aa_agg_flush(g, l) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+extern int aa_agg_finish(struct aa_agg *g) {
+    if (!g)
+        return -1;
+
+    int ret = 0;
+    for (size_t t = 0; t < g->nlocals; t++)
+        if (aa_agg_flush(g, &g->locals[t]) != 0)
+            ret = -1;
+
+    return ret;
+}
+
+extern size_t aa_agg_len(struct aa_agg *g) {
+    if (!g)
+        return 0;
+
+    size_t len = 0;
+    for (size_t p = 0; p < g->nparts; p++)
+        len += aa_len(g->parts[p]);
+
+    return len;
+}
+
+extern struct aa_node *aa_agg_next(struct aa_agg *g) {
+    if (!g)
+        return NULL;
+
+    for (; g->part < g->nparts; g->part++, g->slot = 0) {
+        struct aa *t = g->parts[g->part];
+        while (g->slot < aa_slots(t)) {
+            struct aa_node *n = aa_slot_node(t, g->slot++);
+            if (n)
+                return n;
+        }
+    }
+
+    g->part = 0;
     return NULL;
 }
+#endif /* AA_AGG */
 
 #endif /* AA_IMPLEMENTATION */
@@ -0,0 +1,557 @@
+/*
+ * aa.hpp - C++ front-end of the aa.h hash table
+ *
+ * The author of the original implementation: Martin Nowak
+ *
+ * Copyright (c) 2025, Ferhat Kurtulmuş, Alexander Chepkov
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS 'AS IS' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef AA_HPP
+#define AA_HPP
+
+#include <bit>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+extern "C" {
+#include "alloc.h"
+}
+
+/*
+ * The open addressing engine of aa.h as a template: the same buckets of
+ * stored hash and node pointer, triangular probing, thresholds and hashes,
+ * with the key and value types fixed at compile time instead of through
+ * AA_KEY/AA_VALUE, so any number of instantiations fit in one translation unit.
+ * The namespace takes the name of struct aa, so aa.h is not included here
+ */
+namespace aa {
+
+namespace detail {
+constexpr std::size_t width = std::numeric_limits<std::size_t>::digits;
+
+/* The hash table constants of aa.h */
+constexpr std::size_t grow_num = 4, grow_den = 5, shrink_num = 1, shrink_den = 8, grow_fac = 4, init_buckets = 8;
+constexpr std::size_t hash_empty = 0, hash_deleted = 1, hash_filled = std::size_t(1) << (width - 1);
+
+inline std::size_t fnv1a(const void *data, std::size_t len) noexcept {
+    static_assert(width == 64 || width == 32, "Not implemented");
+    constexpr std::size_t basis = width == 64 ? static_cast<std::size_t>(14695981039346656037U) : 2166136261U;
+    constexpr std::size_t prime = width == 64 ? static_cast<std::size_t>(1099511628211U) : 16777619U;
+
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    std::size_t hash = basis;
+    for (std::size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= prime;
+    }
+
+    return hash;
+}
+
+inline std::size_t mix(std::size_t x) noexcept {
+    constexpr std::size_t mul = width == 64 ? static_cast<std::size_t>(0x9E3779B97F4A7C15U) : 0x9E3779B9U;
+
+    x *= mul;
+    x ^= x >> (width / 2 - 3);
+    x *= mul;
+    x ^= x >> (width / 2);
+
+    return x;
+}
+} // namespace detail
+
+/**
+ * @brief Hash of strings of any kind, hashes the same bytes as aa_calc_hash
+ */
+struct string_hash {
+    using is_transparent = void;
+
+    std::size_t operator()(std::string_view key) const noexcept { return detail::fnv1a(key.data(), key.size()); }
+};
+
+/**
+ * @brief Equality of strings of any kind
+ */
+struct string_equal {
+    using is_transparent = void;
+
+    bool operator()(std::string_view k1, std::string_view k2) const noexcept { return k1 == k2; }
+};
+
+/**
+ * @brief Default hash: integer-sized keys are mixed as in aa_calc_hash, others go through std::hash
+ */
+template <class K> struct hash {
+    std::size_t operator()(const K &key) const noexcept {
+        if constexpr ((std::is_integral_v<K> || std::is_enum_v<K> || std::is_pointer_v<K>) &&
+                      sizeof(K) <= sizeof(std::size_t)) {
+            std::size_t x = 0;
+            std::memcpy(&x, &key, sizeof(key));
+            return detail::mix(x);
+        } else
+            return detail::mix(std::hash<K>{}(key));
+    }
+};
+
+template <> struct hash<std::string> : string_hash {};
+template <> struct hash<std::string_view> : string_hash {};
+
+/**
+ * @brief Default equality, transparent for strings
+ */
+template <class K> struct equal_to : std::equal_to<K> {};
+template <> struct equal_to<std::string> : string_equal {};
+template <> struct equal_to<std::string_view> : string_equal {};
+
+/**
+ * @brief Hash table owning its keys and values, freed when it goes out of scope
+ *
+ * References to elements stay valid until they are erased. Insertions may
+ * invalidate iterators, erase(key) may too when it shrinks the table, and
+ * erase(iterator) never does
+ */
+template <class K, class V, class Hash = hash<K>, class Eq = equal_to<K>> class map {
+  public:
+    using key_type = K;
+    using mapped_type = V;
+    using value_type = std::pair<const K, V>;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using hasher = Hash;
+    using key_equal = Eq;
+    using reference = value_type &;
+    using const_reference = const value_type &;
+
+  private:
+    static_assert(alignof(value_type) <= alignof(std::max_align_t), "Over-aligned types are not supported");
+    /* aa.h copies string keys, a map would only keep the pointer to the caller's bytes */
+    static_assert(!(std::is_pointer_v<K> && std::is_same_v<std::remove_cv_t<std::remove_pointer_t<K>>, char>),
+                  "Character pointer keys are not owned, use std::string");
+
+    struct bucket {
+        std::size_t hash;
+        value_type *entry;
+    };
+
+    /* Lookups by another type than K need both functors to accept it */
+    static constexpr bool transparent = requires {
+        typename Hash::is_transparent;
+        typename Eq::is_transparent;
+    };
+
+  public:
+    template <bool Const> class basic_iterator {
+        friend class map;
+        template <bool> friend class basic_iterator;
+        using bucket_type = std::conditional_t<Const, const bucket, bucket>;
+
+        bucket_type *b = nullptr, *end = nullptr;
+
+        basic_iterator(bucket_type *b, bucket_type *end) noexcept : b(b), end(end) {}
+
+        void skip() noexcept {
+            while (b != end && !(b->hash & detail::hash_filled))
+                b++;
+        }
+
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = map::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = std::conditional_t<Const, const value_type *, value_type *>;
+        using reference = std::conditional_t<Const, const value_type &, value_type &>;
+
+        basic_iterator() noexcept = default;
+
+        template <bool C>
+            requires(Const && !C)
+        basic_iterator(const basic_iterator<C> &other) noexcept : b(other.b), end(other.end) {}
+
+        reference operator*() const noexcept { return *b->entry; }
+        pointer operator->() const noexcept { return b->entry; }
+
+        basic_iterator &operator++() noexcept {
+            b++;
+            skip();
+            return *this;
+        }
+
+        basic_iterator operator++(int) noexcept {
+            basic_iterator it = *this;
+            ++*this;
+            return it;
+        }
+
+        friend bool operator==(const basic_iterator &i1, const basic_iterator &i2) noexcept { return i1.b == i2.b; }
+    };
+
+    using iterator = basic_iterator<false>;
+    using const_iterator = basic_iterator<true>;
+
+    map() = default;
+
+    explicit map(const Hash &hash, const Eq &eq = Eq()) : hash_(hash), eq_(eq) {}
+
+    map(std::initializer_list<value_type> init) : map() {
+        reserve(init.size());
+        for (const value_type &kv : init)
+            try_emplace(kv.first, kv.second);
+    }
+
+    /* Copies the buckets as they are, the stored hashes are not recomputed */
+    map(const map &other) : map(other.hash_, other.eq_) {
+        if (!other.buckets)
+            return;
+
+        buckets = alloc_buckets(other.dim);
+        dim = other.dim;
+        used = other.used;
+        deleted = other.deleted;
+        for (size_type i = 0; i < dim; i++) {
+            if (other.buckets[i].hash & detail::hash_filled)
+                buckets[i].entry = new_entry(*other.buckets[i].entry);
+            buckets[i].hash = other.buckets[i].hash;
+        }
+    }
+
+    map(map &&other) noexcept
+        : buckets(std::exchange(other.buckets, nullptr)), dim(std::exchange(other.dim, 0)),
+          used(std::exchange(other.used, 0)), deleted(std::exchange(other.deleted, 0)), hash_(other.hash_),
+          eq_(other.eq_) {}
+
+    map &operator=(map other) noexcept {
+        swap(other);
+        return *this;
+    }
+
+    ~map() { clear(); }
+
+    void swap(map &other) noexcept {
+        std::swap(buckets, other.buckets);
+        std::swap(dim, other.dim);
+        std::swap(used, other.used);
+        std::swap(deleted, other.deleted);
+        std::swap(hash_, other.hash_);
+        std::swap(eq_, other.eq_);
+    }
+
+    friend void swap(map &m1, map &m2) noexcept { m1.swap(m2); }
+
+    size_type size() const noexcept { return used - deleted; }
+    bool empty() const noexcept { return size() == 0; }
+    size_type bucket_count() const noexcept { return dim; }
+    hasher hash_function() const { return hash_; }
+    key_equal key_eq() const { return eq_; }
+
+    iterator begin() noexcept { return first<iterator>(buckets); }
+    iterator end() noexcept { return iterator(buckets + dim, buckets + dim); }
+    const_iterator begin() const noexcept { return first<const_iterator>(buckets); }
+    const_iterator end() const noexcept { return const_iterator(buckets + dim, buckets + dim); }
+    const_iterator cbegin() const noexcept { return begin(); }
+    const_iterator cend() const noexcept { return end(); }
+
+    void clear() noexcept {
+        for (size_type i = 0; i < dim; i++)
+            if (buckets[i].hash & detail::hash_filled)
+                delete_entry(buckets[i].entry);
+
+        if (buckets)
+            fat_free(buckets);
+        buckets = nullptr;
+        dim = used = deleted = 0;
+    }
+
+    /* Room for n entries without crossing the grow threshold */
+    void reserve(size_type n) {
+        if (buckets && n * detail::grow_den <= dim * detail::grow_num)
+            return;
+
+        size_type s = std::bit_ceil(n * detail::grow_den / detail::grow_num + 1);
+        resize(s < detail::init_buckets ? detail::init_buckets : s);
+    }
+
+    /* Constructs the value in place from args unless the key is present */
+    template <class... Args> std::pair<iterator, bool> try_emplace(const K &key, Args &&...args) {
+        return emplace_key(key, std::forward<Args>(args)...);
+    }
+
+    template <class... Args> std::pair<iterator, bool> try_emplace(K &&key, Args &&...args) {
+        return emplace_key(std::move(key), std::forward<Args>(args)...);
+    }
+
+    template <class M> std::pair<iterator, bool> insert_or_assign(const K &key, M &&value) {
+        return assign_key(key, std::forward<M>(value));
+    }
+
+    template <class M> std::pair<iterator, bool> insert_or_assign(K &&key, M &&value) {
+        return assign_key(std::move(key), std::forward<M>(value));
+    }
+
+    std::pair<iterator, bool> insert(const value_type &kv) { return try_emplace(kv.first, kv.second); }
+
+    std::pair<iterator, bool> insert(value_type &&kv) { return try_emplace(kv.first, std::move(kv.second)); }
+
+    V &operator[](const K &key) { return try_emplace(key).first->second; }
+    V &operator[](K &&key) { return try_emplace(std::move(key)).first->second; }
+
+    iterator find(const K &key) noexcept { return at_bucket<iterator>(lookup(key)); }
+    const_iterator find(const K &key) const noexcept { return at_bucket<const_iterator>(lookup(key)); }
+    bool contains(const K &key) const noexcept { return lookup(key) != nullptr; }
+    size_type count(const K &key) const noexcept { return contains(key); }
+
+    /* Heterogeneous lookups, a std::string_view finds a std::string key without a copy */
+    template <class Q>
+        requires transparent
+    iterator find(const Q &key) noexcept {
+        return at_bucket<iterator>(lookup(key));
+    }
+
+    template <class Q>
+        requires transparent
+    const_iterator find(const Q &key) const noexcept {
+        return at_bucket<const_iterator>(lookup(key));
+    }
+
+    template <class Q>
+        requires transparent
+    bool contains(const Q &key) const noexcept {
+        return lookup(key) != nullptr;
+    }
+
+    V &at(const K &key) { return checked(lookup(key))->entry->second; }
+    const V &at(const K &key) const { return checked(lookup(key))->entry->second; }
+
+    size_type erase(const K &key) noexcept { return erase_key(key); }
+
+    template <class Q>
+        requires(transparent && !std::is_convertible_v<const Q &, const_iterator>)
+    size_type erase(const Q &key) noexcept {
+        return erase_key(key);
+    }
+
+    /* Returns the iterator past the erased entry, the table is not shrunk */
+    iterator erase(const_iterator pos) noexcept {
+        bucket *b = buckets + (pos.b - buckets);
+        erase_bucket(b);
+        return first<iterator>(b + 1);
+    }
+
+    iterator erase(iterator pos) noexcept { return erase(const_iterator(pos)); }
+
+  private:
+    bucket *buckets = nullptr;
+    size_type dim = 0, used = 0, deleted = 0;
+    [[no_unique_address]] Hash hash_;
+    [[no_unique_address]] Eq eq_;
+
+    template <class Q> std::size_t hash_of(const Q &key) const noexcept {
+        return static_cast<std::size_t>(hash_(key)) | detail::hash_filled;
+    }
+
+    template <class It, class B> It first(B *b) const noexcept {
+        It it(b, buckets + dim);
+        it.skip();
+        return it;
+    }
+
+    template <class It, class B> It at_bucket(B *b) const noexcept {
+        return b ? It(b, buckets + dim) : It(buckets + dim, buckets + dim);
+    }
+
+    static bucket *checked(bucket *b) {
+        if (!b)
+            throw std::out_of_range("aa::map::at");
+        return b;
+    }
+
+    static bucket *alloc_buckets(size_type s) {
+        /* fat_malloc returns zeroed memory, every bucket starts empty */
+        bucket *b = static_cast<bucket *>(fat_malloc(sizeof(bucket) * s));
+        if (!b)
+            throw std::bad_alloc();
+        return b;
+    }
+
+    template <class... Args> static value_type *new_entry(Args &&...args) {
+        void *p = fat_malloc(sizeof(value_type));
+        if (!p)
+            throw std::bad_alloc();
+        try {
+            return new (p) value_type(std::forward<Args>(args)...);
+        } catch (...) {
+            fat_free(p);
+            throw;
+        }
+    }
+
+    static void delete_entry(value_type *entry) noexcept {
+        entry->~value_type();
+        fat_free(entry);
+    }
+
+    template <class Q> bucket *lookup(const Q &key) const noexcept {
+        return buckets ? lookup(key, hash_of(key)) : nullptr;
+    }
+
+    /* For callers that keep the hash to place a missing key */
+    template <class Q> bucket *lookup(const Q &key, std::size_t hash) const noexcept {
+        if (!buckets)
+            return nullptr;
+
+        for (size_type m = dim - 1, i = hash & m, j = 1;; j++) {
+            bucket *b = &buckets[i];
+            if (b->hash == detail::hash_empty)
+                return nullptr;
+
+            if (b->hash == hash && eq_(key, b->entry->first))
+                return b;
+
+            i = (i + j) & m;
+        }
+    }
+
+    bucket *find_slot_insert(std::size_t hash) const noexcept {
+        for (size_type m = dim - 1, i = hash & m, j = 1;; j++) {
+            if (!(buckets[i].hash & detail::hash_filled))
+                return &buckets[i];
+
+            i = (i + j) & m;
+        }
+    }
+
+    void resize(size_type s) {
+        bucket *o = buckets;
+        size_type odim = dim;
+
+        buckets = alloc_buckets(s);
+        dim = s;
+        for (size_type i = 0; i < odim; i++)
+            if (o[i].hash & detail::hash_filled)
+                *find_slot_insert(o[i].hash) = o[i];
+
+        used -= deleted;
+        deleted = 0;
+
+        if (o)
+            fat_free(o);
+    }
+
+    /* Purges the tombstones if the live entries leave room, grows otherwise */
+    void grow(size_type len) {
+        resize(len * detail::shrink_den < detail::grow_fac * dim * detail::shrink_num ? dim : detail::grow_fac * dim);
+    }
+
+    /* Links an entry that is not in the table yet */
+    bucket *place(std::size_t hash, value_type *entry) {
+        if (!buckets)
+            resize(detail::init_buckets);
+
+        bucket *b = find_slot_insert(hash);
+        if (b->hash == detail::hash_deleted && deleted > 0)
+            deleted--;
+        else {
+            if ((used + 1) * detail::grow_den > dim * detail::grow_num) {
+                grow(size() + 1);
+                b = find_slot_insert(hash);
+            }
+            used++;
+        }
+
+        b->entry = entry;
+        b->hash = hash;
+
+        return b;
+    }
+
+    /* Adds a key that lookup did not find under hash */
+    template <class KK, class... Args> iterator insert_new(std::size_t hash, KK &&key, Args &&...args) {
+        value_type *entry = new_entry(std::piecewise_construct, std::forward_as_tuple(std::forward<KK>(key)),
+                                      std::forward_as_tuple(std::forward<Args>(args)...));
+        try {
+            return iterator(place(hash, entry), buckets + dim);
+        } catch (...) {
+            delete_entry(entry);
+            throw;
+        }
+    }
+
+    template <class KK, class... Args> std::pair<iterator, bool> emplace_key(KK &&key, Args &&...args) {
+        std::size_t hash = hash_of(key);
+        if (bucket *b = lookup(key, hash))
+            return {iterator(b, buckets + dim), false};
+
+        return {insert_new(hash, std::forward<KK>(key), std::forward<Args>(args)...), true};
+    }
+
+    template <class KK, class M> std::pair<iterator, bool> assign_key(KK &&key, M &&value) {
+        std::size_t hash = hash_of(key);
+        if (bucket *b = lookup(key, hash)) {
+            b->entry->second = std::forward<M>(value);
+            return {iterator(b, buckets + dim), false};
+        }
+
+        return {insert_new(hash, std::forward<KK>(key), std::forward<M>(value)), true};
+    }
+
+    void erase_bucket(bucket *b) noexcept {
+        delete_entry(b->entry);
+        b->entry = nullptr;
+        b->hash = detail::hash_deleted;
+        deleted++;
+    }
+
+    template <class Q> size_type erase_key(const Q &key) noexcept {
+        bucket *b = lookup(key);
+        if (!b)
+            return 0;
+
+        erase_bucket(b);
+        if (size() == 0)
+            clear();
+        else if (size() * detail::shrink_den < dim * detail::shrink_num && dim > detail::init_buckets) {
+            /* A shrink that fails to allocate leaves the table as it was */
+            try {
+                resize(dim / detail::grow_fac);
+            } catch (const std::bad_alloc &) {
+            }
+        }
+
+        return 1;
+    }
+};
+
+} // namespace aa
+
+#endif /* AA_HPP */
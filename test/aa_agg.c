@@ -0,0 +1,179 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <threads.h>
+#include <time.h>
+
+#ifdef TEST_AA_AGG
+
+#define AA_KEY size_t
+#define AA_VALUE size_t
+#define AA_PARALLEL
+#define AA_AGG
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+enum { BATCH = 4096 };
+
+struct feeder {
+    struct aa_agg *agg;
+    size_t thread;
+    const size_t *keys, *values;
+    size_t n;
+};
+
+static double now_s(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void product(void *acc, const void *value) {
+    *(size_t *)acc *= *(const size_t *)value;
+}
+
+static int feed(void *p) {
+    struct feeder *f = (struct feeder *)p;
+    for (size_t i = 0; i < f->n; i += BATCH) {
+        size_t n = f->n - i < BATCH ? f->n - i : BATCH;
+        assert(aa_agg_add_batch(f->agg, f->thread, (size_t *)f->keys + i, (size_t *)f->values + i, n) == 0);
+    }
+
+    return 0;
+}
+
+/* Splits the rows over nthreads feeding threads and collects the groups */
+static struct aa_agg *run(enum aa_agg_op op, void (*fold)(void *, const void *), const size_t *keys,
+                          const size_t *values, size_t n, size_t nthreads, size_t flush_at) {
+    struct aa_agg *agg = aa_agg_new(op, fold, nthreads, 16, flush_at);
+    assert(agg);
+
+    struct feeder f[8];
+    thrd_t threads[8];
+    assert(nthreads <= 8);
+    for (size_t t = 0; t < nthreads; t++) {
+        f[t] = (struct feeder){agg, t, keys + n * t / nthreads, values + n * t / nthreads,
+                               n * (t + 1) / nthreads - n * t / nthreads};
+        assert(thrd_create(&threads[t], feed, &f[t]) == thrd_success);
+    }
+    for (size_t t = 0; t < nthreads; t++)
+        thrd_join(threads[t], NULL);
+    assert(aa_agg_finish(agg) == 0);
+
+    return agg;
+}
+
+/* Row i falls in group i % groups and holds the value i % 7 + 1 */
+static void rows(size_t *keys, size_t *values, size_t n, size_t groups) {
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = i % groups * 2654435761U;
+        values[i] = i % 7 + 1;
+    }
+}
+
+static void check(struct aa_agg *agg, enum aa_agg_op op, const size_t *keys, const size_t *values, size_t n,
+                  size_t groups) {
+    struct aa *expect = aa_new();
+    assert(expect);
+    for (size_t i = 0; i < n; i++) {
+        size_t acc;
+        if (aa_get(expect, keys[i], &acc) != 0)
+            acc = op == AA_AGG_COUNT ? 1 : values[i];
+        else if (op == AA_AGG_COUNT)
+            acc++;
+        else if (op == AA_AGG_SUM)
+            acc += values[i];
+        else if (op == AA_AGG_MIN)
+            acc = values[i] < acc ? values[i] : acc;
+        else if (op == AA_AGG_MAX)
+            acc = values[i] > acc ? values[i] : acc;
+        else
+            acc *= values[i];
+        assert(aa_set(expect, keys[i], acc) == 0);
+    }
+
+    /* Every group comes out once with its aggregate, then the iteration starts over */
+    assert(aa_agg_len(agg) == groups);
+    size_t seen = 0;
+    for (struct aa_node *node = NULL; (node = aa_agg_next(agg)); seen++) {
+        size_t acc;
+        assert(aa_get(expect, node->key, &acc) == 0 && acc == node->value);
+        assert(aa_remove(expect, node->key) == 0);
+    }
+    assert(seen == groups && aa_len(expect) == 0);
+    assert(aa_agg_next(agg) != NULL);
+    aa_delete(expect);
+}
+
+int main(void) {
+    assert(!aa_agg_new(AA_AGG_CUSTOM, NULL, 1, 1, 0) && !aa_agg_new(AA_AGG_SUM, NULL, 0, 1, 0));
+
+    enum { N = 20000, GROUPS = 1000 };
+    size_t *keys = fat_malloc(sizeof(size_t) * N), *values = fat_malloc(sizeof(size_t) * N);
+    assert(keys && values);
+    rows(keys, values, N, GROUPS);
+
+    /* Small thread tables flush to the shared partitions many times over */
+    enum aa_agg_op ops[] = {AA_AGG_COUNT, AA_AGG_SUM, AA_AGG_MIN, AA_AGG_MAX, AA_AGG_CUSTOM};
+    for (size_t o = 0; o < sizeof(ops) / sizeof(*ops); o++) {
+        for (size_t nthreads = 1; nthreads <= 3; nthreads++) {
+            struct aa_agg *agg = run(ops[o], product, keys, values, N, nthreads, 64);
+            check(agg, ops[o], keys, values, N, GROUPS);
+            aa_agg_delete(agg);
+        }
+    }
+
+    /* Counting needs no values */
+    struct aa_agg *agg = aa_agg_new(AA_AGG_COUNT, NULL, 1, 4, 0);
+    assert(agg && aa_agg_add_batch(agg, 0, keys, NULL, N) == 0);
+    assert(aa_agg_add_batch(agg, 1, keys, NULL, N) != 0);
+    assert(aa_agg_len(agg) == 0 && aa_agg_finish(agg) == 0 && aa_agg_len(agg) == GROUPS);
+    check(agg, AA_AGG_COUNT, keys, values, N, GROUPS);
+    aa_agg_delete(agg);
+    fat_free(keys);
+    fat_free(values);
+
+    /* Rows per second against aa_get and aa_set on every row */
+    enum { ROWS = 4000000, BENCH_GROUPS = 10000 };
+    keys = fat_malloc(sizeof(size_t) * ROWS);
+    values = fat_malloc(sizeof(size_t) * ROWS);
+    assert(keys && values);
+    rows(keys, values, ROWS, BENCH_GROUPS);
+
+    double start = now_s();
+    struct aa *naive = aa_new();
+    assert(naive);
+    for (size_t i = 0; i < ROWS; i++) {
+        size_t sum = 0;
+        aa_get(naive, keys[i], &sum);
+        assert(aa_set(naive, keys[i], sum + values[i]) == 0);
+    }
+    double naive_s = now_s() - start;
+    assert(aa_len(naive) == BENCH_GROUPS);
+    aa_delete(naive);
+
+    printf("%-22s %12s\n%-22s %12.0f\n", "", "rows/s", "aa_get + aa_set", ROWS / naive_s);
+    double agg_s[4];
+    for (size_t nthreads = 1, i = 0; nthreads <= 8; nthreads *= 2, i++) {
+        start = now_s();
+        agg = run(AA_AGG_SUM, NULL, keys, values, ROWS, nthreads, 0);
+        agg_s[i] = now_s() - start;
+        assert(aa_agg_len(agg) == BENCH_GROUPS);
+        aa_agg_delete(agg);
+
+        char label[32];
+        snprintf(label, sizeof(label), "aa_agg, %zu thread%s", nthreads, nthreads > 1 ? "s" : "");
+        printf("%-22s %12.0f\n", label, ROWS / agg_s[i]);
+    }
+
+    fat_free(keys);
+    fat_free(values);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_AGG */
@@ -0,0 +1,141 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef TEST_AA_BLOOM
+
+#define AA_KEY char *
+#define AA_VALUE size_t
+#define AA_BLOOM
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+static double now_s(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static bool is_odd(struct aa_node *n, void *ctx) {
+    (void)ctx;
+    return n->value & 1;
+}
+
+static char **make_keys(const char *prefix, size_t n) {
+    char **keys = fat_malloc(sizeof(char *) * n);
+    assert(keys);
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = fat_malloc(32);
+        assert(keys[i]);
+        snprintf(keys[i], 32, "%s_%zu", prefix, i);
+    }
+
+    return keys;
+}
+
+static void free_keys(char **keys, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        fat_free(keys[i]);
+    fat_free(keys);
+}
+
+static double lookup_ns(struct aa *a, char **keys, size_t n, size_t expect) {
+    size_t found = 0, rounds = 2000000 / n + 1;
+    double start = now_s();
+    for (size_t r = 0; r < rounds; r++)
+        for (size_t i = 0; i < n; i++)
+            found += aa_get(a, keys[i], NULL) == 0;
+    double ns = (now_s() - start) * 1e9 / (double)(rounds * n);
+    assert(found == expect * rounds);
+
+    return ns;
+}
+
+static void bench(size_t n) {
+    char **hits = make_keys("key", n), **misses = make_keys("miss", n);
+    struct aa *a = aa_new();
+    assert(a);
+    for (size_t i = 0; i < n; i++)
+        assert(aa_set(a, hits[i], i) == 0);
+
+    double hit = lookup_ns(a, hits, n, n), miss = lookup_ns(a, misses, n, 0);
+
+    /* Half of the keys removed, their bits stay until the next rebuild */
+    for (size_t i = 0; i < n; i += 2)
+        assert(aa_remove(a, hits[i]) == 0);
+    double removed = lookup_ns(a, hits, n, n / 2);
+
+    printf("%8zu keys: hit %6.1f ns, miss %6.1f ns, half removed %6.1f ns\n", n, hit, miss, removed);
+
+    aa_delete(a);
+    free_keys(hits, n);
+    free_keys(misses, n);
+}
+
+int main(void) {
+    struct aa *a = aa_new();
+    assert(a);
+
+    enum { N = 100000 };
+    char key[32];
+
+    /* No false negatives through every resize */
+    for (size_t i = 0; i < N; i++) {
+        snprintf(key, sizeof(key), "key_%zu", i);
+        assert(aa_set(a, key, i) == 0);
+        snprintf(key, sizeof(key), "key_%zu", i / 2);
+        assert(aa_get(a, key, NULL) == 0);
+    }
+    assert(a->bloom && a->bloom_dim == aa_entries(a));
+
+    size_t passed = 0;
+    for (size_t i = 0; i < N; i++) {
+        snprintf(key, sizeof(key), "miss_%zu", i);
+        assert(aa_get(a, key, NULL) != 0);
+        passed += aa_bloom_test(a, aa_calc_hash(key));
+    }
+    printf("False positives: %.2f%%\n", 100.0 * (double)passed / N);
+    assert(passed < N / 10);
+
+    /* Removed keys stay misses, shrinking rebuilds the filter */
+    for (size_t i = 0; i < N; i += 2) {
+        snprintf(key, sizeof(key), "key_%zu", i);
+        assert(aa_remove(a, key) == 0);
+    }
+    for (size_t i = 0; i < N; i++) {
+        snprintf(key, sizeof(key), "key_%zu", i);
+        assert((aa_get(a, key, NULL) == 0) == (i % 2 == 1));
+    }
+    assert(a->bloom_stale <= aa_len(a));
+
+    for (size_t i = 0; i < N; i += 4) {
+        snprintf(key, sizeof(key), "key_%zu", i);
+        assert(aa_set(a, key, i) == 0);
+    }
+    assert(aa_remove_if(a, is_odd, NULL) == N / 2);
+    assert(aa_len(a) == N / 4);
+    for (size_t i = 0; i < N; i++) {
+        snprintf(key, sizeof(key), "key_%zu", i);
+        assert((aa_get(a, key, NULL) == 0) == (i % 4 == 0));
+    }
+
+    aa_clear(a);
+    assert(aa_get(a, "key_0", NULL) != 0);
+    assert(aa_set(a, "key_0", 0) == 0);
+    assert(aa_get(a, "key_0", NULL) == 0);
+    printf("Heap of a[%zu]: %zu\n", aa_len(a), _Allocated_memory);
+    aa_delete(a);
+
+    bench(1000);
+    bench(100000);
+    bench(1000000);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_BLOOM */
@@ -0,0 +1,88 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef TEST_AA_CACHE
+
+#define AA_KEY char *
+#define AA_VALUE size_t
+#define AA_CACHE
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+struct evicted {
+    size_t count, sum;
+};
+
+static void on_evict(struct aa_node *n, void *ctx) {
+    struct evicted *e = ctx;
+    e->count++;
+    e->sum += n->value;
+}
+
+int main(void) {
+    struct aa *a = aa_new();
+    assert(a);
+
+    struct evicted e = {};
+    assert(aa_set_capacity(a, 100, on_evict, &e) == 0);
+
+    char key[32];
+    aa_value_t value;
+
+    /* Hot keys are read between the inserts of a long cold scan */
+    for (size_t i = 0; i < 10; i++) {
+        snprintf(key, sizeof(key), "hot_%zu", i);
+        assert(aa_set(a, key, 0) == 0);
+    }
+    for (size_t i = 0; i < 10000; i++) {
+        snprintf(key, sizeof(key), "cold_%zu", i);
+        assert(aa_set(a, key, 1) == 0);
+        assert(aa_len(a) <= 100);
+
+        snprintf(key, sizeof(key), "hot_%zu", i % 10);
+        assert(aa_get(a, key, &value) == 0);
+    }
+    assert(aa_len(a) == 100);
+
+    /* Updating a resident key does not evict */
+    assert(aa_set(a, "hot_0", 0) == 0);
+    assert(aa_len(a) == 100);
+
+    struct aa_cache_stats stats = aa_cache_stats(a);
+    assert(stats.hits == 10000);
+    assert(stats.misses == 0);
+    assert(stats.evictions == 10010 - 100);
+    assert(e.count == stats.evictions);
+    assert(e.sum == e.count);
+
+    assert(aa_get(a, "cold_0", NULL) != 0);
+    assert(aa_cache_stats(a).misses == 1);
+
+    /* Lowering the capacity evicts right away */
+    assert(aa_set_capacity(a, 20, NULL, NULL) == 0);
+    assert(aa_len(a) == 20);
+    for (size_t i = 0; i < 10; i++) {
+        snprintf(key, sizeof(key), "hot_%zu", i);
+        assert(aa_get(a, key, NULL) == 0);
+    }
+    assert(aa_cache_stats(a).evictions == stats.evictions + 80);
+
+    /* No limit */
+    assert(aa_set_capacity(a, 0, NULL, NULL) == 0);
+    for (size_t i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "cold_%zu", i);
+        assert(aa_set(a, key, i) == 0);
+    }
+    assert(aa_len(a) >= 1000);
+    printf("Heap of a[%zu]: %zu\n", aa_len(a), _Allocated_memory);
+
+    aa_delete(a);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_CACHE */
@@ -0,0 +1,67 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef TEST_AA_COMPACT
+
+#define AA_KEY int
+#define AA_VALUE int
+#define AA_COMPACT
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+int main(void) {
+    struct aa *a = aa_new();
+    assert(a);
+
+    /* Keys go in backwards, iteration must follow insertion order */
+    for (int i = 100000; i > 0; i--)
+        assert(aa_set(a, i, -i) == 0);
+    printf("Heap of a[%zu]: %zu\n", aa_len(a), _Allocated_memory);
+
+    int expected = 100000;
+    for (struct aa_node *node = NULL; (node = aa_next(a)); expected--)
+        assert(node->key == expected && node->value == -expected);
+    assert(expected == 0);
+
+    /* Updating a key keeps its position */
+    assert(aa_set(a, 100000, 1) == 0);
+    assert(aa_next(a)->key == 100000);
+    aa_next(NULL);
+
+    for (int i = 1; i <= 100000; i++)
+        if (i % 10 != 0)
+            assert(aa_remove(a, i) == 0);
+    assert(aa_len(a) == 10000);
+
+    aa_value_t value;
+    assert(aa_get(a, 5, &value) != 0);
+    assert(aa_get(a, 50, &value) == 0 && value == -50);
+
+    /* Holes left by removals are skipped, and squeezed out by a rehash */
+    assert(aa_rehash(a) == 0);
+    assert(a->used == aa_len(a));
+
+    expected = 100000;
+    for (struct aa_node *node = NULL; (node = aa_next(a)); expected -= 10)
+        assert(node->key == expected);
+    assert(expected == 0);
+    printf("Heap of a[%zu]: %zu\n", aa_len(a), _Allocated_memory);
+
+    /* Re-inserted keys go to the end */
+    assert(aa_remove(a, 100000) == 0);
+    assert(aa_set(a, 100000, 0) == 0);
+    struct aa_node *last = NULL;
+    for (struct aa_node *node = NULL; (node = aa_next(a));)
+        last = node;
+    assert(last && last->key == 100000);
+
+    aa_delete(a);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_COMPACT */
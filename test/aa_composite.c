@@ -0,0 +1,85 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef TEST_AA_COMPOSITE
+
+/* Padded composite key: only the named fields take part in the identity */
+struct flow {
+    uint32_t tenant;
+    uint32_t id;
+    uint16_t shard;
+};
+
+static size_t flow_hash(struct flow f) {
+    size_t h = (size_t)f.tenant << 32 | f.id;
+
+    return (h ^ f.shard) * 0x9E3779B97F4A7C15;
+}
+
+static bool flow_equals(struct flow f1, struct flow f2) {
+    return f1.tenant == f2.tenant && f1.id == f2.id && f1.shard == f2.shard;
+}
+
+#define AA_KEY struct flow
+#define AA_VALUE size_t
+#define AA_KEY_HASH(key) flow_hash(key)
+#define AA_KEY_EQUALS(k1, k2) flow_equals(k1, k2)
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+static struct flow make_flow(uint32_t tenant, uint32_t id, uint16_t shard, unsigned char junk) {
+    struct flow f;
+
+    /* Dirty the padding so byte-wise hashing would fail */
+    memset(&f, junk, sizeof(f));
+    f.tenant = tenant;
+    f.id = id;
+    f.shard = shard;
+
+    return f;
+}
+
+int main(void) {
+    struct aa *a = aa_new();
+    assert(a);
+
+    for (uint32_t i = 0; i < 10000; i++)
+        assert(aa_set(a, make_flow(i % 7, i, (uint16_t)(i % 3), 0x00), i) == 0);
+    assert(aa_len(a) == 10000);
+
+    aa_value_t value;
+    for (uint32_t i = 0; i < 10000; i++) {
+        assert(aa_get(a, make_flow(i % 7, i, (uint16_t)(i % 3), 0xA5), &value) == 0);
+        assert(value == i);
+    }
+    assert(aa_get(a, make_flow(1, 0, 0, 0xFF), &value) != 0);
+
+    /* Overwrite and remove through keys with different padding */
+    assert(aa_set(a, make_flow(0, 0, 0, 0x5A), 42) == 0);
+    assert(aa_len(a) == 10000);
+    assert(aa_get(a, make_flow(0, 0, 0, 0x00), &value) == 0);
+    assert(value == 42);
+
+    size_t hash = aa_hash_key(make_flow(3, 10, 1, 0x11));
+    assert(hash == aa_hash_key(make_flow(3, 10, 1, 0x22)));
+    assert(aa_remove_hashed(a, hash, make_flow(3, 10, 1, 0x33)) == 0);
+    assert(aa_get(a, make_flow(3, 10, 1, 0x00), &value) != 0);
+
+    for (uint32_t i = 0; i < 10000; i += 2)
+        aa_remove(a, make_flow(i % 7, i, (uint16_t)(i % 3), 0xC3));
+    assert(aa_len(a) == 5000);
+    printf("Heap of a[%zu]: %zu\n", aa_len(a), _Allocated_memory);
+
+    aa_delete(a);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_COMPOSITE */
@@ -0,0 +1,97 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef TEST_AA_COW
+
+#define AA_KEY char *
+#define AA_VALUE size_t
+#define AA_COW
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+static void check(struct aa *a, size_t n, size_t add) {
+    char key[32];
+    aa_value_t value;
+
+    for (size_t i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "key_%zu", i);
+        assert(aa_get(a, key, &value) == 0);
+        assert(value == i + add);
+    }
+
+    return;
+}
+
+int main(void) {
+    struct aa *a = aa_new();
+    assert(a);
+
+    char key[32];
+    for (size_t i = 0; i < 50000; i++) {
+        snprintf(key, sizeof(key), "key_%zu", i);
+        assert(aa_set(a, key, i) == 0);
+    }
+
+    /* A clone only costs its page table */
+    size_t heap = _Allocated_memory;
+    struct aa *snap = aa_clone(a);
+    assert(snap);
+    assert(aa_len(snap) == aa_len(a));
+    assert(_Allocated_memory - heap < aa_entries(a) * sizeof(struct aa_bucket) / 32);
+
+    /* A single write copies one page and one node */
+    heap = _Allocated_memory;
+    assert(aa_set(a, "key_7", 1007) == 0);
+    assert(_Allocated_memory - heap < 4096);
+
+    aa_value_t value;
+    assert(aa_get(snap, "key_7", &value) == 0 && value == 7);
+    assert(aa_get(a, "key_7", &value) == 0 && value == 1007);
+
+    /* Writers go on: updates, removals, inserts and a resize */
+    for (size_t i = 0; i < 50000; i++) {
+        snprintf(key, sizeof(key), "key_%zu", i);
+        if (i % 2)
+            assert(aa_remove(a, key) == 0);
+        else
+            assert(aa_set(a, key, i + 1) == 0);
+    }
+    for (size_t i = 50000; i < 200000; i++) {
+        snprintf(key, sizeof(key), "key_%zu", i);
+        assert(aa_set(a, key, i) == 0);
+    }
+    assert(aa_len(a) == 175000);
+
+    /* The snapshot still sees the table as it was */
+    assert(aa_len(snap) == 50000);
+    check(snap, 50000, 0);
+    assert(aa_get(snap, "key_50000", &value) != 0);
+
+    size_t n = 0;
+    for (struct aa_node *node = NULL; (node = aa_next(snap));)
+        n++;
+    assert(n == 50000);
+
+    /* Clones of clones, written on both sides, outliving the original */
+    struct aa *snap2 = aa_clone(snap);
+    assert(snap2);
+    aa_delete(a);
+    assert(aa_set(snap, "key_1", 0) == 0);
+    assert(aa_remove(snap2, "key_2") == 0);
+    assert(aa_get(snap2, "key_1", &value) == 0 && value == 1);
+    assert(aa_get(snap, "key_2", &value) == 0 && value == 2);
+    assert(aa_len(snap2) == 49999);
+    printf("Heap of snap[%zu]: %zu\n", aa_len(snap), _Allocated_memory);
+
+    aa_delete(snap);
+    assert(aa_get(snap2, "key_3", &value) == 0 && value == 3);
+    aa_delete(snap2);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_COW */
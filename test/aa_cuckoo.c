@@ -0,0 +1,70 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef TEST_AA_CUCKOO
+
+#define AA_KEY char *
+#define AA_VALUE size_t
+#define AA_CUCKOO
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+int main(void) {
+    struct aa *a = aa_new();
+    assert(a);
+
+    /* The table fills past 90% before it grows */
+    double max_load = 0;
+    for (size_t i = 0; i < 500000; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "key_%zu", i);
+
+        assert(aa_set(a, key, i) == 0);
+
+        double load = (double)aa_len(a) / aa_entries(a);
+        if (load > max_load)
+            max_load = load;
+    }
+    printf("Heap of a[%zu]: %zu, max load %.3f\n", aa_len(a), _Allocated_memory, max_load);
+    assert(max_load >= 0.9);
+
+    aa_value_t value;
+    for (size_t i = 0; i < 500000; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "key_%zu", i);
+
+        assert(aa_get(a, key, &value) == 0);
+        assert(value == i);
+    }
+    assert(aa_get(a, "key_500000", &value) != 0);
+
+    /* Removal leaves no tombstones behind */
+    for (size_t i = 0; i < 500000; i += 2) {
+        char key[32];
+        snprintf(key, sizeof(key), "key_%zu", i);
+
+        assert(aa_remove(a, key) == 0);
+    }
+    assert(a->deleted == 0);
+    assert(aa_len(a) == 250000);
+    assert(aa_get(a, "key_0", &value) != 0);
+    assert(aa_get(a, "key_1", &value) == 0 && value == 1);
+
+    size_t n = 0;
+    for (struct aa_node *node = NULL; (node = aa_next(a)); n++)
+        assert(node->value % 2 == 1);
+    assert(n == 250000);
+
+    assert(aa_rehash(a) == 0);
+    assert(aa_get(a, "key_499999", &value) == 0 && value == 499999);
+
+    aa_delete(a);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_CUCKOO */
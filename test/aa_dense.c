@@ -0,0 +1,137 @@
+#include "alloc.h"
+#include <assert.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef TEST_AA_DENSE
+
+#define AA_KEY int
+#define AA_VALUE size_t
+#define AA_DENSE
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+static double now_s(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static bool is_odd(struct aa_node *n, void *ctx) {
+    (void)ctx;
+    return n->key % 2;
+}
+
+static double lookups(struct aa *a, const int *keys, size_t n, size_t rounds) {
+    size_t sum = 0;
+    double start = now_s();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < n; i++) {
+            aa_value_t value;
+            sum += aa_get(a, keys[i], &value) == 0 ? value : 0;
+        }
+    }
+    double ns = (now_s() - start) * 1e9 / (double)(rounds * n);
+    assert(sum == rounds * (n * (n - 1) / 2));
+
+    return ns;
+}
+
+int main(void) {
+    enum { N = 100000, ROUNDS = 20 };
+
+    struct aa *a = aa_new();
+    assert(a);
+
+    /* IDs from 0 fill their range, the table leaves the buckets as it grows */
+    for (int i = 0; i < N; i++)
+        assert(aa_set(a, i, (size_t)i) == 0);
+    assert(a->dense && !a->buckets && aa_len(a) == N);
+
+    aa_value_t value;
+    assert(aa_get(a, 4242, &value) == 0 && value == 4242);
+    assert(aa_get(a, N, &value) != 0 && aa_get(a, -1, &value) != 0);
+    assert(aa_set(a, 7, 70) == 0 && aa_len(a) == N);
+    assert(aa_get(a, 7, &value) == 0 && value == 70);
+
+    /* Negative keys widen the range downwards */
+    for (int i = -1; i >= -1000; i--)
+        assert(aa_set(a, i, (size_t)-i) == 0);
+    assert(a->dense && aa_len(a) == N + 1000);
+    assert(aa_get(a, -1000, &value) == 0 && value == 1000);
+
+    /* aa_next visits every entry once */
+    size_t n = 0;
+    for (struct aa_node *node = NULL; (node = aa_next(a));)
+        n++;
+    assert(n == N + 1000);
+
+    assert(aa_remove(a, -1000) == 0 && aa_remove(a, -1000) != 0);
+    assert(aa_remove_if(a, is_odd, NULL) == (N + 1000) / 2);
+    assert(a->dense && aa_get(a, 4242, &value) == 0 && aa_get(a, 4243, &value) != 0);
+
+    /* Under the shrink threshold the keys go back to buckets */
+    for (int i = 0; i < N; i += 2)
+        if (i % 32)
+            assert(aa_remove(a, i) == 0);
+    assert(!a->dense && a->buckets);
+    assert(aa_get(a, 320, &value) == 0 && value == 320);
+    assert(aa_get(a, -998, &value) == 0 && value == 998);
+    assert(aa_get(a, 322, &value) != 0);
+    aa_clear(a);
+
+    /* A key far from the others scatters the range */
+    for (int i = 0; i < N; i++)
+        assert(aa_set(a, i, (size_t)i) == 0);
+    assert(a->dense);
+    assert(aa_set(a, INT_MAX, 1) == 0 && aa_set(a, INT_MIN, 2) == 0);
+    assert(!a->dense && aa_len(a) == N + 2);
+    assert(aa_get(a, INT_MAX, &value) == 0 && value == 1);
+    assert(aa_get(a, INT_MIN, &value) == 0 && value == 2);
+    assert(aa_get(a, N - 1, &value) == 0 && value == N - 1);
+
+    /* And back once the outliers are gone and the table grows again */
+    assert(aa_remove(a, INT_MAX) == 0 && aa_remove(a, INT_MIN) == 0);
+    for (int i = N; i < 4 * N; i++)
+        assert(aa_set(a, i, (size_t)i) == 0);
+    assert(a->dense && aa_len(a) == 4 * N);
+    aa_delete(a);
+
+    /* The same number of entries, dense IDs against scattered ones */
+    int *ids = fat_malloc(sizeof(int) * N), *scattered = fat_malloc(sizeof(int) * N);
+    assert(ids && scattered);
+    for (int i = 0; i < N; i++) {
+        ids[i] = i * 7919 % N;
+        scattered[i] = (int)((unsigned)ids[i] * 2654435761U);
+    }
+
+    size_t heap = _Allocated_memory;
+    struct aa *dense = aa_new(), *hashed = aa_new();
+    assert(dense && hashed);
+    for (int i = 0; i < N; i++)
+        assert(aa_set(dense, ids[i], (size_t)i) == 0);
+    size_t dense_heap = _Allocated_memory - heap;
+    for (int i = 0; i < N; i++)
+        assert(aa_set(hashed, scattered[i], (size_t)i) == 0);
+    size_t hashed_heap = _Allocated_memory - heap - dense_heap;
+    assert(dense->dense && !hashed->dense);
+
+    double dense_ns = lookups(dense, ids, N, ROUNDS), hashed_ns = lookups(hashed, scattered, N, ROUNDS);
+    printf("%-8s %8s %12s\n%-8s %8.1f %12.1f\n%-8s %8.1f %12.1f\n", "", "ns/get", "bytes/entry", "dense", dense_ns,
+           (double)dense_heap / N, "hashed", hashed_ns, (double)hashed_heap / N);
+    assert(dense_heap < hashed_heap);
+
+    aa_delete(dense);
+    aa_delete(hashed);
+    fat_free(ids);
+    fat_free(scattered);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_DENSE */
@@ -0,0 +1,57 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef TEST_AA_HASHED
+
+#define AA_KEY char *
+#define AA_VALUE size_t
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+#ifndef countof
+#define countof(array) (sizeof(array) / sizeof(*array))
+#endif
+
+int main(void) {
+    struct aa *a = aa_new();
+    assert(a);
+
+    char *hot[] = {"GET", "POST", "PUT", "DELETE", "PATCH", "HEAD", "OPTIONS"};
+    size_t hash[countof(hot)];
+
+    /* Hash once, cache the result next to the key */
+    for (size_t i = 0; i < countof(hot); i++) {
+        hash[i] = aa_hash_key(hot[i]);
+        assert(hash[i] == aa_hash_key(hot[i]));
+        assert(aa_set_hashed(a, hash[i], hot[i], i) == 0);
+    }
+
+    aa_value_t value;
+    for (size_t j = 0; j < 1000000; j++) {
+        size_t i = j % countof(hot);
+        assert(aa_get_hashed(a, hash[i], hot[i], &value) == 0);
+        assert(value == i);
+    }
+
+    /* Hashed and plain entry points see the same table */
+    assert(aa_get(a, "PATCH", &value) == 0);
+    assert(value == 4);
+    assert(aa_set(a, "PATCH", 40) == 0);
+    assert(aa_get_hashed(a, hash[4], hot[4], &value) == 0);
+    assert(value == 40);
+
+    assert(aa_remove_hashed(a, hash[0], hot[0]) == 0);
+    assert(aa_get(a, "GET", &value) != 0);
+    assert(aa_remove_hashed(a, hash[0], hot[0]) != 0);
+    printf("Heap of a[%zu]: %zu\n", aa_len(a), _Allocated_memory);
+
+    aa_delete(a);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_HASHED */
@@ -0,0 +1,200 @@
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#ifdef TEST_AA_HPP
+
+/* Brings in alloc.h with C linkage */
+#include "aa.hpp"
+
+static double now_s() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Counts the live instances, every one must be gone with its map */
+struct counted {
+    static inline std::size_t live = 0;
+    std::size_t v;
+
+    explicit counted(std::size_t v = 0) : v(v) { live++; }
+    counted(const counted &other) : v(other.v) { live++; }
+    counted &operator=(const counted &) = default;
+    ~counted() { live--; }
+};
+
+struct transparent_hash {
+    using is_transparent = void;
+    std::size_t operator()(std::string_view key) const noexcept { return std::hash<std::string_view>{}(key); }
+};
+
+/* Counts the calls, every insert hashes its key once */
+struct counting_hash {
+    static inline std::size_t calls = 0;
+    std::size_t operator()(std::size_t key) const noexcept {
+        calls++;
+        return std::hash<std::size_t>{}(key);
+    }
+};
+
+template <class F> static double time_per_op(std::size_t ops, F f) {
+    double start = now_s();
+    f();
+    return (now_s() - start) * 1e9 / (double)ops;
+}
+
+int main() {
+    {
+        aa::map<std::string, counted> m;
+        for (std::size_t i = 0; i < 1000; i++)
+            assert(m.try_emplace("key_" + std::to_string(i), i).second);
+        assert(m.size() == 1000 && counted::live == 1000);
+        assert(!m.try_emplace("key_7", 0).second && m.at("key_7").v == 7);
+        assert(!m.insert_or_assign("key_7", counted(77)).second && m.at("key_7").v == 77);
+
+        /* std::string_view and literals find std::string keys without building one */
+        std::string_view sv = "key_999";
+        assert(m.find(sv) != m.end() && m.find(sv)->second.v == 999);
+        assert(m.contains("key_0") && !m.contains(std::string_view("key_1000")));
+
+        std::size_t sum = 0, n = 0;
+        for (const auto &[key, value] : m) {
+            sum += value.v;
+            n++;
+        }
+        assert(n == 1000 && sum == 999 * 1000 / 2 + 70);
+
+        /* Erasing through an iterator keeps the iteration going */
+        for (auto it = m.begin(); it != m.end();)
+            it = it->second.v % 2 ? m.erase(it) : std::next(it);
+        assert(m.size() == 500 && counted::live == 500);
+        assert(m.erase("key_0") == 1 && m.erase("key_0") == 0);
+        for (std::size_t i = 2; i < 1000; i += 2)
+            assert(m.erase(std::string_view("key_" + std::to_string(i))) == 1);
+        assert(m.empty() && m.bucket_count() == 0 && counted::live == 0);
+
+        bool thrown = false;
+        try {
+            m.at("missing");
+        } catch (const std::out_of_range &) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    {
+        /* Move-only values, moved in and out */
+        aa::map<std::uint64_t, std::unique_ptr<std::uint64_t>> m;
+        for (std::uint64_t i = 0; i < 10000; i++)
+            m[i] = std::make_unique<std::uint64_t>(i * 3);
+        assert(*m[9999] == 29997);
+        std::unique_ptr<std::uint64_t> p = std::move(m[42]);
+        assert(*p == 126 && !m[42]);
+
+        aa::map<std::uint64_t, std::unique_ptr<std::uint64_t>> moved = std::move(m);
+        assert(m.empty() && moved.size() == 10000 && *moved.at(9999) == 29997);
+        m = std::move(moved);
+        assert(m.size() == 10000);
+    }
+
+    {
+        /* Copies share no storage, RAII frees both */
+        aa::map<int, counted> m{{1, counted(10)}, {2, counted(20)}, {3, counted(30)}};
+        aa::map<int, counted> copy = m;
+        assert(counted::live == 6);
+        copy[1].v = 11;
+        assert(m.at(1).v == 10 && copy.at(1).v == 11 && copy.size() == 3);
+        m = copy;
+        assert(m.at(1).v == 11 && counted::live == 6);
+        m.clear();
+        assert(m.empty() && counted::live == 3);
+    }
+    assert(counted::live == 0);
+
+    {
+        /* Inserts hash their key once, resizes reuse the stored hashes */
+        aa::map<std::size_t, std::size_t, counting_hash> m;
+        for (std::size_t i = 0; i < 1000; i++)
+            assert(m.try_emplace(i, i).second);
+        assert(!m.try_emplace(7, 0).second && counting_hash::calls == 1001);
+        assert(m.insert_or_assign(1000, 1).second && !m.insert_or_assign(7, 8).second && counting_hash::calls == 1003);
+        m[1001] = 2;
+        assert(counting_hash::calls == 1004);
+    }
+
+    /* Against std::unordered_map: the same workload on integer and string keys */
+    enum { N = 1000000 };
+    std::vector<std::string> keys(N), misses(N);
+    for (std::size_t i = 0; i < N; i++) {
+        keys[i] = "user:" + std::to_string(i * 2654435761U % 1000003);
+        misses[i] = "none:" + std::to_string(i);
+    }
+
+    std::size_t found = 0;
+    {
+        aa::map<std::uint64_t, std::uint64_t> a;
+        std::unordered_map<std::uint64_t, std::uint64_t> u;
+        double ai = time_per_op(N, [&] {
+            for (std::uint64_t i = 0; i < N; i++)
+                a[i * 2654435761U] = i;
+        });
+        double ui = time_per_op(N, [&] {
+            for (std::uint64_t i = 0; i < N; i++)
+                u[i * 2654435761U] = i;
+        });
+        double af = time_per_op(N, [&] {
+            for (std::uint64_t i = 0; i < N; i++)
+                found += a.find(i * 2654435761U)->second == i;
+        });
+        double uf = time_per_op(N, [&] {
+            for (std::uint64_t i = 0; i < N; i++)
+                found += u.find(i * 2654435761U)->second == i;
+        });
+        std::printf("%-22s %12s %16s\n", "ns/op", "aa::map", "unordered_map");
+        std::printf("%-22s %12.1f %16.1f\n%-22s %12.1f %16.1f\n", "uint64 insert", ai, ui, "uint64 hit", af, uf);
+    }
+
+    {
+        aa::map<std::string, std::size_t> a;
+        std::unordered_map<std::string, std::size_t, transparent_hash, std::equal_to<>> u;
+        double ai = time_per_op(N, [&] {
+            for (std::size_t i = 0; i < N; i++)
+                a.try_emplace(keys[i], i);
+        });
+        double ui = time_per_op(N, [&] {
+            for (std::size_t i = 0; i < N; i++)
+                u.try_emplace(keys[i], i);
+        });
+        double af = time_per_op(N, [&] {
+            for (std::size_t i = 0; i < N; i++)
+                found += a.contains(std::string_view(keys[i]));
+        });
+        double uf = time_per_op(N, [&] {
+            for (std::size_t i = 0; i < N; i++)
+                found += u.contains(std::string_view(keys[i]));
+        });
+        double am = time_per_op(N, [&] {
+            for (std::size_t i = 0; i < N; i++)
+                found += a.contains(std::string_view(misses[i]));
+        });
+        double um = time_per_op(N, [&] {
+            for (std::size_t i = 0; i < N; i++)
+                found += u.contains(std::string_view(misses[i]));
+        });
+        std::printf("%-22s %12.1f %16.1f\n%-22s %12.1f %16.1f\n%-22s %12.1f %16.1f\n", "string insert", ai, ui,
+                    "string_view hit", af, uf, "string_view miss", am, um);
+    }
+    assert(found == 4 * (std::size_t)N);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_HPP */
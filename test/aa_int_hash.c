@@ -0,0 +1,81 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef TEST_AA_INT_HASH
+
+#define AA_KEY int
+#define AA_VALUE int
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+#ifndef countof
+#define countof(array) (sizeof(array) / sizeof(*array))
+#endif
+
+/*
+ * Throws n keys (start, start + stride, ...) into 2^bits buckets the way
+ * aa_mask does and returns the share of keys that got a bucket of their own.
+ * Random placement at load 1/2 gives about 0.79.
+ */
+static double spread(int start, int stride, size_t bits, size_t *max_load) {
+    size_t dim = (size_t)1 << bits, n = dim / 2, distinct = 0;
+    unsigned char *load = (unsigned char *)fat_malloc(dim);
+    assert(load);
+
+    *max_load = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t b = aa_calc_hash(start + (int)i * stride) & (dim - 1);
+        distinct += load[b] == 0;
+        if (load[b] < 255 && ++load[b] > *max_load)
+            *max_load = load[b];
+    }
+
+    fat_free(load);
+
+    return (double)distinct / n;
+}
+
+int main(void) {
+    int strides[] = {1, 2, 3, 8, 10, 64, 100, 1000, 1024, 4096, 65536, 1 << 20};
+
+    for (size_t bits = 8; bits <= 20; bits += 4)
+        for (size_t s = 0; s < countof(strides); s++) {
+            /* Keep every key within int */
+            if (((long long)1 << (bits - 1)) * strides[s] >= (1LL << 30))
+                continue;
+
+            size_t max_load;
+            double share = spread(0, strides[s], bits, &max_load);
+            printf("buckets 2^%zu, stride %d: %.3f distinct, max load %zu\n", bits, strides[s], share, max_load);
+            assert(share > 0.7);
+            assert(max_load <= 12);
+
+            share = spread(-(1 << 30), strides[s], bits, &max_load);
+            assert(share > 0.7);
+            assert(max_load <= 12);
+        }
+
+    /* Strided keys like the ones in test/aa_int.c still land where they are looked up */
+    struct aa *a = aa_new();
+    assert(a);
+
+    for (int i = 0; i < 1000000; i++)
+        assert(aa_set(a, i * 1024, i) == 0);
+
+    aa_value_t value;
+    for (int i = 0; i < 1000000; i++) {
+        assert(aa_get(a, i * 1024, &value) == 0);
+        assert(value == i);
+    }
+    assert(aa_get(a, 1, &value) != 0);
+
+    aa_delete(a);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_INT_HASH */
@@ -0,0 +1,141 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef TEST_AA_KEY_POOL
+
+#define AA_KEY char *
+#define AA_VALUE size_t
+#define AA_KEY_POOL
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+/*
+ * A plain char * table allocates strlen + 1 bytes per key and otherwise the
+ * same buckets and nodes, so its heap is ours with the pool swapped for them
+ */
+static void compare(const char *what, size_t heap, size_t capacity, size_t plain_key_bytes, size_t entries) {
+    printf("%s: heap %.1f per entry with the pool, %.1f with plain char * keys\n", what, (double)heap / entries,
+           (double)(heap - capacity + plain_key_bytes) / entries);
+
+    return;
+}
+
+int main(void) {
+    enum { N = 200000, SHARED = 20000 };
+    char key[64];
+
+    /* A private pool, created on the first insert, costs at most a page more than plain keys */
+    size_t heap = _Allocated_memory, key_bytes = 0;
+    struct aa *a = aa_new();
+    assert(a);
+    assert(aa_set(a, "user:0", 0) == 0);
+    assert(aa_key_pool_stats(a->key_pool).capacity == AA_KEY_POOL_PAGE_MIN);
+    for (size_t i = 0; i < N; i++) {
+        key_bytes += (size_t)snprintf(key, sizeof(key), "user:%zu", i) + 1;
+        assert(aa_set(a, key, i) == 0);
+    }
+    struct aa_key_pool_stats stats = aa_key_pool_stats(a->key_pool);
+    assert(stats.keys == N && stats.bytes == key_bytes);
+    assert(stats.capacity < key_bytes + ((size_t)1 << AA_KEY_POOL_PAGE_BITS));
+    compare("Private pool", _Allocated_memory - heap, stats.capacity, key_bytes, N);
+
+    /* Removing most keys shrinks the table, which compacts the pool */
+    for (size_t i = 0; i < N; i++) {
+        if (i % 10 == 0)
+            continue;
+        snprintf(key, sizeof(key), "user:%zu", i);
+        assert(aa_remove(a, key) == 0);
+    }
+    struct aa_key_pool_stats after = aa_key_pool_stats(a->key_pool);
+    assert(after.keys == N / 10);
+    assert(after.capacity < stats.capacity);
+    for (size_t i = 0; i < N; i++) {
+        aa_value_t value;
+        snprintf(key, sizeof(key), "user:%zu", i);
+        assert((aa_get(a, key, &value) == 0) == (i % 10 == 0));
+        assert(i % 10 != 0 || value == i);
+    }
+    aa_delete(a);
+    assert(_Allocated_memory == heap);
+
+    /* Three tables keyed by the same addresses keep one copy of each */
+    struct aa_key_pool *pool = aa_key_pool_new();
+    struct aa *tables[3];
+    assert(pool);
+    key_bytes = 0;
+    for (size_t t = 0; t < 3; t++) {
+        assert((tables[t] = aa_new()) && aa_set_key_pool(tables[t], pool) == 0);
+        for (size_t i = 0; i < SHARED; i++) {
+            key_bytes += (size_t)snprintf(key, sizeof(key), "user%06zu@mail.example.com", i) + 1;
+            assert(aa_set(tables[t], key, i) == 0);
+        }
+    }
+    aa_key_pool_release(pool);
+    stats = aa_key_pool_stats(pool);
+    assert(stats.keys == SHARED);
+    assert(stats.capacity * 2 < key_bytes);
+    compare("Shared pool", _Allocated_memory - heap, stats.capacity, key_bytes, 3 * SHARED);
+
+    /* Removals leave a shared pool as it is, only aa_key_pool_compact moves its keys */
+    for (size_t i = 0; i < SHARED - 1; i++) {
+        snprintf(key, sizeof(key), "user%06zu@mail.example.com", i);
+        for (size_t t = 0; t < 3; t++)
+            assert(aa_remove(tables[t], key) == 0);
+    }
+    assert(aa_key_pool_stats(pool).capacity == stats.capacity);
+    assert(aa_key_pool_compact(pool) == 0);
+    assert(aa_key_pool_stats(pool).capacity < stats.capacity);
+    for (size_t t = 0; t < 3; t++)
+        aa_delete(tables[t]);
+    assert(_Allocated_memory == heap);
+
+    /* Tables sharing a pool store identical keys once */
+    pool = aa_key_pool_new();
+    assert(pool);
+    struct aa *users = aa_new(), *sessions = aa_new();
+    assert(users && sessions);
+    assert(aa_set_key_pool(users, pool) == 0);
+    assert(aa_set_key_pool(sessions, pool) == 0);
+    for (size_t i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "user:%zu", i);
+        assert(aa_set(users, key, i) == 0);
+        assert(aa_set(sessions, key, i * 2) == 0);
+    }
+    assert(aa_key_pool_stats(pool).keys == 1000);
+    assert(aa_set_key_pool(users, pool) != 0);
+
+    /* Keys dropped by one table stay live for the other */
+    for (size_t i = 0; i < 1000; i += 2) {
+        snprintf(key, sizeof(key), "user:%zu", i);
+        assert(aa_remove(users, key) == 0);
+    }
+    assert(aa_key_pool_compact(pool) == 0);
+    assert(aa_key_pool_stats(pool).keys == 1000);
+    for (size_t i = 0; i < 1000; i++) {
+        aa_value_t value;
+        snprintf(key, sizeof(key), "user:%zu", i);
+        assert(aa_get(sessions, key, &value) == 0 && value == i * 2);
+        assert((aa_get(users, key, &value) == 0) == (i % 2 == 1));
+    }
+
+    aa_clear(sessions);
+    assert(aa_key_pool_compact(pool) == 0);
+    assert(aa_key_pool_stats(pool).keys == 500);
+
+    /* Dead keys are revived without a copy until the next compaction */
+    aa_clear(users);
+    assert(aa_set(users, "user:1", 1) == 0);
+    assert(aa_key_pool_stats(pool).keys == 1);
+
+    aa_key_pool_release(pool);
+    aa_delete(users);
+    aa_delete(sessions);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_KEY_POOL */
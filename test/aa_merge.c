@@ -0,0 +1,142 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef TEST_AA_MERGE
+
+#define AA_KEY char *
+#define AA_VALUE size_t
+#define AA_PARALLEL
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+static double now_s(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void sum(struct aa_node *n, struct aa_node *other, void *ctx) {
+    (void)ctx;
+    n->value += other->value;
+}
+
+static struct aa_node *node_of(struct aa *a, const char *key) {
+    for (struct aa_node *n = NULL; (n = aa_next(a));) {
+        if (strcmp(n->key, key) == 0) {
+            /* Stopped early, the next walk starts over */
+            aa_next(NULL);
+            return n;
+        }
+    }
+
+    return NULL;
+}
+
+/* Per-worker partial counts: worker w saw key_i w + 1 times for every i in [w * N / 2, w * N / 2 + N) */
+static void partials(struct aa **parts, size_t workers, size_t n) {
+    char key[32];
+    for (size_t w = 0; w < workers; w++) {
+        assert((parts[w] = aa_new()));
+        for (size_t i = w * n / 2; i < w * n / 2 + n; i++) {
+            snprintf(key, sizeof(key), "key_%zu", i);
+            assert(aa_set(parts[w], key, w + 1) == 0);
+        }
+    }
+}
+
+static void check(struct aa *a, size_t workers, size_t n) {
+    char key[32];
+    assert(aa_len(a) == (workers + 1) * n / 2);
+    for (size_t i = 0; i < (workers + 1) * n / 2; i++) {
+        size_t expect = 0;
+        for (size_t w = 0; w < workers; w++)
+            if (i >= w * n / 2 && i < w * n / 2 + n)
+                expect += w + 1;
+
+        aa_value_t value;
+        snprintf(key, sizeof(key), "key_%zu", i);
+        assert(aa_get(a, key, &value) == 0 && value == expect);
+    }
+}
+
+int main(void) {
+    struct aa *a = aa_new(), *b = aa_new();
+    assert(a && b);
+
+    assert(aa_set(a, "both", 1) == 0 && aa_set(a, "only a", 2) == 0 && aa_set(a, "gone", 0) == 0);
+    assert(aa_remove(a, "gone") == 0);
+    assert(aa_set(b, "both", 10) == 0 && aa_set(b, "only b", 20) == 0);
+
+    /* The nodes of b move over with their keys */
+    struct aa_node *moved = node_of(b, "only b");
+    char *key = moved->key;
+    assert(aa_merge(a, b, sum, NULL) == 0);
+    assert(aa_len(b) == 0 && aa_len(a) == 3);
+    assert(node_of(a, "only b") == moved && moved->key == key);
+
+    aa_value_t value;
+    assert(aa_get(a, "both", &value) == 0 && value == 11);
+    assert(aa_get(a, "only a", &value) == 0 && value == 2);
+    assert(aa_get(a, "gone", &value) != 0);
+
+    /* Without a conflict function the value of src wins */
+    assert(aa_set(b, "both", 100) == 0);
+    assert(aa_merge(a, b, NULL, NULL) == 0);
+    assert(aa_get(a, "both", &value) == 0 && value == 100 && aa_len(a) == 3);
+    assert(aa_merge(a, a, NULL, NULL) == 0 && aa_merge(a, b, NULL, NULL) == 0 && aa_len(a) == 3);
+    aa_delete(a);
+    aa_delete(b);
+
+    /* Partial tables of workers, merged one by one and on threads */
+    enum { WORKERS = 8, N = 100000, THREADS = 4 };
+    struct aa *parts[WORKERS];
+
+    partials(parts, WORKERS, N);
+    double start = now_s();
+    struct aa *naive = aa_new();
+    assert(naive);
+    for (size_t w = 0; w < WORKERS; w++) {
+        for (struct aa_node *n = NULL; (n = aa_next(parts[w]));) {
+            aa_value_t prev = 0;
+            aa_get(naive, n->key, &prev);
+            assert(aa_set(naive, n->key, prev + n->value) == 0);
+        }
+    }
+    double naive_s = now_s() - start;
+    check(naive, WORKERS, N);
+    for (size_t w = 0; w < WORKERS; w++)
+        aa_delete(parts[w]);
+    aa_delete(naive);
+
+    partials(parts, WORKERS, N);
+    start = now_s();
+    for (size_t w = 1; w < WORKERS; w++)
+        assert(aa_merge(parts[0], parts[w], sum, NULL) == 0);
+    double merge_s = now_s() - start;
+    check(parts[0], WORKERS, N);
+    for (size_t w = 0; w < WORKERS; w++)
+        aa_delete(parts[w]);
+
+    partials(parts, WORKERS, N);
+    start = now_s();
+    for (size_t w = 1; w < WORKERS; w++)
+        assert(aa_merge_parallel(parts[0], parts[w], sum, NULL, THREADS) == 0);
+    double parallel_s = now_s() - start;
+    check(parts[0], WORKERS, N);
+    for (size_t w = 0; w < WORKERS; w++)
+        aa_delete(parts[w]);
+
+    printf("%-22s %8.1f ms\n%-22s %8.1f ms\n%-22s %8.1f ms\n", "aa_next + aa_get/set", naive_s * 1e3, "aa_merge",
+           merge_s * 1e3, "aa_merge_parallel", parallel_s * 1e3);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_MERGE */
@@ -0,0 +1,102 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef TEST_AA_MULTI
+
+#define AA_KEY size_t
+#define AA_VALUE size_t
+#define AA_MULTI
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+static double now_s(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static bool has_many(struct aa_node *n, void *ctx) { return n->count >= *(size_t *)ctx; }
+
+int main(void) {
+    struct aa *a = aa_new();
+    assert(a);
+
+    /* Adjacency lists: node i links to i+1 ... i+(i % 32) */
+    enum { N = 20000 };
+    size_t edges = 0;
+    for (size_t i = 0; i < N; i++)
+        for (size_t j = 1; j <= i % 32; j++, edges++)
+            assert(aa_add(a, i, i + j) == 0);
+    assert(aa_len(a) == N - N / 32);
+
+    for (size_t i = 0; i < N; i++) {
+        struct aa_span s = aa_get_all(a, i);
+        assert(s.len == i % 32 && aa_count(a, i) == s.len);
+        for (size_t j = 0; j < s.len; j++)
+            assert(s.data[j] == i + j + 1);
+    }
+    assert(aa_get_all(a, N).len == 0 && aa_get_all(a, N).data == NULL);
+
+    /* Duplicates are kept, remove_one takes the first one and keeps the order */
+    assert(aa_add(a, 31, 32) == 0);
+    assert(aa_count(a, 31) == 32);
+    assert(aa_remove_one(a, 31, 32) == 0);
+    struct aa_span s = aa_get_all(a, 31);
+    assert(s.len == 31 && s.data[0] == 33 && s.data[30] == 32);
+    assert(aa_remove_one(a, 31, 1000) != 0);
+    assert(aa_remove_one(a, N, 0) != 0);
+
+    /* The last value takes the key along */
+    assert(aa_remove_one(a, 1, 2) == 0);
+    assert(aa_count(a, 1) == 0);
+    assert(aa_len(a) == N - N / 32 - 1);
+
+    /* Draining a long list shrinks its chunk */
+    for (size_t j = 2; j < 31; j++)
+        assert(aa_remove_one(a, 63, 63 + j) == 0);
+    s = aa_get_all(a, 63);
+    assert(s.len == 2 && s.data[0] == 64 && s.data[1] == 94);
+
+    size_t many = 16;
+    assert(aa_remove_if(a, has_many, &many) > 0);
+    for (size_t i = 0; i < N; i++)
+        assert(aa_count(a, i) < 16);
+    assert(aa_remove(a, 2) == 0);
+    assert(aa_count(a, 2) == 0);
+
+    printf("Heap of a[%zu]: %zu\n", aa_len(a), _Allocated_memory);
+    aa_clear(a);
+    assert(aa_len(a) == 0);
+    assert(aa_add(a, 7, 1) == 0 && aa_count(a, 7) == 1);
+    aa_delete(a);
+
+    /* Fan-out reads are sequential scans of one chunk per key */
+    a = aa_new();
+    assert(a);
+    for (size_t i = 0; i < N; i++)
+        for (size_t j = 1; j <= i % 32; j++)
+            assert(aa_add(a, i, i + j) == 0);
+
+    size_t sum = 0, rounds = 50;
+    double start = now_s();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < N; i++) {
+            s = aa_get_all(a, i);
+            for (size_t j = 0; j < s.len; j++)
+                sum += s.data[j];
+        }
+    }
+    printf("%-10s %8.2f ns/value\n", "fan-out", (now_s() - start) * 1e9 / (double)(rounds * edges));
+    assert(sum > 0);
+    aa_delete(a);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_MULTI */
@@ -0,0 +1,91 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef TEST_AA_PARALLEL
+
+#define AA_KEY size_t
+#define AA_VALUE size_t
+#define AA_PARALLEL
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+struct stats {
+    size_t count, sum, max;
+};
+
+static void fold(struct aa_node *n, void *acc) {
+    struct stats *s = acc;
+    s->count++;
+    s->sum += n->value;
+    if (n->value > s->max)
+        s->max = n->value;
+}
+
+static void combine(void *acc, const void *part) {
+    struct stats *s = acc;
+    const struct stats *p = part;
+    s->count += p->count;
+    s->sum += p->sum;
+    if (p->max > s->max)
+        s->max = p->max;
+}
+
+static void visit(struct aa_node *n, void *ctx) { atomic_fetch_add((atomic_size_t *)ctx, n->value); }
+
+static double now_s(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(void) {
+    struct aa *a = aa_new();
+    assert(a);
+
+    enum { N = 2000000 };
+    for (size_t i = 0; i < N; i++)
+        assert(aa_set(a, i * 7919, i) == 0);
+
+    /* Serial reference */
+    struct stats ref = {};
+    double start = now_s();
+    for (struct aa_node *n = NULL; (n = aa_next(a));)
+        fold(n, &ref);
+    printf("%-10s %8.2f ms\n", "aa_next", (now_s() - start) * 1e3);
+    assert(ref.count == N && ref.max == N - 1 && ref.sum == (size_t)N * (N - 1) / 2);
+
+    for (size_t nthreads = 0; nthreads <= 8; nthreads = nthreads ? nthreads * 2 : 1) {
+        struct stats s = {};
+        start = now_s();
+        assert(aa_reduce(a, fold, combine, &s, sizeof(s), nthreads) == 0);
+        printf("reduce/%zu   %8.2f ms\n", nthreads, (now_s() - start) * 1e3);
+        assert(s.count == ref.count && s.sum == ref.sum && s.max == ref.max);
+
+        atomic_size_t sum;
+        atomic_init(&sum, 0);
+        assert(aa_for_each_parallel(a, visit, &sum, nthreads) == 0);
+        assert(atomic_load(&sum) == ref.sum);
+    }
+
+    /* Empty and tiny tables */
+    struct aa *e = aa_new();
+    struct stats s = {};
+    assert(aa_reduce(e, fold, combine, &s, sizeof(s), 4) == 0 && s.count == 0);
+    assert(aa_set(e, 1, 5) == 0);
+    assert(aa_reduce(e, fold, combine, &s, sizeof(s), 4) == 0 && s.count == 1 && s.sum == 5);
+    aa_delete(e);
+
+    printf("Heap of a[%zu]: %zu\n", aa_len(a), _Allocated_memory);
+    aa_delete(a);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_PARALLEL */
@@ -0,0 +1,58 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef TEST_AA_REMOVE_IF
+
+#define AA_KEY char *
+#define AA_VALUE size_t
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+static bool expired(struct aa_node *node, void *ctx) { return node->value < *(size_t *)ctx; }
+
+static bool odd(struct aa_node *node, void *) { return node->value % 2 != 0; }
+
+int main(void) {
+    struct aa *a = aa_new();
+    assert(a);
+
+    /* The value is the time an entry expires at */
+    for (size_t i = 0; i < 200000; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "key_%zu", i);
+
+        assert(aa_set(a, key, i) == 0);
+    }
+    printf("Heap of a[%zu]: %zu\n", aa_len(a), _Allocated_memory);
+
+    size_t now = 150000;
+    assert(aa_remove_if(a, expired, &now) == 150000);
+    assert(aa_len(a) == 50000);
+    assert(aa_remove_if(a, expired, &now) == 0);
+    assert(aa_get(a, "key_149999", NULL) != 0);
+    assert(aa_get(a, "key_150000", NULL) == 0);
+    printf("Heap of a[%zu]: %zu\n", aa_len(a), _Allocated_memory);
+
+    assert(aa_retain_if(a, odd, NULL) == 25000);
+    assert(aa_len(a) == 25000);
+    for (struct aa_node *node = NULL; (node = aa_next(a));)
+        assert(node->value % 2 != 0 && node->value >= now);
+
+    /* The table stays usable after a sweep */
+    assert(aa_set(a, "key_0", 0) == 0);
+    assert(aa_get(a, "key_150001", NULL) == 0);
+
+    now = (size_t)-1;
+    assert(aa_remove_if(a, expired, &now) == 25001);
+    assert(aa_len(a) == 0);
+
+    aa_delete(a);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_REMOVE_IF */
@@ -0,0 +1,221 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef TEST_AA_REPLAY
+
+/*
+ * Replays a trace recorded with AA_TRACE against this instantiation.
+ * Build with any AA_KEY/AA_VALUE (or AA_SET) and engine flags to compare
+ * configurations on the same traffic:
+ *
+ *     aa_replay [trace.bin]
+ *
+ * Without an argument a skewed synthetic trace is recorded first.
+ */
+#ifndef AA_KEY
+#define AA_KEY char *
+#endif /* AA_KEY */
+#if !defined(AA_VALUE) && !defined(AA_SET)
+#define AA_VALUE size_t
+#endif /* !AA_VALUE && !AA_SET */
+#define AA_TRACE
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+struct replay_op {
+    enum aa_trace_op op;
+    size_t key, key_len;
+};
+
+struct replay {
+    struct replay_op *ops;
+    size_t len, cap;
+    unsigned char *arena;
+    size_t used, size;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+
+    return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+}
+
+static aa_key_t replay_key(const unsigned char *bytes, size_t len) {
+    aa_key_t key;
+    memset(&key, 0, sizeof(key));
+
+    if (IS_POINTER(key)) {
+        const unsigned char *s = bytes;
+        memcpy(&key, &s, sizeof(key) < sizeof(s) ? sizeof(key) : sizeof(s));
+    } else
+        memcpy(&key, bytes, len < sizeof(key) ? len : sizeof(key));
+
+    return key;
+}
+
+static int replay_push(struct replay *r, const struct aa_trace_record *rec) {
+    if (r->len == r->cap) {
+        size_t cap = r->cap ? r->cap * 2 : 1024;
+        struct replay_op *ops = realloc(r->ops, cap * sizeof(*ops));
+        if (!ops)
+            return -1;
+        r->ops = ops, r->cap = cap;
+    }
+    if (r->used + rec->key_len + 1 > r->size) {
+        size_t size = r->size ? r->size * 2 : 1 << 16;
+        while (size < r->used + rec->key_len + 1)
+            size *= 2;
+        unsigned char *arena = realloc(r->arena, size);
+        if (!arena)
+            return -1;
+        r->arena = arena, r->size = size;
+    }
+
+    /* Keys are kept NUL-terminated so string instantiations can use them directly */
+    memcpy(r->arena + r->used, rec->key, rec->key_len + 1);
+    r->ops[r->len++] = (struct replay_op){.op = rec->op, .key = r->used, .key_len = rec->key_len};
+    r->used += rec->key_len + 1;
+
+    return 0;
+}
+
+static void record_synthetic(FILE *out) {
+    struct aa *a = aa_new();
+    assert(a);
+    assert(aa_trace(a, out) == 0);
+
+    uint64_t x = 0x9E3779B97F4A7C15U;
+    for (size_t i = 0; i < 200000; i++) {
+        x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+
+        /* Product of two uniform draws: a few hot keys and a long tail */
+        size_t id = (size_t)(x & 0x3FF) * (size_t)(x >> 10 & 0x3FF) / 16;
+        char buf[32];
+        aa_key_t key;
+        if (IS_POINTER(key)) {
+            snprintf(buf, sizeof(buf), "user:%zu", id);
+            key = replay_key((const unsigned char *)buf, strlen(buf));
+        } else
+            key = replay_key((const unsigned char *)&id, sizeof(id));
+
+        unsigned dice = (unsigned)(x >> 32) % 10;
+#ifndef AA_SET
+        if (dice < 7)
+            aa_get(a, key, NULL);
+        else if (dice < 9)
+            aa_set(a, key, i);
+        else
+            aa_remove(a, key);
+#else
+        if (dice < 7)
+            aa_contains(a, key);
+        else if (dice < 9)
+            aa_insert(a, key);
+        else
+            aa_remove(a, key);
+#endif /* AA_SET */
+    }
+
+    assert(aa_trace(a, NULL) == 0);
+    aa_delete(a);
+
+    return;
+}
+
+static void run(const struct replay *r, uint32_t *latency, size_t *peak) {
+    struct aa *a = aa_new();
+    assert(a);
+
+    for (size_t i = 0; i < r->len; i++) {
+        aa_key_t key = replay_key(r->arena + r->ops[i].key, r->ops[i].key_len);
+        uint64_t start = latency ? now_ns() : 0;
+
+        switch (r->ops[i].op) {
+#ifndef AA_SET
+        case AA_TRACE_SET:
+            aa_set(a, key, i);
+            break;
+        case AA_TRACE_GET:
+            aa_get(a, key, NULL);
+            break;
+#else
+        case AA_TRACE_SET:
+            aa_insert(a, key);
+            break;
+        case AA_TRACE_GET:
+            aa_contains(a, key);
+            break;
+#endif /* AA_SET */
+        case AA_TRACE_REMOVE:
+            aa_remove(a, key);
+            break;
+        }
+
+        if (latency) {
+            uint64_t ns = now_ns() - start;
+            latency[i] = ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+            if (_Allocated_memory > *peak)
+                *peak = _Allocated_memory;
+        }
+    }
+
+    aa_delete(a);
+
+    return;
+}
+
+static int compare_u32(const void *p1, const void *p2) {
+    uint32_t x1 = *(const uint32_t *)p1, x2 = *(const uint32_t *)p2;
+
+    return (x1 > x2) - (x1 < x2);
+}
+
+int main(int argc, char *argv[]) {
+    FILE *in = argc > 1 ? fopen(argv[1], "rb") : tmpfile();
+    assert(in);
+    if (argc <= 1) {
+        record_synthetic(in);
+        rewind(in);
+    }
+    assert(_Allocated_memory == 0);
+
+    struct replay r = {};
+    struct aa_trace_record rec = {};
+    while (aa_trace_read(in, &rec) == 0)
+        assert(replay_push(&r, &rec) == 0);
+    assert(feof(in));
+    fclose(in);
+    assert(r.len > 0);
+    printf("Trace: %zu ops, %.3f s recorded\n", r.len, (double)rec.time / 1e9);
+
+    uint64_t start = now_ns();
+    run(&r, NULL, NULL);
+    double seconds = (double)(now_ns() - start) / 1e9;
+    printf("Throughput: %.2f Mops/s\n", (double)r.len / seconds / 1e6);
+
+    uint32_t *latency = malloc(r.len * sizeof(*latency));
+    assert(latency);
+    size_t peak = 0;
+    run(&r, latency, &peak);
+    qsort(latency, r.len, sizeof(*latency), compare_u32);
+    printf("Latency ns: p50 %u, p90 %u, p99 %u, p99.9 %u, max %u\n", latency[r.len / 2], latency[r.len * 9 / 10],
+           latency[r.len * 99 / 100], latency[r.len * 999 / 1000], latency[r.len - 1]);
+    printf("Peak heap: %zu\n", peak);
+
+    free(latency);
+    free(r.ops);
+    free(r.arena);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_REPLAY */
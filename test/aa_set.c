@@ -0,0 +1,79 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef TEST_AA_SET
+
+#define AA_KEY char *
+#define AA_SET
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+int main(void) {
+    struct aa *seen = aa_new();
+    assert(seen);
+
+    /* Deduplicate a stream with a single probe per key */
+    size_t unique = 0;
+    for (size_t i = 0; i < 300000; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "key_%zu", i % 100000);
+
+        int r = aa_insert(seen, key);
+        assert(r >= 0);
+        unique += r == 0;
+    }
+    assert(unique == 100000);
+    assert(aa_len(seen) == 100000);
+    assert(aa_contains(seen, "key_99999"));
+    assert(!aa_contains(seen, "key_100000"));
+    printf("Heap of seen[%zu]: %zu\n", aa_len(seen), _Allocated_memory);
+
+    struct aa *even = aa_new(), *odd = aa_new();
+    assert(even && odd);
+
+    for (size_t i = 0; i < 1000; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "key_%zu", i);
+
+        assert(aa_insert(i % 2 ? odd : even, key) == 0);
+    }
+
+    /* seen = {0..99999} \ even = odd numbers below 1000 plus {1000..99999} */
+    assert(aa_difference(seen, even) == 0);
+    assert(aa_len(seen) == 100000 - 500);
+    assert(!aa_contains(seen, "key_0"));
+    assert(aa_contains(seen, "key_1"));
+
+    /* seen & odd = odd numbers below 1000 */
+    assert(aa_intersection(seen, odd) == 0);
+    assert(aa_len(seen) == 500);
+    for (struct aa_node *node = NULL; (node = aa_next(seen));)
+        assert(aa_contains(odd, node->key));
+
+    /* seen | even = {0..999} */
+    assert(aa_union(seen, even) == 0);
+    assert(aa_len(seen) == 1000);
+    assert(aa_contains(seen, "key_0") && aa_contains(seen, "key_999"));
+
+    size_t hash = aa_hash_key("key_42");
+    assert(aa_contains_hashed(seen, hash, "key_42"));
+    assert(aa_remove_hashed(seen, hash, "key_42") == 0);
+    assert(!aa_contains_hashed(seen, hash, "key_42"));
+    assert(aa_insert_hashed(seen, hash, "key_42") == 0);
+    assert(aa_insert_hashed(seen, hash, "key_42") == 1);
+
+    assert(aa_difference(seen, seen) == 0);
+    assert(aa_len(seen) == 0);
+
+    aa_delete(seen);
+    aa_delete(even);
+    aa_delete(odd);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_SET */
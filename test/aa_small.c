@@ -0,0 +1,128 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef TEST_AA_SMALL
+
+#define AA_KEY char *
+#define AA_VALUE size_t
+#define AA_SMALL
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+static double now_s(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static const char *words[] = {"Open", "Save As", "Exit", "Locale", "File", "Edit", "Notepad"};
+enum { WORDS = sizeof(words) / sizeof(*words) };
+static_assert(WORDS <= AA_SMALL_N, "The words fit in a small table");
+
+static bool is_odd(struct aa_node *n, void *ctx) {
+    (void)ctx;
+    return n->value % 2;
+}
+
+/* Builds tables of the words, hashed ones are pushed out of the small layout first */
+static size_t build(struct aa **tables, size_t n, bool hashed) {
+    size_t heap = _Allocated_memory;
+    for (size_t t = 0; t < n; t++) {
+        assert((tables[t] = aa_new()));
+        if (hashed)
+            assert(aa_reserve(tables[t], AA_SMALL_N + 1) == 0);
+        for (size_t i = 0; i < WORDS; i++)
+            assert(aa_set(tables[t], words[i], i) == 0);
+    }
+
+    return _Allocated_memory - heap;
+}
+
+static double lookups(struct aa **tables, size_t n, size_t rounds) {
+    size_t sum = 0;
+    double start = now_s();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t t = 0; t < n; t++) {
+            aa_value_t value;
+            for (size_t i = 0; i < WORDS; i++)
+                sum += aa_get(tables[t], words[i], &value) == 0 ? value : 0;
+            sum += aa_get(tables[t], "Missing", &value) == 0;
+        }
+    }
+    double ns = (now_s() - start) * 1e9 / (double)(rounds * n * (WORDS + 1));
+    assert(sum == rounds * n * (WORDS * (WORDS - 1) / 2));
+
+    return ns;
+}
+
+int main(void) {
+    struct aa *a = aa_new();
+    assert(a);
+
+    /* Up to AA_SMALL_N entries stay in the table itself */
+    for (size_t i = 0; i < WORDS; i++)
+        assert(aa_set(a, words[i], i) == 0);
+    assert(aa_len(a) == WORDS && aa_entries(a) == 0);
+    assert(aa_set(a, "Exit", 20) == 0 && aa_len(a) == WORDS);
+
+    aa_value_t value;
+    assert(aa_get(a, "Exit", &value) == 0 && value == 20);
+    assert(aa_get(a, "Exi", &value) != 0 && aa_get(a, "Exit!", &value) != 0);
+    assert(aa_remove(a, "Save As") == 0 && aa_remove(a, "Save As") != 0);
+    assert(aa_len(a) == WORDS - 1);
+
+    size_t n = 0;
+    for (struct aa_node *node = NULL; (node = aa_next(a));)
+        n++;
+    assert(n == WORDS - 1);
+    assert(aa_remove_if(a, is_odd, NULL) == 2);
+    assert(aa_len(a) == WORDS - 3 && aa_entries(a) == 0);
+    assert(aa_reserve(a, AA_SMALL_N) == 0 && aa_entries(a) == 0);
+
+    /* Past AA_SMALL_N the entries move to a bucket array */
+    char key[32];
+    for (size_t i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "key_%zu", i);
+        assert(aa_set(a, key, i) == 0);
+    }
+    assert(aa_entries(a) > 0 && aa_len(a) == WORDS - 3 + 100);
+    assert(aa_get(a, "Exit", &value) == 0 && value == 20);
+    assert(aa_get(a, "Open", &value) == 0 && value == 0);
+    for (size_t i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "key_%zu", i);
+        assert(aa_get(a, key, &value) == 0 && value == i);
+    }
+
+    /* Emptied, the table is small again */
+    aa_clear(a);
+    assert(aa_len(a) == 0 && aa_entries(a) == 0);
+    assert(aa_set(a, "File", 4) == 0 && aa_entries(a) == 0);
+    aa_delete(a);
+
+    /* Many tiny tables, as with per-locale string tables */
+    enum { TABLES = 20000, ROUNDS = 20 };
+    struct aa **small = fat_malloc(sizeof(struct aa *) * TABLES), **hashed = fat_malloc(sizeof(struct aa *) * TABLES);
+    assert(small && hashed);
+    size_t small_heap = build(small, TABLES, false), hashed_heap = build(hashed, TABLES, true);
+    double small_ns = lookups(small, TABLES, ROUNDS), hashed_ns = lookups(hashed, TABLES, ROUNDS);
+    printf("%-8s %8s %12s\n%-8s %8.1f %12.1f\n%-8s %8.1f %12.1f\n", "", "ns/get", "bytes/table", "small", small_ns,
+           (double)small_heap / TABLES, "hashed", hashed_ns, (double)hashed_heap / TABLES);
+    assert(small_heap < hashed_heap);
+
+    for (size_t t = 0; t < TABLES; t++) {
+        aa_delete(small[t]);
+        aa_delete(hashed[t]);
+    }
+    fat_free(small);
+    fat_free(hashed);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_SMALL */
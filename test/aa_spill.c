@@ -0,0 +1,130 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef TEST_AA_SPILL
+
+#define AA_KEY char *
+#define AA_VALUE size_t
+#define AA_SPILL
+#define AA_SPILL_LOGS 4
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+static double now_s(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static size_t next_random(size_t *state) {
+    *state = *state * 6364136223846793005U + 1442695040888963407U;
+    return *state >> 17;
+}
+
+int main(void) {
+    enum { N = 50000, PARTS = 16, BUDGET = 1 << 19, BATCH = 20000 };
+    char key[32];
+
+    struct aa_spill *s = aa_spill_new(".", PARTS, BUDGET);
+    assert(s);
+
+    /* Several times the budget, the peak stays within it plus one partition */
+    size_t peak = 0;
+    for (size_t i = 0; i < N; i++) {
+        snprintf(key, sizeof(key), "key_%zu", i);
+        assert(aa_spill_set(s, key, i) == 0);
+        if (s->resident > peak)
+            peak = s->resident;
+    }
+    assert(aa_spill_len(s) == N);
+    assert(s->logs <= AA_SPILL_LOGS);
+    printf("Peak of %zu partitions: %zu bytes, budget %d\n", s->nparts, peak, BUDGET);
+    assert(peak <= BUDGET + BUDGET / 2);
+
+    size_t spilled = 0;
+    for (size_t i = 0; i < s->nparts; i++)
+        spilled += s->parts[i].spilled;
+    assert(spilled > 0);
+
+    for (size_t i = 0; i < N; i += 7) {
+        aa_value_t value;
+        snprintf(key, sizeof(key), "key_%zu", i);
+        assert(aa_spill_get(s, key, &value) == 0 && value == i);
+    }
+    assert(aa_spill_get(s, "missing", NULL) != 0);
+
+    for (size_t i = 0; i < N; i += 2) {
+        snprintf(key, sizeof(key), "key_%zu", i);
+        assert(aa_spill_remove(s, key) == 0);
+    }
+    assert(aa_spill_len(s) == N / 2);
+    assert(aa_spill_remove(s, "key_0") != 0);
+
+    /* A record torn by a failed append is dropped when the partition loads */
+    size_t part = 0, odd = 1;
+    assert(aa_spill_out(s, part) == 0 && aa_spill_close_log(s, &s->parts[part]) == 0);
+    FILE *log = aa_spill_open(s, part, "ab");
+    assert(log && fwrite("\x0a" "key", 1, 4, log) == 4 && fclose(log) == 0);
+    for (;; odd += 2) {
+        snprintf(key, sizeof(key), "key_%zu", odd);
+        if (aa_spill_part_of(s, aa_calc_hash(key)) == part)
+            break;
+    }
+    aa_value_t kept;
+    assert(aa_spill_get(s, key, &kept) == 0 && kept == odd);
+    assert(s->parts[part].dirty && aa_spill_len(s) == N / 2);
+
+    /* Batched lookups read each spilled partition once */
+    char **keys = fat_malloc(sizeof(char *) * BATCH);
+    aa_value_t *values = fat_malloc(sizeof(aa_value_t) * BATCH);
+    bool *found = fat_malloc(sizeof(bool) * BATCH);
+    size_t *index = fat_malloc(sizeof(size_t) * BATCH), state = 1;
+    assert(keys && values && found && index);
+    for (size_t i = 0; i < BATCH; i++) {
+        index[i] = next_random(&state) % N;
+        keys[i] = fat_malloc(32);
+        assert(keys[i]);
+        snprintf(keys[i], 32, "key_%zu", index[i]);
+    }
+
+    size_t expect = 0;
+    for (size_t i = 0; i < BATCH; i++)
+        expect += index[i] % 2;
+
+    /* One by one, most lookups load a partition */
+    double start = now_s();
+    size_t hits = 0, singles = BATCH / 100, expect_singles = 0;
+    for (size_t i = 0; i < singles; i++) {
+        hits += aa_spill_get(s, keys[i], NULL) == 0;
+        expect_singles += index[i] % 2;
+    }
+    double single = now_s() - start;
+    assert(hits == expect_singles);
+
+    start = now_s();
+    assert(aa_spill_get_batch(s, keys, BATCH, values, found) == expect);
+    double batch = now_s() - start;
+    for (size_t i = 0; i < BATCH; i++)
+        assert(found[i] == (index[i] % 2 == 1) && (!found[i] || values[i] == index[i]));
+    printf("%-10s %8.2f us/key\n%-10s %8.2f us/key\n", "single", single * 1e6 / (double)singles, "batched",
+           batch * 1e6 / BATCH);
+
+    for (size_t i = 0; i < BATCH; i++)
+        fat_free(keys[i]);
+    fat_free(keys);
+    fat_free(values);
+    fat_free(found);
+    fat_free(index);
+
+    aa_spill_delete(s);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_SPILL */
@@ -0,0 +1,101 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef TEST_AA_TTL
+
+#define AA_KEY char *
+#define AA_VALUE size_t
+#define AA_TTL
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+int main(void) {
+    struct aa *a = aa_new();
+    assert(a);
+
+    /* Start far from zero, the clock is whatever the caller uses */
+    uint64_t now = 1700000000000U;
+    assert(aa_expire(a, now, 0) == 0);
+
+    char key[32];
+    aa_value_t value;
+
+    /* Lifetimes from a tick to far beyond the span of the wheel */
+    for (size_t i = 0; i < 10000; i++) {
+        snprintf(key, sizeof(key), "key_%zu", i);
+        assert(aa_set_ttl(a, key, i, 1 + i * i * 397) == 0);
+    }
+    assert(aa_set(a, "forever", 1) == 0);
+    assert(aa_set_ttl(a, "refreshed", 2, 10) == 0);
+    assert(aa_set_ttl(a, "refreshed", 2, 1000) == 0);
+    assert(aa_set_ttl(a, "made_permanent", 3, 10) == 0);
+    assert(aa_set(a, "made_permanent", 3) == 0);
+    assert(aa_len(a) == 10003);
+
+    /* Setting a key again moves its timer, memory stays as it was */
+    size_t heap = _Allocated_memory;
+    for (size_t i = 0; i < 1000; i++)
+        assert(aa_set_ttl(a, "refreshed", 2, 1000 + i % 10) == 0);
+    assert(_Allocated_memory == heap);
+
+    /* Entries read as misses as soon as they are due, even before removal */
+    assert(aa_expire(a, now + 100, 0) == 0);
+    assert(aa_get(a, "key_0", &value) != 0);
+    assert(aa_get(a, "key_1", &value) == 0 && value == 1);
+    assert(aa_len(a) == 10003);
+
+    /* The budget bounds the entries removed per call */
+    size_t removed = 0;
+    for (size_t i = 0; i < 3; i++) {
+        removed += aa_expire(a, now + 100, 1);
+        assert(aa_len(a) >= 10002);
+    }
+    assert(removed == 1);
+    assert(aa_expire(a, now + 100, 100) == 0);
+    assert(aa_len(a) == 10002);
+
+    assert(aa_expire(a, now + 500, SIZE_MAX) == 1);
+    assert(aa_get(a, "refreshed", &value) == 0);
+    assert(aa_get(a, "made_permanent", &value) == 0);
+
+    /* Walk the clock in uneven steps and compare with the expected survivors */
+    for (uint64_t t = now + 500; t < now + 50000000000U; t += t % 7919 * 3571 + 1) {
+        aa_expire(a, t, SIZE_MAX);
+        for (size_t i = 0; i < 10000; i += 97) {
+            snprintf(key, sizeof(key), "key_%zu", i);
+            bool alive = now + 1 + i * i * 397 > t;
+            assert((aa_get(a, key, &value) == 0) == alive);
+        }
+    }
+    aa_expire(a, now + 50000000000U, SIZE_MAX);
+    assert(aa_len(a) == 2);
+    assert(aa_get(a, "forever", &value) == 0 && value == 1);
+    assert(aa_get(a, "made_permanent", &value) == 0 && value == 3);
+
+    /* A burst due at once is removed a budget at a time */
+    uint64_t later = now + 50000000000U;
+    for (size_t i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "burst_%zu", i);
+        assert(aa_set_ttl(a, key, i, 5) == 0);
+    }
+    assert(aa_expire(a, later + 1000000, 1) == 1);
+    assert(aa_len(a) == 101);
+    assert(aa_expire(a, later + 1000000, 40) == 40);
+    assert(aa_expire(a, later + 1000000, SIZE_MAX) == 59);
+    assert(aa_len(a) == 2);
+
+    /* Pending timers are freed with the table */
+    assert(aa_set_ttl(a, "pending", 4, 1000000) == 0);
+    printf("Heap of a[%zu]: %zu\n", aa_len(a), _Allocated_memory);
+
+    aa_delete(a);
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_TTL */
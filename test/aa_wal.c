@@ -0,0 +1,168 @@
+#include "alloc.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef TEST_AA_WAL
+
+#define AA_KEY char *
+#define AA_VALUE size_t
+#define AA_WAL
+#define AA_IMPLEMENTATION
+#include "aa.h"
+
+#define WAL_PATH "aa_wal_test.log"
+
+static void cleanup(void) {
+    remove(WAL_PATH);
+    remove(WAL_PATH ".snap");
+    remove(WAL_PATH ".snap.tmp");
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void check(struct aa *a, size_t n) {
+    char key[32];
+    aa_value_t value;
+
+    for (size_t i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "key_%zu", i);
+        if (i % 3 == 0)
+            assert(aa_get(a, key, &value) != 0);
+        else {
+            assert(aa_get(a, key, &value) == 0);
+            assert(value == i * 2);
+        }
+    }
+
+    return;
+}
+
+static void fill(struct aa *a, size_t n) {
+    char key[32];
+
+    for (size_t i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "key_%zu", i);
+        assert(aa_set(a, key, i) == 0);
+        assert(aa_set(a, key, i * 2) == 0);
+        if (i % 3 == 0)
+            assert(aa_remove(a, key) == 0);
+    }
+
+    return;
+}
+
+static void bench(const char *name, size_t sync_every, size_t n) {
+    cleanup();
+    struct aa *a = aa_new();
+    assert(a);
+    assert(aa_wal_open(a, WAL_PATH, sync_every) == 0);
+
+    char key[32];
+    double start = now_s();
+    for (size_t i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "key_%zu", i);
+        assert(aa_set(a, key, i) == 0);
+    }
+    assert(aa_wal_sync(a) == 0);
+    printf("%-12s %10.0f ops/s\n", name, (double)n / (now_s() - start));
+
+    aa_delete(a);
+
+    return;
+}
+
+int main(void) {
+    cleanup();
+
+    /* Log only: reopening replays every record */
+    struct aa *a = aa_new();
+    assert(a);
+    assert(aa_wal_open(a, WAL_PATH, 64) == 0);
+    fill(a, 3000);
+    aa_delete(a);
+
+    a = aa_new();
+    assert(aa_wal_open(a, WAL_PATH, 64) == 0);
+    assert(aa_len(a) == 2000);
+    check(a, 3000);
+
+    /* Snapshot plus a log tail, the checkpoint empties the open log */
+    assert(aa_wal_checkpoint(a) == 0);
+    FILE *f = fopen(WAL_PATH, "rb");
+    assert(f && fgetc(f) == EOF);
+    fclose(f);
+    assert(aa_set(a, "tail", 7) == 0);
+    assert(aa_remove(a, "key_1") == 0);
+    aa_delete(a);
+
+    a = aa_new();
+    assert(aa_wal_open(a, WAL_PATH, AA_WAL_SYNC_ALL) == 0);
+    aa_value_t value;
+    assert(aa_get(a, "tail", &value) == 0 && value == 7);
+    assert(aa_get(a, "key_1", &value) != 0);
+    assert(aa_set(a, "key_1", 2) == 0);
+    check(a, 3000);
+    aa_delete(a);
+
+    /* A torn record at the end of the log is dropped */
+    f = fopen(WAL_PATH, "ab");
+    assert(f);
+    fwrite("\x01\x05key", 1, 5, f);
+    fclose(f);
+
+    a = aa_new();
+    assert(aa_wal_open(a, WAL_PATH, AA_WAL_NO_SYNC) == 0);
+    assert(aa_len(a) == 2001);
+    check(a, 3000);
+
+    /* The log is compacted once it outgrows the table */
+    for (size_t i = 0; i < 2 * AA_WAL_COMPACT_MIN; i++)
+        assert(aa_set(a, "hot", i) == 0);
+    assert(a->wal_records < AA_WAL_COMPACT_MIN);
+    aa_delete(a);
+
+    a = aa_new();
+    assert(aa_wal_open(a, WAL_PATH, AA_WAL_NO_SYNC) == 0);
+    assert(aa_get(a, "hot", &value) == 0 && value == 2 * AA_WAL_COMPACT_MIN - 1);
+    check(a, 3000);
+    printf("Heap of a[%zu]: %zu\n", aa_len(a), _Allocated_memory);
+
+    /* A table that lost its log fails writes rather than dropping them */
+    fclose(a->wal);
+    a->wal = NULL;
+    assert(aa_set(a, "lost", 1) != 0 && aa_remove(a, "hot") != 0);
+    aa_delete(a);
+
+    /* Write throughput at each durability level */
+    bench("no sync", AA_WAL_NO_SYNC, 200000);
+    bench("group 1024", 1024, 200000);
+    bench("group 64", 64, 50000);
+    bench("sync all", AA_WAL_SYNC_ALL, 2000);
+
+    struct aa *mem = aa_new();
+    char key[32];
+    double start = now_s();
+    for (size_t i = 0; i < 200000; i++) {
+        snprintf(key, sizeof(key), "key_%zu", i);
+        assert(aa_set(mem, key, i) == 0);
+    }
+    printf("%-12s %10.0f ops/s\n", "in memory", 200000 / (now_s() - start));
+    aa_delete(mem);
+
+    cleanup();
+
+    assert(_Allocated_memory == 0);
+
+    return 0;
+}
+
+#endif /* TEST_AA_WAL */